@@ -0,0 +1,111 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <initializer_list>
+#include <memory>
+#include <new>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+/// A contiguous array allocated in a TArena
+template <typename T>
+struct TArenaArray {
+  T* data = nullptr;
+  std::size_t count = 0;
+
+  T* begin() const { return data; }
+  T* end() const { return data + count; }
+  std::size_t size() const { return count; }
+  bool empty() const { return count == 0; }
+  T& operator[](std::size_t i) const { return data[i]; }
+};
+
+/// A bump allocator: objects are carved out of big blocks one after another
+/// and are all freed at once together with the arena. Destructors are never
+/// run, so whatever lives here must not own memory outside of the arena
+class TArena {
+ public:
+  static constexpr std::size_t BLOCK_SIZE = 64 << 10;
+
+  TArena() = default;
+  TArena(const TArena&) = delete;
+  TArena& operator=(const TArena&) = delete;
+
+  void* Allocate(std::size_t size, std::size_t align) {
+    auto offset = (align - reinterpret_cast<std::uintptr_t>(cur) % align) % align;
+    if (cur == nullptr || static_cast<std::size_t>(end - cur) < offset + size) {
+      NewBlock(size + align);
+      offset = (align - reinterpret_cast<std::uintptr_t>(cur) % align) % align;
+    }
+    auto result = cur + offset;
+    cur = result + size;
+    used += size;
+    return result;
+  }
+
+  template <typename T, typename... Args>
+  T* Make(Args&&... args) {
+    return new (Allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+  }
+
+  /// An uninitialized array, to be filled in by the caller
+  template <typename T>
+  TArenaArray<T> AllocateArray(std::size_t count) {
+    static_assert(std::is_trivially_copyable_v<T>);
+    if (count == 0) {
+      return {};
+    }
+    return {static_cast<T*>(Allocate(sizeof(T) * count, alignof(T))), count};
+  }
+
+  template <typename T>
+  TArenaArray<T> CopyArray(const T* data, std::size_t count) {
+    auto result = AllocateArray<T>(count);
+    if (count != 0) {
+      std::memcpy(result.data, data, sizeof(T) * count);
+    }
+    return result;
+  }
+
+  template <typename T>
+  TArenaArray<T> CopyArray(const std::vector<T>& items) {
+    return CopyArray(items.data(), items.size());
+  }
+
+  template <typename T>
+  TArenaArray<T> CopyArray(std::initializer_list<T> items) {
+    return CopyArray(items.begin(), items.size());
+  }
+
+  std::string_view CopyString(std::string_view str) {
+    auto array = CopyArray(str.data(), str.size());
+    return {array.data, array.count};
+  }
+
+  /// The bytes handed out so far
+  std::size_t BytesUsed() const { return used; }
+
+  /// The bytes taken from the system
+  std::size_t BytesReserved() const { return reserved; }
+
+ private:
+  void NewBlock(std::size_t atLeast) {
+    auto size = std::max(BLOCK_SIZE, atLeast);
+    // NOTE: not make_unique, there is no need to zero the block
+    blocks.emplace_back(new char[size]);
+    cur = blocks.back().get();
+    end = cur + size;
+    reserved += size;
+  }
+
+  std::vector<std::unique_ptr<char[]>> blocks;
+  char* cur = nullptr;
+  char* end = nullptr;
+  std::size_t used = 0;
+  std::size_t reserved = 0;
+};
@@ -0,0 +1,101 @@
+#include "ast.hh"
+
+#include <ostream>
+
+#include <cpputils/common.hh>
+
+#include "flat_ast.hh"
+
+/*******************************************************************************
+ *                                   Printing                                   *
+ *******************************************************************************/
+
+void TPrintVisitor::visit(TNumber* n) {
+  AddIndent();
+  os << utils::Format("TNumber: `%`\n", n->val);
+}
+
+void TPrintVisitor::visit(TString* str) {
+  AddIndent();
+  os << utils::Format("TString: `%`\n", str->val);
+}
+
+void TPrintVisitor::visit(TId* id) {
+  AddIndent();
+  os << utils::Format("TId: `%`\n", id->val);
+}
+
+void TPrintVisitor::visit(TTree* root) {
+  // NOTE: an explicit stack of the trees being printed, the input can nest
+  // deeper than the call stack allows
+  std::vector<std::pair<TTree*, std::size_t>> trees;
+  PrintTree(root);
+  trees.push_back({root, 0});
+  while (!trees.empty()) {
+    auto& [tree, next] = trees.back();
+    if (next == tree->children.size()) {
+      trees.pop_back();
+      indent_level--;
+      continue;
+    }
+    auto child = tree->children[next++];
+    if (auto childTree = child->As<TTree>()) {
+      PrintTree(childTree);
+      trees.push_back({childTree, 0});
+    } else {
+      child->accept(this);
+    }
+  }
+}
+
+void TPrintVisitor::PrintTree(TTree* node) {
+  AddIndent();
+  os << utils::Format("`%` with % children\n", TreeKindName(node->kind), node->children.size());
+  indent_level++;
+}
+
+void TPrintVisitor::AddIndent() {
+  // One write per line, however deep the node is
+  std::size_t width = indent_level * indent.size();
+  while (indents.size() < width) {
+    indents.append(indent);
+  }
+  os.write(indents.data(), width);
+}
+
+void PrintFlatAst(const TFlatAst& ast, std::ostream& os, const char* indent) {
+  // The number of children yet to be printed for every tree above the node
+  std::vector<std::size_t> left;
+  std::string_view step{indent};
+  std::string indents;
+  for (TFlatAst::TIndex node = 0; node < ast.size(); node++) {
+    while (indents.size() < left.size() * step.size()) {
+      indents.append(step);
+    }
+    os.write(indents.data(), left.size() * step.size());
+    std::size_t childCount = 0;
+    switch (ast.Kind(node)) {
+      case ENodeKind::Number:
+        os << utils::Format("TNumber: `%`\n", ast.Number(node));
+        break;
+      case ENodeKind::String:
+        os << utils::Format("TString: `%`\n", ast.String(node));
+        break;
+      case ENodeKind::Id:
+        os << utils::Format("TId: `%`\n", ast.Symbol(node).name);
+        break;
+      case ENodeKind::Tree:
+        childCount = ast.Children(node).size();
+        os << utils::Format("`%` with % children\n", TreeKindName(ast.TreeKind(node)), childCount);
+        break;
+    }
+    if (childCount != 0) {
+      left.push_back(childCount);
+      continue;
+    }
+    // The subtree is over: so are the trees it was the last child of
+    while (!left.empty() && --left.back() == 0) {
+      left.pop_back();
+    }
+  }
+}
@@ -1,16 +1,25 @@
 #pragma once
 
-#include <cpputils/common.hh>
-#include <cpputils/string.hh>
-#include <spdlog/spdlog.h>
-#include <iostream>
+#include <cassert>
+#include <charconv>
+#include <cstdint>
+#include <iosfwd>
 #include <memory>
+#include <optional>
+#include <stdexcept>
 #include <string>
+#include <string_view>
 #include <type_traits>
+#include <unordered_map>
 #include <vector>
 #include <array>
+#include <utility>
 
+#include "arena.hh"
+#include "symbols.hh"
+#include "trace.hh"
 #include "visit.hh"
+#include "writer.hh"
 
 struct TPrintVisitor;
 struct TNameVisitor;
@@ -23,42 +32,113 @@ using TVisitorList = TypeList<TypeList<TPrintVisitor, void>,
 
 using TNode = IVisitable<TVisitorList>;
 
-using TPtr = std::shared_ptr<TNode>;
+/// The nodes are owned by the TArena of the parse, which frees all of them at
+/// once. That's why they only hold views and arrays allocated in the same arena
+using TPtr = TNode*;
+
+/// What a node is, for the code that works with both AST layouts (see
+/// TFlatAst)
+enum class ENodeKind : std::uint8_t {
+  Number,
+  String,
+  Id,
+  Tree,
+};
+
+/// The kind of an interior node, set by the grammar actions. The visitors
+/// switch over it, the names are only used for printing
+enum class ETreeKind {
+  File,
+  Statements,
+  SimpleStmt,
+  IfStmt,
+  ElseStmt,
+  WhileLoop,
+  ForLoop,
+  Condition,
+  Iterator,
+  RangeExpr,
+  Assign,
+  Invoke,
+  Arglist,
+  // binary operators, named after their C counterparts
+  Or,
+  And,
+  Eq,
+  Neq,
+  Less,
+  Greater,
+  Minus,
+  Plus,
+  Mul,
+  // unary operators
+  Not,
+};
+
+constexpr std::string_view TreeKindName(ETreeKind kind) {
+  constexpr std::string_view NAMES[] = {
+      "file", "statements", "simple_stmt", "if_stmt", "else_stmt",
+      "while_loop", "for_loop", "condition", "iterator", "range_expr",
+      "assign", "invoke", "arglist",
+      "||", "&&", "==", "!=", "<", ">", "-", "+", "*",
+      "!",
+  };
+  static_assert(std::size(NAMES) == static_cast<std::size_t>(ETreeKind::Not) + 1);
+  return NAMES[static_cast<std::size_t>(kind)];
+}
 
 struct TTree : TVisitable<TTree, TVisitorList> {
-  template<typename ...Args>
-  TTree(std::string name_, Args&&... children_) : name{std::move(name_)}, children{std::forward<Args>(children_)...} {}
+  TTree(ETreeKind kind_, TArenaArray<TPtr> children_) : kind{kind_}, children{children_} {}
 
-  std::string name;
-  std::vector<TPtr> children;
+  ETreeKind kind;
+  TArenaArray<TPtr> children;
 };
 
 struct TNumber : TVisitable<TNumber, TVisitorList> {
   TNumber(int val_) : val{val_} {}
 
-  static std::shared_ptr<TNumber> make(int val_) {
-    return std::make_shared<TNumber>(val_);
-  }
-
   int val;
 };
 
 struct TString : TVisitable<TString, TVisitorList> {
-  TString(std::string val_) : val{val_} {}
+  /// `val_` must be allocated in the arena of the node (see TArena::CopyString)
+  TString(std::string_view val_) : val{val_} {}
 
-  std::string val;
+  std::string_view val;
 };
 
 struct TId : TVisitable<TId, TVisitorList> {
-  TId(std::string val_) : val{val_} {}
+  TId(TSymbol symbol) : id{symbol.id}, val{symbol.name} {}
 
-  std::string val;
+  TSymbolId id;
+  /// Owned by the TInterner of the parse
+  std::string_view val;
+};
+
+inline TTree* MakeTree(TArena& arena, ETreeKind kind, const std::vector<TPtr>& children) {
+  return arena.Make<TTree>(kind, arena.CopyArray(children));
+}
+
+template <typename... Args>
+TTree* MakeTree(TArena& arena, ETreeKind kind, Args... children) {
+  return arena.Make<TTree>(kind, arena.CopyArray<TPtr>({children...}));
+}
+
+/// A parsed program: the tree, the arena it lives in and the interned names
+/// its TId nodes refer to
+struct TAst {
+  TPtr root;
+  std::shared_ptr<TArena> arena;
+  std::shared_ptr<TInterner> names;
 };
 
 /*******************************************************************************
  *                                  Visitors                                   *
  *******************************************************************************/
 
+/// Prints the tree with its nodes indented by depth (see ast.cc). The
+/// printing is kept out of the header, so that it doesn't pull the streams
+/// into the embedders of libpytoc
 struct TPrintVisitor {
  public:
   TPrintVisitor() = delete;
@@ -66,40 +146,20 @@ struct TPrintVisitor {
       : os{os_}, indent{indent_}, indent_level{0} {}
   TPrintVisitor(const TPrintVisitor&) = default;
 
-  void visit(TNumber* n) {
-    AddIndent();
-    os << utils::Format("TNumber: `%`\n", n->val);
-  }
-
-  void visit(TString* str) {
-    AddIndent();
-    os << utils::Format("TString: `%`\n", str->val);
-  }
-
-  void visit(TId* id) {
-    AddIndent();
-    os << utils::Format("TId: `%`\n", id->val);
-  }
-
-  void visit(TTree* node) {
-    AddIndent();
-    os << utils::Format("`%` with % children\n", node->name, node->children.size());
-    indent_level++;
-    for (auto& c : node->children) {
-      c->accept(this);
-    }
-    indent_level--;
-  }
+  void visit(TNumber* n);
+  void visit(TString* str);
+  void visit(TId* id);
+  void visit(TTree* root);
 
  private:
-  void AddIndent() {
-    for (int i = 0; i < indent_level; i++) {
-      os << indent;
-    }
-  }
+  /// Prints the header of the tree and indents its children
+  void PrintTree(TTree* node);
+
+  void AddIndent();
 
   std::ostream& os;
-  const char* indent;
+  std::string_view indent;
+  std::string indents;
   int indent_level = 0;
 };
 
@@ -110,54 +170,163 @@ struct TNameVisitor {
   std::string visit(TTree*) { return "tree"; }
 };
 
+/// The runtime of the generated programs. stdin is read in large chunks and
+/// the output is collected in a buffer, so a program that reads and prints
+/// millions of values makes few system calls and allocates nothing
 constexpr auto C_TEMPLATE = R"(
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static char __out[1 << 16];
+static size_t __out_len;
+
+static void __flush(void) {
+  size_t done = 0;
+  while (done < __out_len) {
+    ssize_t written = write(STDOUT_FILENO, __out + done, __out_len - done);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("print");
+      abort();
+    }
+    done += written;
+  }
+  __out_len = 0;
+}
 
-const char* input() {
-  static const int MAX_STR_SIZE = 512;
-  char* result = (char*)malloc(MAX_STR_SIZE);
-  if (!result) {
-    perror("input allocation");
-    abort();
+static inline void __write(const char* text, size_t len) {
+  while (len > 0) {
+    if (__out_len == sizeof(__out)) {
+      __flush();
+    }
+    size_t chunk = sizeof(__out) - __out_len;
+    if (chunk > len) {
+      chunk = len;
+    }
+    memcpy(__out + __out_len, text, chunk);
+    __out_len += chunk;
+    text += chunk;
+    len -= chunk;
   }
-  if (!fgets(result, MAX_STR_SIZE, stdin)) {
-    perror("input gets_s");
-    abort();
+}
+
+#define __print_str(literal) __write(literal, sizeof(literal) - 1)
+
+static inline void __print_int(int value) {
+  char digits[16];
+  char* first = digits + sizeof(digits);
+  unsigned magnitude = value < 0 ? 0u - (unsigned)value : (unsigned)value;
+  *--first = '\n';
+  do {
+    *--first = (char)('0' + magnitude % 10);
+    magnitude /= 10;
+  } while (magnitude != 0);
+  if (value < 0) {
+    *--first = '-';
   }
-  return result;
+  __write(first, digits + sizeof(digits) - first);
 }
 
-struct TRange {
-  int from;
-  int to;
-  int step;
-};
+static char __in[1 << 16];
+static size_t __in_pos;
+static size_t __in_len;
+
+/* The next byte of stdin or EOF */
+static inline int __getc(void) {
+  if (__in_pos == __in_len) {
+    /* the prompts must show up before the program waits for the input */
+    __flush();
+    ssize_t len;
+    do {
+      len = read(STDIN_FILENO, __in, sizeof(__in));
+    } while (len < 0 && errno == EINTR);
+    if (len <= 0) {
+      return EOF;
+    }
+    __in_pos = 0;
+    __in_len = len;
+  }
+  return (unsigned char)__in[__in_pos++];
+}
 
-int InRange(const struct TRange* r, int i) {
-  if (r->from == r->to && r->step == 0) {
-    return 0;  // empty range
+static inline void __no_input(void) {
+  __flush();
+  fputs("input: end of file\n", stderr);
+  abort();
+}
+
+/* The line stays valid until the next call */
+const char* input() {
+  static char line[512];
+  size_t len = 0;
+  int c = __getc();
+  if (c == EOF) {
+    __no_input();
   }
-  if (r->from < r->to) {
-    return r->from <= i && i <= r->to;
-  } else {
-    return r->to <= i && i <= r->from;
+  for (; c != EOF; c = __getc()) {
+    if (len + 1 < sizeof(line)) {
+      line[len++] = (char)c;
+    }
+    if (c == '\n') {
+      break;
+    }
   }
+  line[len] = '\0';
+  return line;
 }
 
-int {{vars}};
+/* int(input()) without the copy of the line, parses like atoi */
+static inline int __read_int(void) {
+  int c = __getc();
+  if (c == EOF) {
+    __no_input();
+  }
+  while (c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f') {
+    c = __getc();
+  }
+  int negative = c == '-';
+  if (c == '-' || c == '+') {
+    c = __getc();
+  }
+  unsigned value = 0;
+  for (; c >= '0' && c <= '9'; c = __getc()) {
+    value = value * 10 + (unsigned)(c - '0');
+  }
+  while (c != '\n' && c != EOF) {
+    c = __getc();
+  }
+  return (int)(negative ? 0u - value : value);
+}
 
 int main() {
 {{program}}
+  __flush();
 }
 )";
 
+/// `for ... in range(...)` with a step of a known sign: a plain counted loop
+/// the C compiler can unroll and vectorize. The bounds are computed once, as
+/// `range` does. NOTE: they are declared before the iterator, whose scope
+/// starts right after its declarator: `range(i)` reads the `i` outside
 constexpr auto FOR_TEMPLATE = R"(
-{
-  const struct TRange __{{iterator}}_range = {{range_expr}};
-  for (int {{iterator}} = __{{iterator}}_range.from; InRange(&__{{iterator}}_range, i); i += __{{iterator}}_range.step) {
+for (int __{{iterator}}_from = {{from}}, __{{iterator}}_to = {{to}}, {{iterator}} = __{{iterator}}_from;
+     {{iterator}} {{compare}} __{{iterator}}_to; {{iterator}} += {{step}}) {
+{{statements}}
+}
+)";
+/// The step is only known at runtime: it picks the direction, a zero step
+/// makes an empty range
+constexpr auto FOR_DYNAMIC_TEMPLATE = R"(
+for (int __{{iterator}}_from = {{from}}, __{{iterator}}_to = {{to}}, __{{iterator}}_step = {{step}},
+         {{iterator}} = __{{iterator}}_from;
+     __{{iterator}}_step > 0 ? {{iterator}} < __{{iterator}}_to : __{{iterator}}_step < 0 && {{iterator}} > __{{iterator}}_to;
+     {{iterator}} += __{{iterator}}_step) {
 {{statements}}
-  }
 }
 )";
 
@@ -174,163 +343,639 @@ while ({{condition}}) {
 }
 )";
 
-struct TPyToCVisitor {
-  std::string visit(TNumber* n) {
-    return utils::ToString(n->val);
+/// The {{placeholders}} of the code templates
+enum class ESlot : std::uint8_t {
+  None,
+  Program,
+  Condition,
+  Statements,
+  IfCont,
+  Iterator,
+  From,
+  To,
+  Step,
+  Compare,
+};
+
+constexpr ESlot SlotByName(std::string_view name) {
+  constexpr std::pair<std::string_view, ESlot> SLOTS[] = {
+    {"program", ESlot::Program},
+    {"condition", ESlot::Condition},
+    {"statements", ESlot::Statements},
+    {"if_cont", ESlot::IfCont},
+    {"iterator", ESlot::Iterator},
+    {"from", ESlot::From},
+    {"to", ESlot::To},
+    {"step", ESlot::Step},
+    {"compare", ESlot::Compare},
+  };
+  for (auto [slotName, slot] : SLOTS) {
+    if (slotName == name) {
+      return slot;
+    }
+  }
+  // NOTE: fails the compilation when evaluated in a constant expression
+  throw std::logic_error{"unknown template slot"};
+}
+
+/// A piece of a code template: either literal text or a slot to fill
+struct TTemplateSegment {
+  ESlot slot = ESlot::None;
+  std::string_view text;
+};
+
+/// A code template split at its slots
+template <std::size_t N>
+struct TTemplate {
+  std::array<TTemplateSegment, N> segments;
+
+  constexpr const TTemplateSegment* begin() const { return segments.data(); }
+  constexpr const TTemplateSegment* end() const { return segments.data() + N; }
+};
+
+/// Calls `f` with every segment of `tmpl` in order
+template <typename F>
+constexpr void ForEachSegment(std::string_view tmpl, F&& f) {
+  while (!tmpl.empty()) {
+    auto open = tmpl.find("{{");
+    if (open == std::string_view::npos) {
+      f(TTemplateSegment{ESlot::None, tmpl});
+      return;
+    }
+    auto close = tmpl.find("}}", open);
+    if (close == std::string_view::npos) {
+      throw std::logic_error{"unterminated template slot"};
+    }
+    if (open != 0) {
+      f(TTemplateSegment{ESlot::None, tmpl.substr(0, open)});
+    }
+    f(TTemplateSegment{SlotByName(tmpl.substr(open + 2, close - open - 2)), {}});
+    tmpl.remove_prefix(close + 2);
   }
+}
 
-  std::string visit(TString* s) {
-    return utils::MakeString() << '"' << s->val << '"';
+constexpr std::size_t CountSegments(std::string_view tmpl) {
+  std::size_t count = 0;
+  ForEachSegment(tmpl, [&](TTemplateSegment) { count++; });
+  return count;
+}
+
+/// Splits a template once, at compile time: emitting a construct then only
+/// walks the segments
+template <std::size_t N>
+constexpr TTemplate<N> ParseTemplate(std::string_view tmpl) {
+  TTemplate<N> result{};
+  std::size_t i = 0;
+  ForEachSegment(tmpl, [&](TTemplateSegment segment) { result.segments[i++] = segment; });
+  return result;
+}
+
+constexpr auto C_SEGMENTS = ParseTemplate<CountSegments(C_TEMPLATE)>(C_TEMPLATE);
+constexpr auto FOR_SEGMENTS = ParseTemplate<CountSegments(FOR_TEMPLATE)>(FOR_TEMPLATE);
+constexpr auto FOR_DYNAMIC_SEGMENTS =
+    ParseTemplate<CountSegments(FOR_DYNAMIC_TEMPLATE)>(FOR_DYNAMIC_TEMPLATE);
+constexpr auto IF_SEGMENTS = ParseTemplate<CountSegments(IF_TEMPLATE)>(IF_TEMPLATE);
+constexpr auto WHILE_SEGMENTS = ParseTemplate<CountSegments(WHILE_TEMPLATE)>(WHILE_TEMPLATE);
+
+/// Lets TCGenerator walk the tree of TNode
+struct TTreeLayout {
+  using TNode = TPtr;
+
+  ENodeKind Kind(TPtr node) const {
+    if (node->As<TTree>()) {
+      return ENodeKind::Tree;
+    } else if (node->As<TId>()) {
+      return ENodeKind::Id;
+    } else if (node->As<TNumber>()) {
+      return ENodeKind::Number;
+    }
+    assert(node->As<TString>());
+    return ENodeKind::String;
+  }
+
+  ETreeKind TreeKind(TPtr node) const { return node->As<TTree>()->kind; }
+  int Number(TPtr node) const { return node->As<TNumber>()->val; }
+  std::string_view String(TPtr node) const { return node->As<TString>()->val; }
+
+  TSymbol Symbol(TPtr node) const {
+    auto id = node->As<TId>();
+    return {id->id, id->val};
   }
 
-  std::string visit(TId* id) {
-    return id->val;
+  TArenaArray<TPtr> Children(TPtr node) const {
+    auto tree = node->As<TTree>();
+    return tree ? tree->children : TArenaArray<TPtr>{};
   }
+};
 
-  std::string visit(TTree* t) {
-    spdlog::info("entering {}", t->name);
-    if (t->name == "file") {
-      auto program = JoinChildren(t, "\n");
-      TLevelGuard _guard{&indentLevel};
-      return utils::Replace(C_TEMPLATE, {
-          {"{{vars}}", utils::Join(vars, ", ")},
-          {"{{program}}", AddIndent(program)},
-      });
-    } else if (t->name == "statements") {
-      return JoinChildren(t, "\n");
-    } else if (t->name == "if_stmt") {
-      auto [condition, statements, cont] = VisitChildren<3>(t);
-
-      TLevelGuard _guard{&indentLevel};
-      return utils::Replace(IF_TEMPLATE, {
-          {"{{condition}}", condition},
-          {"{{statements}}", AddIndent(statements)},
-          {"{{if_cont}}", AddIndent(cont)},
-      });
-    } else if (t->name == "else_stmt") {
-      auto [statements] = VisitChildren<1>(t);
-
-      return statements;
-    } else if (t->name == "while_loop") {
-      auto [condition, statements] = VisitChildren<2>(t);
-
-      TLevelGuard _guard{&indentLevel};
-      return utils::Replace(WHILE_TEMPLATE, {
-          {"{{condition}}", condition},
-          {"{{statements}}", AddIndent(statements)},
-      });
-    } else if (t->name == "for_loop") {
-      auto [iterator, range_expr, statements] = VisitChildren<3>(t);
-
-      TLevelGuard _guard{&indentLevel};
-      return utils::Replace(FOR_TEMPLATE, {
-          {"{{iterator}}", iterator},
-          {"{{range_expr}}", range_expr},
-          {"{{statements}}", AddIndent(statements)},
-      });
-    } else if (t->name == "assign") {
-      auto [lhs, rhs] = VisitChildren<2>(t);
-      vars.insert(lhs);
-      spdlog::info("assigning to {}", lhs);
-      return utils::Format("% = %", lhs, rhs);
-    } else if (t->name == "invoke") {
-      auto funcName = t->children[0]->accept(this);
-      auto argTree = dynamic_cast<TTree*>(t->children[1].get());
-      assert(argTree);
-      auto args = ProcessChildren(argTree);
-      if (funcName == "print") {
+/// Streams the C code of an AST to a writer: every byte of the output is
+/// written once, straight to where it belongs. TLayout gives access to the
+/// nodes of one of the layouts (TTreeLayout or TFlatAst).
+/// The nodes are expanded into steps (text, children to visit, blocks to
+/// indent) kept on an explicit stack: the input can nest deeper than the call
+/// stack allows
+template <typename TLayout>
+class TCGenerator {
+ public:
+  using TNode = typename TLayout::TNode;
+
+  TCGenerator(const TLayout& layout_, TBufferedWriter& out_) : layout{layout_}, out{out_} {}
+
+  void Generate(TNode root) {
+    ScopeVariables(root);
+    steps.push_back({EStep::Visit, root, {}});
+    while (!steps.empty()) {
+      auto step = steps.back();
+      steps.pop_back();
+      switch (step.kind) {
+        case EStep::Visit:
+          Expand(step.node);
+          break;
+        case EStep::Text:
+          out.Write(step.text);
+          break;
+        case EStep::Open:
+          out.Open();
+          break;
+        case EStep::Close:
+          out.Close();
+          break;
+      }
+    }
+    out.Finish();
+  }
+
+ private:
+  enum class EStep : std::uint8_t {
+    Visit,
+    Text,
+    Open,
+    Close,
+  };
+
+  struct TStep {
+    EStep kind;
+    TNode node;
+    std::string_view text;
+  };
+
+  /// A block of statements is a file or the body of a compound statement
+  bool IsBlock(TNode node) const {
+    auto kind = layout.TreeKind(node);
+    return kind == ETreeKind::File || kind == ETreeKind::Statements;
+  }
+
+  /// Finds the innermost block around all the uses of every variable. The
+  /// variables become locals, which the C compiler can keep in registers: a
+  /// global may change in any call.
+  /// A variable lives in that block if its first use there is an assignment
+  /// statement, so it never carries a value from one run of the block into
+  /// the next. Otherwise it lives in `main` and starts at 0, like the globals
+  /// it replaces. The declarations are in the order of the first use
+  void ScopeVariables(TNode root) {
+    if (layout.Kind(root) != ENodeKind::Tree) {
+      return;
+    }
+    // NOTE: the root is a block even if it's a part of a statement, so that
+    // all the blocks have a common one
+    mainBlock = root;
+    std::vector<std::pair<TNode, std::size_t>> trees;
+    std::vector<TNode> path;
+    auto enter = [&](TNode node) {
+      trees.push_back({node, 0});
+      if (IsBlock(node) || node == root) {
+        blocks[node] = {path.empty() ? node : path.back(), path.size()};
+        path.push_back(node);
+      }
+    };
+    enter(root);
+    while (!trees.empty()) {
+      auto [node, next] = trees.back();
+      auto children = layout.Children(node);
+      if (next == children.size()) {
+        if (IsBlock(node) || node == root) {
+          path.pop_back();
+        }
+        trees.pop_back();
+        continue;
+      }
+      trees.back().second++;
+      auto child = children[next];
+      if (layout.Kind(child) == ENodeKind::Tree) {
+        enter(child);
+        continue;
+      }
+      auto parent = layout.TreeKind(node);
+      // NOTE: the iterator of a `for` is declared by the loop itself
+      bool name = (parent == ETreeKind::Invoke && next == 0) || parent == ETreeKind::Iterator;
+      if (layout.Kind(child) == ENodeKind::Id && !name) {
+        AddUse(layout.Symbol(child), parent == ETreeKind::Assign && next == 0, trees, path.back());
+      }
+    }
+
+    for (auto& var : symbols.Records()) {
+      if (!var.assigned) {
+        continue;
+      }
+      bool local = var.assignedFirst && var.block == var.firstBlock && var.block != mainBlock;
+      auto& declaration = declarations[local ? var.block : mainBlock];
+      declaration += declaration.empty() ? "int " : ", ";
+      declaration += var.symbol.name;
+      if (!local) {
+        declaration += " = 0";
+      }
+    }
+    for (auto& [_, declaration] : declarations) {
+      declaration += ";";
+    }
+  }
+
+  void AddUse(TSymbol symbol, bool assignment,
+              const std::vector<std::pair<TNode, std::size_t>>& trees, TNode block) {
+    auto [var, inserted] = symbols.TryEmplace(
+        symbol.id, {symbol, false, false, block, block, trees.back().first, trees.size() - 1});
+    if (inserted) {
+      // `x = ...` as a statement of the block
+      auto depth = trees.size();
+      var->assignedFirst = assignment && depth >= 3 &&
+                           layout.TreeKind(trees[depth - 2].first) == ETreeKind::SimpleStmt &&
+                           trees[depth - 3].first == block;
+    } else {
+      var->block = CommonBlock(var->block, block);
+      // A use on the right hand side of the first assignment
+      if (var->firstAssignDepth < trees.size() && trees[var->firstAssignDepth].first == var->firstAssign) {
+        var->assignedFirst = false;
+      }
+    }
+    if (assignment) {
+      var->assigned = true;
+    }
+  }
+
+  TNode CommonBlock(TNode lhs, TNode rhs) const {
+    while (lhs != rhs) {
+      auto& left = blocks.at(lhs);
+      auto& right = blocks.at(rhs);
+      if (left.depth >= right.depth) {
+        lhs = left.parent;
+      } else {
+        rhs = right.parent;
+      }
+    }
+    return lhs;
+  }
+
+  /// Writes the declarations of the block as its first statement
+  template <typename TChildren>
+  void Declare(TNode block, const TChildren& statements) {
+    if (auto it = declarations.find(block); it != declarations.end()) {
+      Text(it->second);
+      if (statements.size() != 0) {
+        Text("\n");
+      }
+    }
+  }
+
+  void Expand(TNode node) {
+    switch (layout.Kind(node)) {
+      case ENodeKind::Number: {
+        char digits[16];
+        auto [end, _] = std::to_chars(std::begin(digits), std::end(digits), layout.Number(node));
+        out.Write({digits, static_cast<std::size_t>(end - digits)});
+        return;
+      }
+      case ENodeKind::String:
+        out.Write("\"");
+        out.Write(layout.String(node));
+        out.Write("\"");
+        return;
+      case ENodeKind::Id:
+        out.Write(layout.Symbol(node).name);
+        return;
+      case ENodeKind::Tree:
+        expansion.clear();
+        ExpandTree(node);
+        // The steps are popped from the back
+        steps.insert(steps.end(), expansion.rbegin(), expansion.rend());
+        return;
+    }
+  }
+
+  void ExpandTree(TNode node) {
+    auto kind = layout.TreeKind(node);
+    auto children = layout.Children(node);
+    PYTOC_TRACE(Codegen, "entering {}", TreeKindName(kind));
+    switch (kind) {
+      case ETreeKind::File:
+        ExpandTemplate(C_SEGMENTS, [&](ESlot) {
+          Open();
+          Declare(node, children);
+          Join(children, "\n");
+          Close();
+        });
+        return;
+      case ETreeKind::Statements:
+        Declare(node, children);
+        Join(children, "\n");
+        return;
+      case ETreeKind::IfStmt:
+        assert(children.size() == 3);
+        ExpandTemplate(IF_SEGMENTS, [&](ESlot slot) {
+          if (slot == ESlot::Condition) {
+            Visit(children[0]);
+          } else {
+            Block(slot == ESlot::Statements ? children[1] : children[2]);
+          }
+        });
+        return;
+      case ETreeKind::WhileLoop:
+        assert(children.size() == 2);
+        ExpandTemplate(WHILE_SEGMENTS, [&](ESlot slot) {
+          if (slot == ESlot::Condition) {
+            Visit(children[0]);
+          } else {
+            Block(children[1]);
+          }
+        });
+        return;
+      case ETreeKind::ForLoop:
+        assert(children.size() == 3);
+        ExpandFor(children[0], layout.Children(children[1])[0], children[2]);
+        return;
+      case ETreeKind::Assign:
+        assert(children.size() == 2);
+        PYTOC_TRACE(Codegen, "assigning to {}", layout.Symbol(children[0]).name);
+        Visit(children[0]);
+        Text(" = ");
+        Visit(children[1]);
+        return;
+      case ETreeKind::Invoke:
+        ExpandInvoke(layout.Symbol(children[0]), layout.Children(children[1]));
+        return;
+      case ETreeKind::Arglist:
+        Join(children, ", ");
+        return;
+      case ETreeKind::SimpleStmt:
+        assert(children.size() == 1);
+        Visit(children[0]);
+        Text(";");
+        return;
+      case ETreeKind::Or:
+      case ETreeKind::And:
+      case ETreeKind::Eq:
+      case ETreeKind::Neq:
+      case ETreeKind::Less:
+      case ETreeKind::Greater:
+      case ETreeKind::Minus:
+      case ETreeKind::Plus:
+      case ETreeKind::Mul:
+        assert(children.size() == 2);
+        Text("(");
+        Visit(children[0]);
+        Text(" ");
+        Text(TreeKindName(kind));
+        Text(" ");
+        Visit(children[1]);
+        Text(")");
+        return;
+      case ETreeKind::Not:
+        assert(children.size() == 1);
+        Text("(! ");
+        Visit(children[0]);
+        Text(")");
+        return;
+      case ETreeKind::ElseStmt:
+      case ETreeKind::Condition:
+      case ETreeKind::Iterator:
+      case ETreeKind::RangeExpr:
+        // a wrapper-node that only has one child
+        assert(children.size() == 1);
+        Visit(children[0]);
+        return;
+    }
+  }
+
+  bool IsInvokeOf(TNode node, TSymbolId func) const {
+    return layout.Kind(node) == ENodeKind::Tree && layout.TreeKind(node) == ETreeKind::Invoke &&
+           layout.Symbol(layout.Children(node)[0]).id == func;
+  }
+
+  /// Only `range(...)` can be iterated over, its arguments become the bounds
+  /// of a counted loop
+  void ExpandFor(TNode iterator, TNode range, TNode statements) {
+    if (!IsInvokeOf(range, builtins::RANGE)) {
+      Text("\n#error \"only range(...) can be iterated over\"\n");
+      return;
+    }
+    auto args = layout.Children(layout.Children(range)[1]);
+    std::optional<TNode> from, to, step;
+    switch (args.size()) {
+      case 1:
+        to = args[0];
+        break;
+      case 2:
+        from = args[0];
+        to = args[1];
+        break;
+      case 3:
+        from = args[0];
+        to = args[1];
+        step = args[2];
+        break;
+      default:
+        break;  // an empty range on invalid call
+    }
+    auto bound = [&](const std::optional<TNode>& arg, std::string_view otherwise) {
+      if (arg) {
+        Visit(*arg);
+      } else {
+        Text(otherwise);
+      }
+    };
+
+    // NOTE: a zero step is left to the runtime check of the dynamic loop
+    int direction = 1;
+    if (step) {
+      direction = layout.Kind(*step) == ENodeKind::Number ? layout.Number(*step) : 0;
+    }
+    PYTOC_TRACE(Codegen, "lowering a for loop with {} step", direction == 0 ? "a dynamic" : "a constant");
+    auto fillSlot = [&](ESlot slot) {
+      switch (slot) {
+        case ESlot::Iterator:
+          Visit(iterator);
+          return;
+        case ESlot::From:
+          bound(from, "0");
+          return;
+        case ESlot::To:
+          bound(to, "0");
+          return;
+        case ESlot::Step:
+          bound(step, "1");
+          return;
+        case ESlot::Compare:
+          Text(direction > 0 ? "<" : ">");
+          return;
+        default:
+          Block(statements);
+          return;
+      }
+    };
+    if (direction == 0) {
+      ExpandTemplate(FOR_DYNAMIC_SEGMENTS, fillSlot);
+    } else {
+      ExpandTemplate(FOR_SEGMENTS, fillSlot);
+    }
+  }
+
+  template <typename TChildren>
+  void ExpandInvoke(TSymbol func, const TChildren& args) {
+    switch (func.id) {
+      case builtins::PRINT:
         assert(args.size() == 1);
-        if (args[0].front() == '"' && args[0].back() == '"') {
-          return utils::Format(R"(printf(%))", args[0]);
+        if (layout.Kind(args[0]) == ENodeKind::String) {
+          Text("__print_str(");
         } else {
-          return utils::Format(R"(printf("\%d\\n", %))", args[0]);
+          Text("__print_int(");
         }
-      } else if (funcName == "int") {
+        Visit(args[0]);
+        Text(")");
+        return;
+      case builtins::INT:
         assert(args.size() == 1);
-        return utils::Format("atoi(%)", args[0]);
-      } else if (funcName == "input") {
+        if (IsInvokeOf(args[0], builtins::INPUT)) {
+          // NOTE: the most common way to read a number, it's parsed right
+          // in the input buffer
+          Text("__read_int()");
+          return;
+        }
+        Text("atoi(");
+        Visit(args[0]);
+        Text(")");
+        return;
+      case builtins::INPUT:
         assert(args.size() == 0);
-        return "input()";
-      } else if (funcName == "range") {
+        Text("input()");
+        return;
+      case builtins::RANGE:
         switch (args.size()) {
           case 1:
-            return utils::Format("{ .from = 0, .to = %, .step = 1 }", args[0]);
+            Text("{ .from = 0, .to = ");
+            Visit(args[0]);
+            Text(", .step = 1 }");
+            return;
           case 2:
-            return utils::Format("{ .from = %, .to = %, .step = 1 }", args[0], args[1]);
+            Text("{ .from = ");
+            Visit(args[0]);
+            Text(", .to = ");
+            Visit(args[1]);
+            Text(", .step = 1 }");
+            return;
           case 3:
-            return utils::Format("{ .from = %, .to = %, .step = % }", args[0], args[1], args[2]);
+            Text("{ .from = ");
+            Visit(args[0]);
+            Text(", .to = ");
+            Visit(args[1]);
+            Text(", .step = ");
+            Visit(args[2]);
+            Text(" }");
+            return;
           default:
-            return "{ .from = 0, .to = 0, .step = 0 }";  // empty range on invalid call
+            Text("{ .from = 0, .to = 0, .step = 0 }");  // empty range on invalid call
+            return;
         }
+      default:
+        Text(func.name);
+        Text("(");
+        Join(args, ", ");
+        Text(")");
+        return;
+    }
+  }
+
+  template <std::size_t N, typename F>
+  void ExpandTemplate(const TTemplate<N>& segments, F&& fillSlot) {
+    for (auto& segment : segments) {
+      if (segment.slot != ESlot::None) {
+        fillSlot(segment.slot);
       } else {
-        return utils::Format("%(%)", funcName, utils::Join(", ", args.begin(), args.end()));
+        Text(segment.text);
       }
-    } else if (t->name == "arglist") {
-      return JoinChildren(t);
-    } else if (t->name == "simple_stmt") {
-      auto [stmt] = VisitChildren<1>(t);
-      return utils::MakeString() << stmt << ";";
-    } else if (utils::OneOf(t->name, {"||", "&&", "==", "!=", "<", ">", "-", "+", "*"})) {
-      // binary operators
-      auto [lhs, rhs] = VisitChildren<2>(t);
-      return utils::Format("(% % %)", lhs, t->name, rhs);
-    } else if (utils::OneOf(t->name, {"!"})) {
-      // unary operators
-      auto [arg] = VisitChildren<1>(t);
-      return utils::Format("(! %)", arg);
-    } else {
-      // else this is a wrapper-node that only has one child
-      auto [unwrapped] = VisitChildren<1>(t);
-      return unwrapped;
     }
   }
 
-private:
-  template<int C>
-  std::array<std::string, C> VisitChildren(TTree* t) {
-    assert(t->children.size() == C);
-    std::array<std::string, C> result;
-    for (int i = 0; i < C; i++) {
-      result[i] = t->children[i]->accept(this);
+  template <typename TChildren>
+  void Join(const TChildren& children, std::string_view sep) {
+    for (std::size_t i = 0; i < children.size(); i++) {
+      if (i != 0) {
+        Text(sep);
+      }
+      Visit(children[i]);
     }
-    return result;
   }
 
-  std::vector<std::string> ProcessChildren(TTree* t) {
-    std::vector<std::string> result(t->children.size());
-    std::transform(t->children.begin(), t->children.end(), result.begin(),
-        [&vis = *this] (TPtr p) { return p->accept(&vis); });
-    return result;
-  }
+  void Visit(TNode node) { expansion.push_back({EStep::Visit, node, {}}); }
+  void Text(std::string_view text) { expansion.push_back({EStep::Text, {}, text}); }
+  void Open() { expansion.push_back({EStep::Open, {}, {}}); }
+  void Close() { expansion.push_back({EStep::Close, {}, {}}); }
 
-  std::string JoinChildren(TTree* t, std::string_view sep = ", ") {
-    auto result = ProcessChildren(t);
-    return utils::Join(sep, result.begin(), result.end());
+  void Block(TNode node) {
+    Open();
+    Visit(node);
+    Close();
   }
 
-  std::string AddIndent(std::string str) {
-    if (str.back() == '\n') {
-      str.pop_back();
-    }
-    constexpr auto newIndent = "\n  ";
-    str.insert(0, "  ");
-    return utils::Replace(str, { {"\n", newIndent} });
-  }
+  const TLayout& layout;
+  TCodeWriter out;
+  struct TVariable {
+    TSymbol symbol;
+    bool assigned;
+    /// The first use is an assignment statement of `firstBlock`
+    bool assignedFirst;
+    TNode firstBlock;
+    /// The innermost block around all the uses
+    TNode block;
+    TNode firstAssign;
+    std::size_t firstAssignDepth;
+  };
 
-  struct TLevelGuard {
-    explicit TLevelGuard(int* level) : levelHolder{level} {
-      (*levelHolder)++;
-    }
+  struct TBlock {
+    /// The root block is its own parent
+    TNode parent;
+    std::size_t depth;
+  };
 
-    ~TLevelGuard() {
-      assert(levelHolder);
-      (*levelHolder)--;
-    }
+  std::unordered_map<TNode, TBlock> blocks;
+  /// Where the variables that start at 0 are declared
+  TNode mainBlock{};
+  /// The variables by id, in the order of the first use
+  TSymbolTable<TVariable> symbols;
+  std::unordered_map<TNode, std::string> declarations;
+  std::vector<TStep> steps;
+  /// The steps of the node being expanded, in order
+  std::vector<TStep> expansion;
+};
 
-  private:
-    int* levelHolder = nullptr;
-  };
+inline void GenerateC(TPtr root, TBufferedWriter& out) {
+  TTreeLayout layout;
+  TCGenerator<TTreeLayout>{layout, out}.Generate(root);
+}
+
+/// Translates a tree or any of its subtrees to a string, see GenerateC to
+/// stream the code instead
+struct TPyToCVisitor {
+  std::string visit(TNumber* n) { return Translate(n); }
+  std::string visit(TString* s) { return Translate(s); }
+  std::string visit(TId* id) { return Translate(id); }
+  std::string visit(TTree* t) { return Translate(t); }
 
-  int indentLevel{1};
-  std::unordered_set<std::string> vars = { "__dummy" };
+private:
+  std::string Translate(TPtr node) {
+    std::string result;
+    {
+      TBufferedWriter out{result};
+      GenerateC(node, out);
+    }
+    return result;
+  }
 };
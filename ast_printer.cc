@@ -1,30 +1,30 @@
 #include <type_traits>
 #include <iostream>
-#include <sstream>
-#include <fstream>
 #include <optional>
 
 #include <spdlog/spdlog.h>
 #include <argparse/argparse.hpp>
 
 #include "driver.hh"
+#include "libpytoc.hh"
+#include "mapped_file.hh"
 #include "parser.hh"
+#include "trace.hh"
 
 TPrintVisitor PV{std::cout, "    "};
 TNameVisitor NV;
 argparse::ArgumentParser program{"parser"};
 
-std::optional<TPtr> DoParse(std::istream& is) {
-    auto lex = std::make_shared<TMyLexer>(&is);
-    auto p = yy::parser{lex.get()};
-    if (program["-v"] == true) {
-      p.set_debug_level(true);
+/// Prints the syntax errors to stderr, returns the AST if there are none
+template <class TTree>
+std::optional<TTree> DoParse(TParsed<TTree> parsed, std::string_view file) {
+    for (auto& error : parsed.errors) {
+      std::cerr << error.Format(file) << '\n';
     }
-    if (auto code = p.parse(); code != 0) {
-      spdlog::error("parser failed with code {}", code);
-      return std::nullopt;
+    if (!parsed.ast) {
+      spdlog::error("parser failed");
     }
-    return lex->ctx.result;
+    return std::move(parsed.ast);
 }
 
 int main(int argc, const char *argv[]) {
@@ -35,8 +35,19 @@ int main(int argc, const char *argv[]) {
   program.add_argument("-f", "--file")
     .help("accept input from this file");
   program.add_argument("-v", "--verbose")
+    .help("enable all of the trace categories")
     .default_value(false)
     .implicit_value(true);
+  program.add_argument("--pipeline")
+    .help("lex the file on a separate thread while parsing it")
+    .default_value(false)
+    .implicit_value(true);
+  program.add_argument("--flat-ast")
+    .help("build the AST in the flat structure-of-arrays layout")
+    .default_value(false)
+    .implicit_value(true);
+  program.add_argument("--trace")
+    .help("comma separated trace categories to enable: lexer, parser, codegen or all");
 
   try {
     program.parse_args(argc, argv);
@@ -45,21 +56,50 @@ int main(int argc, const char *argv[]) {
     return 1;
   }
 
+  unsigned traced = 0;
   if (program["-v"] == true) {  // heh
+    traced = trace::ALL;
+  }
+  if (auto categories = program.present("--trace")) {
+    auto mask = trace::ParseCategories(*categories);
+    if (!mask) {
+      spdlog::error("unknown trace category in `{}`", *categories);
+      return 1;
+    }
+    traced |= *mask;
+  }
+
+  if (traced) {
     spdlog::set_level(spdlog::level::info);
     spdlog::info("enabled verbose logging");
+    if (!PYTOC_TRACING) {
+      spdlog::warn("the trace points were compiled out (ENABLE_TRACING=OFF)");
+    }
   } else {
     spdlog::set_level(spdlog::level::err);
   }
+  trace::Enable(traced);
 
   /****************************************************************************
   *                                 Parsing                                  *
   ****************************************************************************/
 
   if (program.present("-f")) {
-      std::fstream fs{program.get<std::string>("-f")};
-      if (auto res = DoParse(fs)) {
-        res.value()->accept(&PV);
+      // The file is scanned right in the mapping, without reading it through
+      // a stream
+      auto path = program.get<std::string>("-f");
+      auto file = TMappedFile::Open(path);
+      if (!file) {
+        return 1;
+      }
+      TParseOptions parseOptions;
+      parseOptions.pipeline = program["--pipeline"] == true;
+      if (program["--flat-ast"] == true) {
+        if (auto res = DoParse(ParseFlat(file->data(), file->size(), parseOptions), path)) {
+          PrintFlatAst(*res, std::cout);
+        }
+      } else if (auto res = DoParse(Parse(file->data(), file->size(), parseOptions), path)) {
+        res->root->accept(&PV);
       }
   } else {
     // interactive mode
@@ -81,9 +121,8 @@ int main(int argc, const char *argv[]) {
       }
 
       line.push_back('\n');
-      std::stringstream ss{line};
-      if (auto res = DoParse(ss)) {
-        res.value()->accept(&PV);
+      if (auto res = DoParse(Parse(line), {})) {
+        res->root->accept(&PV);
       }
     }
   }
@@ -0,0 +1,236 @@
+#include "batch.hh"
+
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <system_error>
+#include <thread>
+
+#include <spdlog/spdlog.h>
+
+#include "hash.hh"
+#include "mapped_file.hh"
+#include "writer.hh"
+
+namespace fs = std::filesystem;
+
+namespace {
+
+/// The indices dealt out to one thread. Aligned, so that the locks of the
+/// neighbouring threads don't share a cache line
+struct alignas(64) TWorkQueue {
+  std::mutex mutex;
+  std::deque<std::size_t> indices;
+};
+
+/// Writes the whole `text` to `path`
+bool WriteFile(const std::string& path, std::string_view text) {
+  auto out = TBufferedWriter::Open(path);
+  if (!out) {
+    return false;
+  }
+  out->Write(text);
+  return out->Flush();
+}
+
+/// Translates one file, everything it needs is its own or the thread's
+bool TranslateFile(const std::string& input, const TBatchOptions& options, std::optional<TFileCache>& cache,
+                   TBatchStats& stats) {
+  auto file = TMappedFile::Open(input);
+  if (!file) {
+    return false;
+  }
+  stats.inputBytes += file->size();
+  auto output = input + ".c";
+
+  std::string key;
+  if (cache) {
+    // NOTE: the same key as `pytoc --cache`, the entries are shared
+    key = TSha256{}
+              .UpdatePart("c")
+              .UpdatePart(TRANSLATOR_VERSION)
+              .UpdatePart(std::to_string(options.translate.level))
+              .Update(file->view())
+              .HexDigest();
+    auto entry = cache->Find(key);
+    if (auto cached = entry ? TMappedFile::Open(entry->string()) : std::nullopt) {
+      stats.outputBytes += cached->size();
+      return WriteFile(output, cached->view());
+    }
+  }
+
+  auto target = cache ? cache->TempPath().string() : output;
+  auto out = TBufferedWriter::Open(target);
+  if (!out) {
+    return false;
+  }
+  auto errors = Translate(file->data(), file->size(), options.translate, *out);
+  // NOTE: one write per error, so that the errors of the files translated on
+  // different threads don't interleave
+  for (auto& error : errors) {
+    std::cerr << error.Format(input) + "\n";
+  }
+  bool ok = errors.empty() && out->Flush();
+  if (!cache) {
+    if (!ok) {
+      fs::remove(output);
+      return false;
+    }
+    stats.outputBytes += fs::file_size(output);
+    return true;
+  }
+  // NOTE: the output is copied from the temporary file, an entry could be
+  // evicted by another process before it is read
+  auto written = ok ? TMappedFile::Open(target) : std::nullopt;
+  if (!written || !WriteFile(output, written->view())) {
+    fs::remove(target);
+    return false;
+  }
+  stats.outputBytes += written->size();
+  return cache->Insert(key, target).has_value();
+}
+
+}  // namespace
+
+void RunWorkStealing(std::size_t count, unsigned threads,
+                     const std::function<void(std::size_t index, unsigned worker)>& task) {
+  threads = std::max(1u, std::min<unsigned>(threads, std::max<std::size_t>(count, 1)));
+  auto queues = std::make_unique<TWorkQueue[]>(threads);
+  for (std::size_t i = 0; i < count; i++) {
+    queues[i % threads].indices.push_back(i);
+  }
+
+  auto work = [&](unsigned worker) {
+    auto take = [&](unsigned from, bool own) -> std::optional<std::size_t> {
+      std::lock_guard lock{queues[from].mutex};
+      auto& indices = queues[from].indices;
+      if (indices.empty()) {
+        return std::nullopt;
+      }
+      auto index = own ? indices.front() : indices.back();
+      own ? indices.pop_front() : indices.pop_back();
+      return index;
+    };
+    while (true) {
+      auto index = take(worker, true);
+      // NOTE: nothing is queued after the start, so once every queue is seen
+      // empty there's nothing left to steal
+      for (unsigned i = 1; !index && i < threads; i++) {
+        index = take((worker + i) % threads, false);
+      }
+      if (!index) {
+        return;
+      }
+      task(*index, worker);
+    }
+  };
+
+  std::vector<std::thread> pool;
+  for (unsigned worker = 1; worker < threads; worker++) {
+    pool.emplace_back(work, worker);
+  }
+  work(0);
+  for (auto& thread : pool) {
+    thread.join();
+  }
+}
+
+std::optional<std::vector<std::string>> CollectBatch(const std::vector<std::string>& paths,
+                                                     const std::vector<std::string>& manifests) {
+  std::vector<std::string> files;
+  for (auto& path : paths) {
+    std::error_code error;
+    if (!fs::is_directory(path, error)) {
+      files.push_back(path);
+      continue;
+    }
+    for (auto it = fs::recursive_directory_iterator{path, error}; !error && it != fs::recursive_directory_iterator{};
+         it.increment(error)) {
+      if (it->path().extension() == ".py" && it->is_regular_file()) {
+        files.push_back(it->path().string());
+      }
+    }
+    if (error) {
+      spdlog::error("can't list {}: {}", path, error.message());
+      return std::nullopt;
+    }
+  }
+  for (auto& manifest : manifests) {
+    std::ifstream in{manifest};
+    if (!in) {
+      spdlog::error("can't open the manifest {}", manifest);
+      return std::nullopt;
+    }
+    for (std::string line; std::getline(in, line);) {
+      if (!line.empty()) {
+        files.push_back(std::move(line));
+      }
+    }
+  }
+  return files;
+}
+
+TBatchStats TranslateBatch(const std::vector<std::string>& files, const TBatchOptions& options) {
+  auto start = std::chrono::steady_clock::now();
+  auto jobs = options.jobs ? options.jobs : std::max(1u, std::thread::hardware_concurrency());
+
+  // The largest files go first, so that the last ones to finish are short
+  std::vector<std::pair<std::uint64_t, std::size_t>> order;
+  for (std::size_t i = 0; i < files.size(); i++) {
+    std::error_code error;
+    auto size = fs::file_size(files[i], error);
+    order.push_back({error ? 0 : size, i});
+  }
+  std::sort(order.begin(), order.end(), std::greater<>{});
+
+  struct alignas(64) TWorker {
+    std::optional<TFileCache> cache;
+    TBatchStats stats;
+  };
+  std::vector<TWorker> workers(jobs);
+  if (options.cacheDir) {
+    auto cache = TFileCache::Open(*options.cacheDir, options.cacheBytes);
+    if (!cache) {
+      TBatchStats failed;
+      failed.files = failed.failed = files.size();
+      return failed;
+    }
+    // Every thread counts its own hits and misses
+    for (auto& worker : workers) {
+      worker.cache = cache;
+    }
+  }
+
+  RunWorkStealing(order.size(), jobs, [&](std::size_t index, unsigned worker) {
+    auto& input = files[order[index].second];
+    auto& [cache, stats] = workers[worker];
+    stats.files++;
+    if (!TranslateFile(input, options, cache, stats)) {
+      spdlog::error("failed to translate {}", input);
+      stats.failed++;
+    }
+  });
+
+  TBatchStats total;
+  total.jobs = jobs;
+  for (auto& [cache, stats] : workers) {
+    total.files += stats.files;
+    total.failed += stats.failed;
+    total.inputBytes += stats.inputBytes;
+    total.outputBytes += stats.outputBytes;
+    if (cache) {
+      total.cache.hits += cache->Stats().hits;
+      total.cache.misses += cache->Stats().misses;
+      cache->SaveStats();
+    }
+  }
+  if (workers[0].cache) {
+    workers[0].cache->Evict();
+  }
+  total.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  return total;
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "cache.hh"
+#include "libpytoc.hh"
+
+/*******************************************************************************
+ *                                Work stealing                                 *
+ *******************************************************************************/
+
+/// Runs `task(index, worker)` for every index in [0, count) on `threads`
+/// threads, the calling one included. The indices are dealt out to the
+/// threads up front, a thread takes its own from the front and, once it runs
+/// out, steals from the back of the others. So a few large files at the start
+/// don't leave the rest of the threads idle. `worker` is in [0, threads), the
+/// task can keep its per-thread state by it
+void RunWorkStealing(std::size_t count, unsigned threads,
+                     const std::function<void(std::size_t index, unsigned worker)>& task);
+
+/*******************************************************************************
+ *                                    Batch                                     *
+ *******************************************************************************/
+
+struct TBatchOptions {
+  TTranslateOptions translate;
+  /// The number of threads, all of the cores if 0
+  unsigned jobs = 0;
+  /// The translations are looked up in and stored into `cacheDir` if set
+  std::optional<std::filesystem::path> cacheDir;
+  std::uint64_t cacheBytes = 0;
+};
+
+struct TBatchStats {
+  std::size_t files = 0;
+  std::size_t failed = 0;
+  std::uint64_t inputBytes = 0;
+  std::uint64_t outputBytes = 0;
+  unsigned jobs = 0;
+  double seconds = 0;
+  TFileCache::TStats cache;
+};
+
+/// The paths to translate: the files as they are, the `*.py` files anywhere
+/// under the directories and the lines of the manifests (one path per line).
+/// Logs the reason and returns nullopt if any of them can't be read
+std::optional<std::vector<std::string>> CollectBatch(const std::vector<std::string>& paths,
+                                                     const std::vector<std::string>& manifests);
+
+/// Translates every file into `<file>.c` next to it, in parallel. Every file
+/// is translated on its own: a failed one is reported (with its name in the
+/// locations of the syntax errors) and doesn't stop the rest
+TBatchStats TranslateBatch(const std::vector<std::string>& files, const TBatchOptions& options);
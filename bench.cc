@@ -0,0 +1,628 @@
+// Throughput benchmarks for the translator. Run without arguments to execute
+// all of them or pass the names of the benchmarks you are interested in
+// (`--mib=N` changes the size of the generated input).
+// The numbers only make sense for release builds
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include <sys/resource.h>
+
+#include <spdlog/spdlog.h>
+
+#include "arena.hh"
+#include "batch.hh"
+#include "driver.hh"
+#include "flat_ast.hh"
+#include "ir.hh"
+#include "linescan.hh"
+#include "mapped_file.hh"
+#include "optimize.hh"
+#include "parser.hh"
+#include "trace.hh"
+#include "visit.hh"
+#include "vm.hh"
+#include "writer.hh"
+
+namespace {
+
+constexpr std::size_t DEFAULT_INPUT_MIB = 32;
+constexpr int ITERATIONS = 5;
+
+/// A syntactically valid program of at least `bytes` bytes that uses every
+/// construct of the language
+std::string GenerateProgram(std::size_t bytes) {
+  std::string result;
+  for (int i = 0; result.size() < bytes; i++) {
+    auto n = std::to_string(i);
+    result += "a" + n + " = int(input())\n";
+    result += "for i in range(1, " + n + "):\n";
+    result += "    if a" + n + " + i > 5 and not i == 3:\n";
+    result += "        print(a" + n + " * i)\n";
+    result += "    elif i < 2:\n";
+    result += "        print(\"small\")\n";
+    result += "    else:\n";
+    result += "        b = a" + n + " - 1\n";
+    result += "\n";
+    result += "while b < 100:\n";
+    result += "    b = b + 1\n";
+  }
+  return result;
+}
+
+/// The generated program lives in a temporary file during the run, so that
+/// the benchmarks also pay for getting the bytes from the file system
+struct TInputFile {
+  explicit TInputFile(std::size_t bytes)
+      : path{std::filesystem::temp_directory_path() / "pytoc_bench.py"} {
+    auto program = GenerateProgram(bytes);
+    std::ofstream{path} << program;
+    size = program.size();
+  }
+
+  ~TInputFile() { std::filesystem::remove(path); }
+
+  std::filesystem::path path;
+  std::size_t size;
+};
+
+/// The best of ITERATIONS runs of `f` in seconds
+double Measure(const std::function<void()>& f) {
+  double best = 1e100;
+  for (int i = 0; i < ITERATIONS; i++) {
+    auto start = std::chrono::steady_clock::now();
+    f();
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    best = std::min(best, elapsed.count());
+  }
+  return best;
+}
+
+/// Prints the throughput of `f` that processes `bytes` bytes
+void Report(std::string_view name, std::size_t bytes, const std::function<void()>& f) {
+  auto best = Measure(f);
+  std::printf("%-24s %10.2f MiB/s  %10.2f ms\n", std::string{name}.c_str(),
+              bytes / best / (1 << 20), best * 1e3);
+}
+
+/// Prints the time per item of `f` that processes `items` items
+void ReportPerItem(std::string_view name, std::size_t items, const std::function<void()>& f) {
+  auto best = Measure(f);
+  std::printf("%-24s %10.3f ns/item %8.2f ms\n", std::string{name}.c_str(),
+              best / items * 1e9, best * 1e3);
+}
+
+void LexAll(TMyLexer& lex) {
+  for (auto res = lex.mylex(); res.type != yy::parser::token_kind_type::YYEOF; res = lex.mylex()) {
+  }
+}
+
+void ParseAll(TMyLexer& lex) {
+  yy::parser p{&lex};
+  if (p.parse() != 0) {
+    spdlog::error("the generated program doesn't parse");
+    std::abort();
+  }
+}
+
+/*******************************************************************************
+ *                              Visitor dispatch                               *
+ *******************************************************************************/
+
+/// The dispatch visit.hh used to have: a virtual `accept` per visitor
+/// signature and a dynamic_cast to the node type on every call. Kept here only
+/// to compare against
+namespace legacy {
+
+template <typename TVisitor>
+struct IVisitable {
+  virtual ~IVisitable() = default;
+  virtual int accept(TVisitor* visitor) = 0;
+};
+
+template <typename T, typename TVisitor>
+struct TVisitable : IVisitable<TVisitor> {
+  int accept(TVisitor* visitor) override {
+    return visitor->visit(dynamic_cast<T*>(this));
+  }
+};
+
+}  // namespace legacy
+
+template <template <typename, typename> typename TVisitableT, typename TVisitor>
+struct TDispatchNodes {
+  struct TA : TVisitableT<TA, TVisitor> { int val = 1; };
+  struct TB : TVisitableT<TB, TVisitor> { int val = 2; };
+  struct TC : TVisitableT<TC, TVisitor> { int val = 3; };
+  struct TD : TVisitableT<TD, TVisitor> { int val = 4; };
+};
+
+struct TLegacySumVisitor;
+using TLegacyNodes = TDispatchNodes<legacy::TVisitable, TLegacySumVisitor>;
+
+struct TLegacySumVisitor {
+  int visit(TLegacyNodes::TA* n) { return n->val; }
+  int visit(TLegacyNodes::TB* n) { return n->val; }
+  int visit(TLegacyNodes::TC* n) { return n->val; }
+  int visit(TLegacyNodes::TD* n) { return -n->val; }
+};
+
+struct TSumVisitor;
+template <typename T, typename TVisitor>
+using TStaticVisitable = TVisitable<T, TypeList<TypeList<TVisitor, int>>>;
+using TStaticNodes = TDispatchNodes<TStaticVisitable, TSumVisitor>;
+
+struct TSumVisitor {
+  int visit(TStaticNodes::TA* n) { return n->val; }
+  int visit(TStaticNodes::TB* n) { return n->val; }
+  int visit(TStaticNodes::TC* n) { return n->val; }
+  int visit(TStaticNodes::TD* n) { return -n->val; }
+};
+
+/// Visits `count` nodes of random types, allocated in `arena`
+template <typename TNodes, typename TBase, typename TVisitor>
+void ReportDispatch(std::string_view name, std::size_t count) {
+  TArena arena;
+  std::vector<TBase*> nodes;
+  std::mt19937 gen{42};
+  for (std::size_t i = 0; i < count; i++) {
+    switch (gen() % 4) {
+      case 0: nodes.push_back(arena.Make<typename TNodes::TA>()); break;
+      case 1: nodes.push_back(arena.Make<typename TNodes::TB>()); break;
+      case 2: nodes.push_back(arena.Make<typename TNodes::TC>()); break;
+      default: nodes.push_back(arena.Make<typename TNodes::TD>()); break;
+    }
+  }
+  volatile int sink = 0;
+  ReportPerItem(name, count, [&] {
+    TVisitor visitor;
+    int sum = 0;
+    for (auto node : nodes) {
+      sum += node->accept(&visitor);
+    }
+    sink = sink + sum;
+  });
+}
+
+/*******************************************************************************
+ *                                 Benchmarks                                  *
+ *******************************************************************************/
+
+void BenchInput(const TInputFile& input) {
+  Report("lex/stream", input.size, [&] {
+    std::ifstream fs{input.path};
+    TMyLexer lex{&fs};
+    LexAll(lex);
+  });
+  Report("lex/mmap", input.size, [&] {
+    auto file = TMappedFile::Open(input.path);
+    TMyLexer lex{file->data(), file->size()};
+    LexAll(lex);
+  });
+  Report("parse/stream", input.size, [&] {
+    std::ifstream fs{input.path};
+    TMyLexer lex{&fs};
+    ParseAll(lex);
+  });
+  Report("parse/mmap", input.size, [&] {
+    auto file = TMappedFile::Open(input.path);
+    TMyLexer lex{file->data(), file->size()};
+    ParseAll(lex);
+  });
+  Report("parse/pipelined", input.size, [&] {
+    auto file = TMappedFile::Open(input.path);
+    TMyLexer lex{file->data(), file->size()};
+    lex.RunAhead();
+    ParseAll(lex);
+  });
+}
+
+void BenchLineScan(const TInputFile& input) {
+  auto file = TMappedFile::Open(input.path);
+  volatile std::size_t sink = 0;
+  Report("linescan/scalar", input.size, [&] {
+    sink = sink + detail::ScanLinesScalar(file->view()).size();
+  });
+  Report("linescan", input.size, [&] {
+    sink = sink + ScanLines(file->view()).size();
+  });
+}
+
+/// Run it for both ENABLE_TRACING=ON and OFF builds: when the trace points
+/// are compiled out, `trace/site` must take as long as `trace/baseline` and
+/// `translate` must not get any slower
+void BenchTrace(const TInputFile& input) {
+  std::printf("trace points are compiled %s\n", PYTOC_TRACING ? "in" : "out");
+
+  constexpr std::size_t SITES = 100'000'000;
+  volatile std::size_t sink = 0;
+  ReportPerItem("trace/baseline", SITES, [&] {
+    for (std::size_t i = 0; i < SITES; i++) {
+      sink = sink + i;
+    }
+  });
+  ReportPerItem("trace/site", SITES, [&] {
+    for (std::size_t i = 0; i < SITES; i++) {
+      PYTOC_TRACE(Codegen, "iteration {}", i);
+      sink = sink + i;
+    }
+  });
+
+  Report("translate", input.size, [&] {
+    auto file = TMappedFile::Open(input.path);
+    TMyLexer lex{file->data(), file->size()};
+    ParseAll(lex);
+    TPyToCVisitor visitor;
+    sink = sink + lex.ctx.result->accept(&visitor).size();
+  });
+}
+
+/// The memory footprint of the AST: the arena usage and the peak RSS of the
+/// process (the RSS includes the mapped input and never goes down)
+void BenchAst(const TInputFile& input) {
+  Report("parse/ast", input.size, [&] {
+    auto file = TMappedFile::Open(input.path);
+    TMyLexer lex{file->data(), file->size()};
+    ParseAll(lex);
+  });
+
+  auto file = TMappedFile::Open(input.path);
+  TMyLexer lex{file->data(), file->size()};
+  ParseAll(lex);
+  std::printf("arena: %.2f MiB used, %.2f MiB reserved\n",
+              lex.ctx.arena->BytesUsed() / double(1 << 20),
+              lex.ctx.arena->BytesReserved() / double(1 << 20));
+
+  rusage usage{};
+  getrusage(RUSAGE_SELF, &usage);
+  std::printf("peak rss: %.2f MiB\n", usage.ru_maxrss / 1024.0);
+}
+
+/// The pointer tree against TFlatAst: building, printing and translating
+void BenchFlatAst(const TInputFile& input) {
+  auto file = TMappedFile::Open(input.path);
+  auto parseFlat = [&] {
+    TMyLexer lex{file->data(), file->size()};
+    lex.ctx.flat = std::make_unique<TFlatAstBuilder>();
+    ParseAll(lex);
+    return std::move(*lex.ctx.flat).Build(lex.ctx.flatRoot, lex.ctx.names);
+  };
+  Report("parse/flat", input.size, [&] { parseFlat(); });
+
+  TMyLexer lex{file->data(), file->size()};
+  ParseAll(lex);
+  auto flat = parseFlat();
+  std::printf("flat ast: %zu nodes\n", flat.size());
+
+  volatile std::size_t sink = 0;
+  Report("print/tree", input.size, [&] {
+    std::stringstream ss;
+    TPrintVisitor visitor{ss};
+    lex.ctx.result->accept(&visitor);
+    sink = sink + ss.tellp();
+  });
+  Report("print/flat", input.size, [&] {
+    std::stringstream ss;
+    PrintFlatAst(flat, ss);
+    sink = sink + ss.tellp();
+  });
+  Report("codegen/tree", input.size, [&] {
+    TPyToCVisitor visitor;
+    sink = sink + lex.ctx.result->accept(&visitor).size();
+  });
+  Report("codegen/flat", input.size, [&] {
+    sink = sink + TFlatPyToC{flat}.Translate().size();
+  });
+}
+
+/// The cost of a single `accept`, the input file is not used
+void BenchDispatch(const TInputFile&) {
+  constexpr std::size_t NODES = 10'000'000;
+  ReportDispatch<TLegacyNodes, legacy::IVisitable<TLegacySumVisitor>, TLegacySumVisitor>(
+      "dispatch/dynamic_cast", NODES);
+  ReportDispatch<TStaticNodes, IVisitable<TypeList<TypeList<TSumVisitor, int>>>, TSumVisitor>(
+      "dispatch/static", NODES);
+}
+
+/*******************************************************************************
+ *                               Generated loops                               *
+ *******************************************************************************/
+
+constexpr int LOOP_N = 10'000;
+
+/// Nested loops over `range` the C compiler can make fast, or not
+constexpr auto LOOP_PROGRAM = R"(n = int(input())
+s = 0
+for i in range(n):
+    for j in range(0, n, 1):
+        s = s + i * j - j
+print(s)
+)";
+
+/// LOOP_PROGRAM in the form FOR_TEMPLATE used to have: a struct TRange and an
+/// InRange call per iteration. Kept here only to compare against. NOTE:
+/// InRange included the bound, so the loops are given n - 1
+constexpr auto LEGACY_LOOP_C = R"(#include <stdio.h>
+#include <stdlib.h>
+
+struct TRange {
+  int from;
+  int to;
+  int step;
+};
+
+int InRange(const struct TRange* r, int i) {
+  if (r->from == r->to && r->step == 0) {
+    return 0;  // empty range
+  }
+  if (r->from < r->to) {
+    return r->from <= i && i <= r->to;
+  } else {
+    return r->to <= i && i <= r->from;
+  }
+}
+
+int __dummy, n, s;
+
+int main() {
+  char line[64];
+  n = atoi(fgets(line, sizeof(line), stdin));
+  s = 0;
+  {
+    const struct TRange __i_range = { .from = 0, .to = n - 1, .step = 1 };
+    for (int i = __i_range.from; InRange(&__i_range, i); i += __i_range.step) {
+      {
+        const struct TRange __j_range = { .from = 0, .to = n - 1, .step = 1 };
+        for (int j = __j_range.from; InRange(&__j_range, j); j += __j_range.step) {
+          s = ((s + (i * j)) - j);
+        }
+      }
+    }
+  }
+  printf("%d\n", s);
+}
+)";
+
+constexpr int IO_VALUES = 2'000'000;
+
+/// Reads and prints a number per iteration
+constexpr auto IO_PROGRAM = R"(n = int(input())
+for i in range(n):
+    x = int(input())
+    print(x * 2 - i)
+)";
+
+/// IO_PROGRAM with the runtime C_TEMPLATE used to have: a malloc per input(),
+/// atoi and a printf per print. Kept here only to compare against
+constexpr auto LEGACY_IO_C = R"(#include <stdio.h>
+#include <stdlib.h>
+
+const char* input() {
+  static const int MAX_STR_SIZE = 512;
+  char* result = (char*)malloc(MAX_STR_SIZE);
+  if (!result) {
+    perror("input allocation");
+    abort();
+  }
+  if (!fgets(result, MAX_STR_SIZE, stdin)) {
+    perror("input gets_s");
+    abort();
+  }
+  return result;
+}
+
+int __dummy, n, x;
+
+int main() {
+  n = atoi(input());
+  for (int i = 0, __i_to = n; i < __i_to; i += 1) {
+    x = atoi(input());
+    printf("%d\n", ((x * 2) - i));
+  }
+}
+)";
+
+/// Translates a program the way pytoc does
+std::string TranslateToC(std::string_view program) {
+  std::stringstream ss{std::string{program}};
+  TMyLexer lex{&ss};
+  ParseAll(lex);
+  auto ast = FoldConstants(TAst{lex.ctx.result, lex.ctx.arena, lex.ctx.names});
+  std::string code;
+  {
+    TBufferedWriter out{code};
+    GenerateC(ast.root, out);
+  }
+  return code;
+}
+
+/// Compiles `code` with the system C compiler ($CC or cc) into `binary`
+bool CompileC(const std::filesystem::path& binary, std::string_view code) {
+  auto source = binary;
+  source += ".c";
+  std::ofstream{source} << code;
+  const char* cc = std::getenv("CC");
+  auto command = std::string{cc ? cc : "cc"} + " -O2 -w -o " + binary.string() + " " + source.string();
+  if (std::system(command.c_str()) != 0) {
+    spdlog::error("`{}` failed", command);
+    return false;
+  }
+  return true;
+}
+
+/// Prints the run time per item of the binaries compiled from the legacy and
+/// the current C code, `inputText` is fed to their stdin
+void ReportGenerated(std::string_view name, std::string_view legacyCode, std::string_view code,
+                     std::string_view inputText, std::size_t items) {
+  auto dir = std::filesystem::temp_directory_path();
+  auto legacy = dir / "pytoc_bench_legacy";
+  auto current = dir / "pytoc_bench_current";
+  auto input = dir / "pytoc_bench_stdin";
+  std::ofstream{input} << inputText;
+  if (CompileC(legacy, legacyCode) && CompileC(current, code)) {
+    auto run = [&](const std::filesystem::path& binary) {
+      auto command = binary.string() + " < " + input.string() + " > /dev/null";
+      if (std::system(command.c_str()) != 0) {
+        spdlog::error("`{}` failed", command);
+      }
+    };
+    ReportPerItem(std::string{name} + "/legacy", items, [&] { run(legacy); });
+    ReportPerItem(std::string{name} + "/current", items, [&] { run(current); });
+  }
+  for (auto& path : {legacy, current, input}) {
+    std::filesystem::remove(path);
+    std::filesystem::remove(path.string() + ".c");
+  }
+}
+
+/// The run time of the generated binaries per loop iteration, with the loops
+/// lowered the old way and to counted C loops. Needs a C compiler, the input
+/// file is not used
+void BenchLoops(const TInputFile&) {
+  ReportGenerated("loops", LEGACY_LOOP_C, TranslateToC(LOOP_PROGRAM),
+                  std::to_string(LOOP_N) + "\n", std::size_t{LOOP_N} * LOOP_N);
+}
+
+/// The values IO_PROGRAM reads, the first one is their count
+std::string IoInput(int count) {
+  std::string values = std::to_string(count) + "\n";
+  std::mt19937 random{42};
+  for (int i = 0; i < count; i++) {
+    values += std::to_string(static_cast<int>(random() % 2'000'000) - 1'000'000) + "\n";
+  }
+  return values;
+}
+
+/// The run time of the generated binaries per value read and printed, with
+/// the old and the buffered runtime. Needs a C compiler, the input file is not
+/// used
+void BenchIo(const TInputFile&) {
+  ReportGenerated("io", LEGACY_IO_C, TranslateToC(IO_PROGRAM), IoInput(IO_VALUES), IO_VALUES);
+}
+
+/// Runs a program from its source the two ways pytoc can: translated and
+/// compiled with the C compiler, and in the bytecode VM. Every run pays for the
+/// whole way from the source, the VM parses the program again as well
+void ReportRun(std::string_view name, std::string_view program, std::string_view inputText,
+               std::size_t items) {
+  auto dir = std::filesystem::temp_directory_path();
+  auto binary = dir / "pytoc_bench_run";
+  auto input = dir / "pytoc_bench_stdin";
+  std::ofstream{input} << inputText;
+  ReportPerItem(std::string{name} + "/cc", items, [&] {
+    if (!CompileC(binary, TranslateToC(program))) {
+      return;
+    }
+    auto command = binary.string() + " < " + input.string() + " > /dev/null";
+    if (std::system(command.c_str()) != 0) {
+      spdlog::error("`{}` failed", command);
+    }
+  });
+  ReportPerItem(std::string{name} + "/vm", items, [&] {
+    std::stringstream ss{std::string{program}};
+    TMyLexer lex{&ss};
+    ParseAll(lex);
+    auto ast = FoldConstants(TAst{lex.ctx.result, lex.ctx.arena, lex.ctx.names});
+    auto ir = LowerToIr(ast.root);
+    OptimizeIr(ir);
+    auto bytecode = CompileBytecode(ir);
+    auto out = TBufferedWriter::Open("/dev/null");
+    TVmInput in{inputText};
+    if (!bytecode || !out || !RunBytecode(*bytecode, in, *out)) {
+      spdlog::error("the VM failed to run {}", name);
+    }
+  });
+  for (auto& path : {binary, input}) {
+    std::filesystem::remove(path);
+  }
+  std::filesystem::remove(binary.string() + ".c");
+}
+
+/// The VM against the C compiler on a short job, where compiling costs more
+/// than running, and on the long ones of BenchLoops and BenchIo. Needs a C
+/// compiler, the input file is not used
+void BenchVm(const TInputFile&) {
+  constexpr int SHORT_VALUES = 100;
+  ReportRun("vm/short", IO_PROGRAM, IoInput(SHORT_VALUES), SHORT_VALUES);
+  ReportRun("vm/loops", LOOP_PROGRAM, std::to_string(LOOP_N) + "\n", std::size_t{LOOP_N} * LOOP_N);
+  ReportRun("vm/io", IO_PROGRAM, IoInput(IO_VALUES), IO_VALUES);
+}
+
+/// Translates the input split into many files on 1, 2, 4... threads up to
+/// the number of cores, the way `pytoc <dir>` does
+void BenchBatch(const TInputFile& input) {
+  constexpr std::size_t FILES = 256;
+  auto dir = std::filesystem::temp_directory_path() / "pytoc_bench_batch";
+  std::filesystem::create_directories(dir);
+  std::vector<std::string> files;
+  auto program = GenerateProgram(input.size / FILES);
+  for (std::size_t i = 0; i < FILES; i++) {
+    files.push_back((dir / (std::to_string(i) + ".py")).string());
+    std::ofstream{files.back()} << program;
+  }
+  auto cores = std::max(1u, std::thread::hardware_concurrency());
+  // NOTE: with one core there's nothing to scale, only j1 is measured
+  std::printf("cores: %u\n", cores);
+  for (unsigned jobs = 1;; jobs = std::min(jobs * 2, cores)) {
+    TBatchOptions options;
+    options.jobs = jobs;
+    Report("batch/j" + std::to_string(jobs), program.size() * FILES, [&] {
+      if (TranslateBatch(files, options).failed != 0) {
+        spdlog::error("the batch failed");
+      }
+    });
+    if (jobs == cores) {
+      break;
+    }
+  }
+  std::filesystem::remove_all(dir);
+}
+
+const std::vector<std::pair<std::string_view, void(*)(const TInputFile&)>> BENCHMARKS = {
+  {"input", BenchInput},
+  {"trace", BenchTrace},
+  {"linescan", BenchLineScan},
+  {"ast", BenchAst},
+  {"flat", BenchFlatAst},
+  {"dispatch", BenchDispatch},
+  {"loops", BenchLoops},
+  {"io", BenchIo},
+  {"vm", BenchVm},
+  {"batch", BenchBatch},
+};
+
+}  // namespace
+
+int main(int argc, const char* argv[]) {
+  spdlog::set_level(spdlog::level::err);
+
+  std::size_t mib = DEFAULT_INPUT_MIB;
+  std::vector<std::string_view> selected;
+  for (std::string_view arg : std::vector<std::string_view>{argv + 1, argv + argc}) {
+    if (arg.rfind("--mib=", 0) == 0) {
+      mib = std::stoul(std::string{arg.substr(6)});
+    } else {
+      selected.push_back(arg);
+    }
+  }
+
+  TInputFile input{mib << 20};
+  std::printf("input: %.2f MiB\n", input.size / double(1 << 20));
+
+  for (auto [name, bench] : BENCHMARKS) {
+    if (selected.empty() || std::find(selected.begin(), selected.end(), name) != selected.end()) {
+      bench(input);
+    }
+  }
+}
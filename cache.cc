@@ -0,0 +1,174 @@
+#include "cache.hh"
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <system_error>
+#include <vector>
+
+#include <spdlog/spdlog.h>
+
+namespace fs = std::filesystem;
+
+namespace {
+
+constexpr std::string_view TEMP_PREFIX = "tmp.";
+
+/// The hit and miss totals as text, "<hits> <misses>\n"
+constexpr std::string_view STATS_FILE = "stats";
+
+/// The temporary files older than that belong to the processes that died
+constexpr auto ABANDONED_AFTER = std::chrono::hours{1};
+
+TFileCache::TStats ReadStats(int fd) {
+  char text[64] = {};
+  TFileCache::TStats stats;
+  if (::pread(fd, text, sizeof(text) - 1, 0) > 0) {
+    char* end = nullptr;
+    stats.hits = std::strtoull(text, &end, 10);
+    stats.misses = std::strtoull(end, nullptr, 10);
+  }
+  return stats;
+}
+
+}  // namespace
+
+std::optional<TFileCache> TFileCache::Open(const fs::path& dir, std::uint64_t maxBytes) {
+  std::error_code error;
+  fs::create_directories(dir, error);
+  if (error) {
+    spdlog::error("can't create the cache directory {}: {}", dir.string(), error.message());
+    return std::nullopt;
+  }
+  return TFileCache{dir, maxBytes};
+}
+
+fs::path TFileCache::DefaultDir() {
+  if (auto dir = std::getenv("PYTOC_CACHE_DIR"); dir && *dir) {
+    return dir;
+  }
+  if (auto dir = std::getenv("XDG_CACHE_HOME"); dir && *dir) {
+    return fs::path{dir} / "pytoc";
+  }
+  if (auto home = std::getenv("HOME"); home && *home) {
+    return fs::path{home} / ".cache" / "pytoc";
+  }
+  return fs::temp_directory_path() / ("pytoc-cache-" + std::to_string(::getuid()));
+}
+
+std::optional<fs::path> TFileCache::Find(std::string_view key) {
+  auto path = dir / key;
+  std::error_code error;
+  // NOTE: the time of the last use decides what is evicted first
+  fs::last_write_time(path, fs::file_time_type::clock::now(), error);
+  if (error) {
+    stats.misses++;
+    return std::nullopt;
+  }
+  stats.hits++;
+  return path;
+}
+
+fs::path TFileCache::TempPath() const {
+  static std::atomic<unsigned> counter{0};
+  return dir / (std::string{TEMP_PREFIX} + std::to_string(::getpid()) + "." + std::to_string(counter++));
+}
+
+std::optional<fs::path> TFileCache::Insert(std::string_view key, const fs::path& file) const {
+  auto path = dir / key;
+  std::error_code error;
+  // NOTE: rename replaces the entry that another process may have inserted
+  // meanwhile, it has the same contents
+  fs::rename(file, path, error);
+  if (error) {
+    spdlog::error("can't move {} into the cache: {}", file.string(), error.message());
+    fs::remove(file, error);
+    return std::nullopt;
+  }
+  return path;
+}
+
+void TFileCache::Evict() const {
+  struct TEntry {
+    fs::file_time_type time;
+    std::uint64_t size;
+    fs::path path;
+  };
+  std::vector<TEntry> entries;
+  std::uint64_t total = 0;
+  auto now = fs::file_time_type::clock::now();
+  std::error_code error;
+  for (auto it = fs::directory_iterator{dir, error}; !error && it != fs::directory_iterator{}; it.increment(error)) {
+    std::error_code statError;
+    auto time = it->last_write_time(statError);
+    auto size = it->file_size(statError);
+    if (statError) {
+      continue;  // removed by another process meanwhile
+    }
+    auto name = it->path().filename().string();
+    if (name == STATS_FILE) {
+      continue;
+    }
+    if (name.rfind(TEMP_PREFIX, 0) == 0) {
+      if (now - time > ABANDONED_AFTER) {
+        fs::remove(it->path(), statError);
+      }
+      continue;
+    }
+    entries.push_back({time, size, it->path()});
+    total += size;
+  }
+  if (total <= maxBytes) {
+    return;
+  }
+  std::sort(entries.begin(), entries.end(), [](const TEntry& lhs, const TEntry& rhs) { return lhs.time < rhs.time; });
+  for (auto& entry : entries) {
+    if (total <= maxBytes) {
+      break;
+    }
+    // NOTE: a process that runs the binary keeps it open, it's only unlinked
+    fs::remove(entry.path, error);
+    total -= entry.size;
+  }
+  spdlog::info("evicted the cache {} down to {} bytes", dir.string(), total);
+}
+
+void TFileCache::SaveStats() {
+  if (stats.hits == 0 && stats.misses == 0) {
+    return;
+  }
+  auto path = dir / STATS_FILE;
+  int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    spdlog::error("can't open {}: {}", path.string(), std::strerror(errno));
+    return;
+  }
+  // NOTE: the lock is released when the file is closed
+  ::flock(fd, LOCK_EX);
+  auto totals = ReadStats(fd);
+  auto text = std::to_string(totals.hits + stats.hits) + " " + std::to_string(totals.misses + stats.misses) + "\n";
+  if (::pwrite(fd, text.data(), text.size(), 0) != static_cast<ssize_t>(text.size()) ||
+      ::ftruncate(fd, text.size()) != 0) {
+    spdlog::error("can't write {}: {}", path.string(), std::strerror(errno));
+  }
+  ::close(fd);
+  stats = {};
+}
+
+TFileCache::TStats TFileCache::LoadStats() const {
+  int fd = ::open((dir / STATS_FILE).c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return {};
+  }
+  ::flock(fd, LOCK_SH);
+  auto totals = ReadStats(fd);
+  ::close(fd);
+  return totals;
+}
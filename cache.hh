@@ -0,0 +1,65 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+
+/// Goes into the keys of the caches: bump it whenever the code generated for a
+/// program may change, so that nothing stale is reused
+constexpr std::string_view TRANSLATOR_VERSION = "21";
+
+/// A directory of files named by their keys (see TSha256), shared by any
+/// number of pytoc processes. The entries are written to a temporary file and
+/// renamed into place, so a reader sees a whole entry or none. A hit updates
+/// the modification time, the oldest entries are evicted first
+class TFileCache {
+ public:
+  struct TStats {
+    std::uint64_t hits = 0;
+    std::uint64_t misses = 0;
+  };
+
+  /// Creates the directory. Logs the reason and returns nullopt if it can't be
+  /// created
+  static std::optional<TFileCache> Open(const std::filesystem::path& dir, std::uint64_t maxBytes);
+
+  /// $PYTOC_CACHE_DIR, $XDG_CACHE_HOME/pytoc or ~/.cache/pytoc
+  static std::filesystem::path DefaultDir();
+
+  /// The path of the entry if it's in the cache. Counts a hit or a miss
+  std::optional<std::filesystem::path> Find(std::string_view key);
+
+  /// A path in the directory that no other process or thread uses, to write
+  /// an entry before Insert
+  std::filesystem::path TempPath() const;
+
+  /// Moves the file written at a TempPath into the cache. Returns the path of
+  /// the entry or nullopt if it can't be moved (the reason is logged)
+  std::optional<std::filesystem::path> Insert(std::string_view key, const std::filesystem::path& file) const;
+
+  /// Removes the least recently used entries until the cache fits in its size
+  /// limit, and the temporary files that were left by crashed processes
+  void Evict() const;
+
+  /// Adds the hits and misses counted by this object to the totals in the
+  /// directory, under a lock, and starts counting from zero
+  void SaveStats();
+
+  /// The totals of all of the processes that used the directory
+  TStats LoadStats() const;
+
+  /// The hits and misses counted since the last SaveStats
+  const TStats& Stats() const { return stats; }
+
+  const std::filesystem::path& Dir() const { return dir; }
+
+ private:
+  TFileCache(std::filesystem::path dir_, std::uint64_t maxBytes_) : dir{std::move(dir_)}, maxBytes{maxBytes_} {}
+
+  std::filesystem::path dir;
+  std::uint64_t maxBytes;
+  TStats stats;
+};
@@ -1,57 +1,145 @@
+#include <atomic>
+#include <iterator>
+#include <thread>
+
 #include <spdlog/spdlog.h>
 
 #include "driver.hh"
+#include "spsc_ring.hh"
+#include "trace.hh"
+
+struct TMyLexer::TRunAhead {
+  /// Big enough for the lexer to get well ahead of the parser
+  static constexpr std::size_t CAPACITY = 4096;
+
+  TSpscRing<TMyLexRes, CAPACITY> ring;
+  /// Set when the parser is gone and nobody is going to read the tokens
+  std::atomic<bool> stop{false};
+  std::thread thread;
+};
+
+TMyLexer::TMyLexer(std::istream* is) {
+  source.assign(std::istreambuf_iterator<char>{*is}, std::istreambuf_iterator<char>{});
+  auto size = source.size();
+  // flex needs two end-of-buffer characters after the text
+  source.append(2, '\0');
+  Init(source.data(), size);
+}
+
+TMyLexer::TMyLexer(char* base, std::size_t size) {
+  Init(base, size);
+}
+
+void TMyLexer::Init(char* base, std::size_t size) {
+  if (size > MAX_SCAN_SIZE) {
+    // NOTE: nothing of it is read, an empty source is scanned instead
+    ctx.errors.push_back({1, 1, 1, 1, "the source is too large, pytoc translates at most 2 GiB"});
+    source.assign(2, '\0');
+    base = source.data();
+    size = 0;
+  }
+  buffer = base;
+  bufferSize = size;
+  lines = ScanLines({base, size});
+  ScanBuffer(base, size + 2);
+}
 
+TMyLexer::~TMyLexer() {
+  if (runAhead) {
+    runAhead->stop.store(true, std::memory_order_relaxed);
+    runAhead->thread.join();
+  }
+}
+
+void TMyLexer::RunAhead() {
+  assert(!runAhead);
+  runAhead = std::make_unique<TRunAhead>();
+  runAhead->thread = std::thread{[this, state = runAhead.get()] {
+    // NOTE: only the lexing thread touches the scanner from now on, the parser
+    // reads the text of the tokens, which is never written again
+    while (true) {
+      auto res = mylex();
+      while (!state->ring.TryPush(res)) {
+        if (state->stop.load(std::memory_order_relaxed)) {
+          return;
+        }
+        std::this_thread::yield();
+      }
+      if (res.type == yy::parser::token_kind_type::YYEOF) {
+        state->ring.Publish();
+        return;
+      }
+    }
+  }};
+}
+
+TMyLexer::TMyLexRes TMyLexer::next() {
+  if (!runAhead) {
+    return mylex();
+  }
+  TMyLexRes res;
+  while (!runAhead->ring.TryPop(res)) {
+    std::this_thread::yield();
+  }
+  return res;
+}
 
 TMyLexer::TMyLexRes TMyLexer::_mylex() {
   if (ctx.indentsLeft < 0) {
     ctx.indentsLeft++;
-    return { yy::parser::token_kind_type::DEDENT, "", ctx.loc };
+    return { yy::parser::token_kind_type::DEDENT, {}, ctx.loc };
   }
   if (ctx.indentsLeft > 0) {
     ctx.indentsLeft--;
-    return { yy::parser::token_kind_type::INDENT, "", ctx.loc };
-  }
-
-  if (ctx.pendingToken) {
-    ctx.pendingToken = false;
-    return { ctx.curTokenKind, ctx.curToken, ctx.loc };
+    return { yy::parser::token_kind_type::INDENT, {}, ctx.loc };
   }
 
-  int token_type = yylex();
+  if (ctx.atLineStart) {
+    // resolve the indentation before touching the rest of the line
+    ctx.atLineStart = false;
+    int level = EnterNextLine();
 
-  if (ctx.prevTokenKind == yy::parser::token_kind_type::LF) {
-    assert(token_type != yy::parser::token_kind_type::LF);
-    if (token_type == yy::parser::token_kind_type::INDENT) {
-      // this is a special kind of token that signals that we should analyze the number of indents
-      int level = ctx.curToken.size() / 4;
-
-      ctx.indentsLeft = level - ctx.currentIndentLevel;
-      ctx.currentIndentLevel = level;
-
-      if (ctx.indentsLeft == 0) {
-        yylex();
-        return { ctx.curTokenKind, ctx.curToken, ctx.loc };
-      }
-      return _mylex();
-    } else {
-      // return -level dedents before touching the lexed part
-      ctx.indentsLeft = -ctx.currentIndentLevel;
-      ctx.currentIndentLevel = 0;
-      ctx.pendingToken = true;
+    ctx.indentsLeft = level - ctx.currentIndentLevel;
+    ctx.currentIndentLevel = level;
 
+    if (ctx.indentsLeft != 0) {
       return _mylex();
     }
   }
 
+  yylex();
+
+  if (ctx.curTokenKind == yy::parser::token_kind_type::LF) {
+    ctx.atLineStart = true;
+    ctx.line++;
+  }
+
   return { ctx.curTokenKind, ctx.curToken, ctx.loc };
 }
 
+int TMyLexer::EnterNextLine() {
+  while (ctx.line < lines.size() && lines[ctx.line].blank) {
+    ctx.line++;
+  }
+  if (ctx.line == lines.size()) {
+    // only blank lines are left, dedent everything before the end of file
+    SkipTo(buffer + bufferSize);
+    return 0;
+  }
+
+  const auto& line = lines[ctx.line];
+  SkipTo(buffer + line.begin + line.indent);
+  ctx.loc.end.line = ctx.line + 1;
+  ctx.loc.end.column = line.indent + 1;
+  ctx.loc.step();
+  return line.indent / 4;
+}
+
 namespace yy
 {
   parser::symbol_type yylex(TMyLexer* lex) {
-    auto [type, text, loc] = lex->mylex();
-    spdlog::info("reading `{}` (type {})", text, type);
+    auto [type, text, loc] = lex->next();
+    PYTOC_TRACE(Lexer, "reading `{}` (type {})", text, type);
 #define CASE_T(x) case parser::token_kind_type::x: { return parser::make_##x(text, loc); }
 #define CASE(x) case parser::token_kind_type::x: { return parser::make_##x(loc); }
 
@@ -81,7 +169,9 @@ namespace yy
       CASE(AND)
       CASE(OR)
       CASE(NOT)
-      CASE_T(ID)
+      case parser::token_kind_type::ID: {
+                                          return parser::make_ID(lex->ctx.names->Intern(text), loc);
+                                        }
       CASE_T(STRING)
       case parser::token_kind_type::NUMBER: {
                                               return parser::make_NUMBER(text, loc);
@@ -95,6 +185,9 @@ namespace yy
 
   // Mandatory error function
   void parser::error (const parser::location_type& loc, const std::string& msg) {
-    std::cerr << loc << ": " << msg << '\n';
+    // NOTE: bison's end column is the one after the error
+    auto endColumn = loc.end.column > 1 ? loc.end.column - 1 : 1;
+    lex->ctx.errors.push_back({static_cast<unsigned>(loc.begin.line), static_cast<unsigned>(loc.begin.column),
+                               static_cast<unsigned>(loc.end.line), static_cast<unsigned>(endColumn), msg});
   }
 }
@@ -1,6 +1,11 @@
 #pragma once
 
+#include <cstddef>
 #include <iostream>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
 
 #if !defined(yyFlexLexerOnce)
 #include <FlexLexer.h>
@@ -8,16 +13,29 @@
 
 #include "parser.hh"
 #include "ast.hh"
+#include "flat_ast.hh"
+#include "libpytoc.hh"
+#include "linescan.hh"
 
 #undef YY_DECL
 #define YY_DECL int TMyLexer::yylex()
 
 struct TMyLexer : public yyFlexLexer {
-  using yyFlexLexer::yyFlexLexer;
+  /// Reads the whole stream up front: the tokens then reference the text kept
+  /// in the lexer instead of copying it out of the flex buffer
+  explicit TMyLexer(std::istream* is);
+
+  /// Scans `size` bytes at `base` in place without copying them (see
+  /// TMappedFile). The buffer must be writable, outlive the lexer and have two
+  /// zero bytes right after its end
+  TMyLexer(char* base, std::size_t size);
+
+  ~TMyLexer() override;
 
   struct TMyLexRes {
     yy::parser::token_kind_type type;
-    std::string text;
+    /// Points into the source buffer, valid as long as the lexer is alive
+    std::string_view text;
     yy::parser::location_type loc;
   };
 
@@ -29,6 +47,16 @@ struct TMyLexer : public yyFlexLexer {
     return _mylex();
   }
 
+  /// Starts lexing the rest of the input on a separate thread, which passes
+  /// the resolved tokens (INDENTs and DEDENTs included) to `next` through a
+  /// lock-free ring. Lexing and parsing then overlap on two cores, which pays
+  /// off for large inputs
+  void RunAhead();
+
+  /// The token the parser should see next: from the lexing thread after
+  /// RunAhead and from `mylex` otherwise
+  TMyLexRes next();
+
   struct {
     /// If positive - denotes the number of INDENTs we have to return before
     /// calling lex.yylex() again
@@ -37,16 +65,51 @@ struct TMyLexer : public yyFlexLexer {
     int indentsLeft{0};
     int prevIndentLevel{0};
     int currentIndentLevel{0};
-    bool pendingToken{false};
-    TPtr result;
+    /// Set after a newline: the indentation of the next line has to be
+    /// resolved before lexing anything else
+    bool atLineStart{true};
+    /// The index of the line the scanner is on
+    std::size_t line{0};
+    TPtr result{nullptr};
+    /// Owns every node of the AST being built
+    std::shared_ptr<TArena> arena = std::make_shared<TArena>();
+    /// Set before parsing to build a TFlatAst instead, `result` stays null
+    std::unique_ptr<TFlatAstBuilder> flat;
+    TFlatAst::TIndex flatRoot{0};
+    /// The identifiers are interned as they are lexed
+    std::shared_ptr<TInterner> names = std::make_shared<TInterner>();
     yy::parser::location_type loc{};
-    std::string curToken;
+    /// The syntax errors, parser::error collects them instead of printing
+    std::vector<TDiagnostic> errors;
+    std::string_view curToken;
     yy::parser::token_kind_type prevTokenKind{};
     yy::parser::token_kind_type curTokenKind{};
   } ctx;
 
 private:
+  /// Makes flex scan `size` bytes starting at `base` in place. The last two
+  /// bytes must be YY_END_OF_BUFFER_CHAR (defined in scanner.ll)
+  void ScanBuffer(char* base, std::size_t size);
+
+  /// Moves the scanner forward to `pos` without matching what's in between
+  /// (defined in scanner.ll)
+  void SkipTo(char* pos);
+
+  void Init(char* base, std::size_t size);
+
+  /// Skips the blank lines and the indentation of the next line, returns its
+  /// indentation level
+  int EnterNextLine();
+
   TMyLexRes _mylex();
+
+  std::string source;
+  char* buffer{nullptr};
+  std::size_t bufferSize{0};
+  TLineIndex lines;
+
+  struct TRunAhead;
+  std::unique_ptr<TRunAhead> runAhead;
 };
 
 namespace yy {
@@ -0,0 +1,210 @@
+#pragma once
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <iosfwd>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "arena.hh"
+#include "ast.hh"
+#include "symbols.hh"
+
+/// The AST in structure-of-arrays form: nothing but a few contiguous arrays
+/// indexed by node. The nodes are laid out in pre-order, so a walk from the root
+/// reads every array front to back
+struct TFlatAst {
+  using TIndex = std::uint32_t;
+  /// For TCGenerator
+  using TNode = TIndex;
+
+  struct TChildren {
+    const TIndex* first = nullptr;
+    std::size_t count = 0;
+
+    const TIndex* begin() const { return first; }
+    const TIndex* end() const { return first + count; }
+    std::size_t size() const { return count; }
+    TIndex operator[](std::size_t i) const { return first[i]; }
+  };
+
+  std::size_t size() const { return kinds.size(); }
+
+  ENodeKind Kind(TIndex node) const { return kinds[node]; }
+
+  ETreeKind TreeKind(TIndex node) const {
+    assert(kinds[node] == ENodeKind::Tree);
+    return static_cast<ETreeKind>(payloads[node]);
+  }
+
+  int Number(TIndex node) const { return numbers[payloads[node]]; }
+  std::string_view String(TIndex node) const { return strings[payloads[node]]; }
+  TSymbol Symbol(TIndex node) const { return ids[payloads[node]]; }
+
+  TChildren Children(TIndex node) const {
+    return {childList.data() + childBegin[node], childCount[node]};
+  }
+
+  /// Interior nodes refine the kind with an ETreeKind
+  std::vector<ENodeKind> kinds;
+  /// The index into `numbers`, `strings` or `ids` for the leaves and the
+  /// ETreeKind for the trees
+  std::vector<TIndex> payloads;
+  /// The children of a node are childList[childBegin[node]] and the
+  /// childCount[node] - 1 indices after it
+  std::vector<TIndex> childBegin;
+  std::vector<TIndex> childCount;
+  std::vector<TIndex> childList;
+  std::vector<int> numbers;
+  std::vector<std::string_view> strings;
+  std::vector<TSymbol> ids;
+  TIndex root{0};
+  /// Owns the text of `strings`
+  std::shared_ptr<TArena> text;
+  /// Owns the names of `ids`
+  std::shared_ptr<TInterner> names;
+};
+
+/// Collects the nodes of a TFlatAst in the order the parser reduces the rules
+/// (children first) and lays them out in pre-order once the root is known
+class TFlatAstBuilder {
+ public:
+  using TIndex = TFlatAst::TIndex;
+
+  TIndex AddNumber(int val) {
+    nodes.numbers.push_back(val);
+    return AddNode(ENodeKind::Number, nodes.numbers.size() - 1, 0);
+  }
+
+  /// Copies `val`, it may point into the source buffer
+  TIndex AddString(std::string_view val) {
+    nodes.strings.push_back(text->CopyString(val));
+    return AddNode(ENodeKind::String, nodes.strings.size() - 1, 0);
+  }
+
+  TIndex AddId(TSymbol symbol) {
+    nodes.ids.push_back(symbol);
+    return AddNode(ENodeKind::Id, nodes.ids.size() - 1, 0);
+  }
+
+  /// Appends a child to the tree that the next AddTree call creates
+  void AddChild(TIndex child) {
+    nodes.childList.push_back(child);
+  }
+
+  /// A tree with the last `count` children passed to AddChild
+  TIndex AddTree(ETreeKind kind, std::size_t count) {
+    assert(count <= nodes.childList.size());
+    return AddNode(ENodeKind::Tree, static_cast<TIndex>(kind), count);
+  }
+
+  /// Lays the subtree of `root` out in pre-order. The nodes are visited with
+  /// an explicit stack: the trees can be deeper than the call stack allows
+  TFlatAst Build(TIndex root, std::shared_ptr<TInterner> names) && {
+    std::vector<TIndex> order;
+    order.reserve(nodes.size());
+    std::vector<TIndex> stack{root};
+    while (!stack.empty()) {
+      auto node = stack.back();
+      stack.pop_back();
+      order.push_back(node);
+      auto children = nodes.Children(node);
+      for (auto it = children.end(); it != children.begin();) {
+        stack.push_back(*--it);
+      }
+    }
+
+    std::vector<TIndex> newIndex(nodes.size());
+    for (TIndex i = 0; i < order.size(); i++) {
+      newIndex[order[i]] = i;
+    }
+
+    TFlatAst result;
+    result.kinds.reserve(order.size());
+    result.payloads.reserve(order.size());
+    result.childBegin.reserve(order.size());
+    result.childCount.reserve(order.size());
+    result.childList.reserve(nodes.childList.size());
+    for (auto node : order) {
+      auto kind = nodes.Kind(node);
+      result.kinds.push_back(kind);
+      // NOTE: the payloads get reordered as well, so that they are read
+      // sequentially too
+      switch (kind) {
+        case ENodeKind::Number:
+          result.payloads.push_back(result.numbers.size());
+          result.numbers.push_back(nodes.Number(node));
+          break;
+        case ENodeKind::String:
+          result.payloads.push_back(result.strings.size());
+          result.strings.push_back(nodes.String(node));
+          break;
+        case ENodeKind::Id:
+          result.payloads.push_back(result.ids.size());
+          result.ids.push_back(nodes.Symbol(node));
+          break;
+        case ENodeKind::Tree:
+          result.payloads.push_back(nodes.payloads[node]);
+          break;
+      }
+      result.childBegin.push_back(result.childList.size());
+      result.childCount.push_back(nodes.childCount[node]);
+      for (auto child : nodes.Children(node)) {
+        result.childList.push_back(newIndex[child]);
+      }
+    }
+    result.root = 0;
+    result.text = std::move(text);
+    result.names = std::move(names);
+    return result;
+  }
+
+ private:
+  TIndex AddNode(ENodeKind kind, std::size_t payload, std::size_t childCount) {
+    nodes.kinds.push_back(kind);
+    nodes.payloads.push_back(payload);
+    nodes.childBegin.push_back(nodes.childList.size() - childCount);
+    nodes.childCount.push_back(childCount);
+    return nodes.size() - 1;
+  }
+
+  /// In the order of reduction
+  TFlatAst nodes;
+  std::shared_ptr<TArena> text = std::make_shared<TArena>();
+};
+
+/// A node built by a grammar action: a pointer into the arena tree or an index
+/// into TFlatAstBuilder, depending on the layout the parse was asked for
+struct TNodeRef {
+  TPtr ptr{nullptr};
+  TFlatAst::TIndex index{0};
+};
+
+/// Prints the same text as TPrintVisitor in one pass over the nodes
+void PrintFlatAst(const TFlatAst& ast, std::ostream& os, const char* indent = "    ");
+
+/// Streams the C code of the whole AST, the nodes are read front to back
+inline void GenerateC(const TFlatAst& ast, TBufferedWriter& out) {
+  TCGenerator<TFlatAst>{ast, out}.Generate(ast.root);
+}
+
+/// TPyToCVisitor for TFlatAst
+struct TFlatPyToC {
+  explicit TFlatPyToC(const TFlatAst& ast_) : ast{ast_} {}
+
+  std::string Translate() {
+    std::string result;
+    {
+      TBufferedWriter out{result};
+      GenerateC(ast, out);
+    }
+    return result;
+  }
+
+private:
+  const TFlatAst& ast;
+};
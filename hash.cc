@@ -0,0 +1,104 @@
+#include "hash.hh"
+
+#include <algorithm>
+#include <cstring>
+
+namespace {
+
+constexpr std::uint32_t K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+constexpr std::uint32_t Rotr(std::uint32_t x, int n) { return (x >> n) | (x << (32 - n)); }
+
+}  // namespace
+
+TSha256::TSha256()
+    : state{0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19},
+      pending{} {}
+
+TSha256& TSha256::Update(std::string_view data) {
+  auto bytes = reinterpret_cast<const unsigned char*>(data.data());
+  auto size = data.size();
+  totalSize += size;
+  if (pendingSize != 0) {
+    auto chunk = std::min(size, pending.size() - pendingSize);
+    std::memcpy(pending.data() + pendingSize, bytes, chunk);
+    pendingSize += chunk;
+    bytes += chunk;
+    size -= chunk;
+    if (pendingSize < pending.size()) {
+      return *this;
+    }
+    Compress(pending.data());
+    pendingSize = 0;
+  }
+  for (; size >= pending.size(); bytes += pending.size(), size -= pending.size()) {
+    Compress(bytes);
+  }
+  std::memcpy(pending.data(), bytes, size);
+  pendingSize = size;
+  return *this;
+}
+
+std::string TSha256::HexDigest() {
+  auto bits = totalSize * 8;
+  // A one bit, zeros up to 56 bytes of the block and the length in bits
+  unsigned char padding[72] = {0x80};
+  auto padSize = (pendingSize < 56 ? 56 : 120) - pendingSize;
+  for (int i = 0; i < 8; i++) {
+    padding[padSize + i] = static_cast<unsigned char>(bits >> (56 - 8 * i));
+  }
+  Update({reinterpret_cast<const char*>(padding), padSize + 8});
+
+  constexpr char DIGITS[] = "0123456789abcdef";
+  std::string result;
+  for (auto word : state) {
+    for (int shift = 28; shift >= 0; shift -= 4) {
+      result.push_back(DIGITS[(word >> shift) & 0xf]);
+    }
+  }
+  return result;
+}
+
+void TSha256::Compress(const unsigned char* block) {
+  std::uint32_t w[64];
+  for (int i = 0; i < 16; i++) {
+    w[i] = std::uint32_t{block[4 * i]} << 24 | std::uint32_t{block[4 * i + 1]} << 16 |
+           std::uint32_t{block[4 * i + 2]} << 8 | std::uint32_t{block[4 * i + 3]};
+  }
+  for (int i = 16; i < 64; i++) {
+    auto s0 = Rotr(w[i - 15], 7) ^ Rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+    auto s1 = Rotr(w[i - 2], 17) ^ Rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+    w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+  }
+
+  auto [a, b, c, d, e, f, g, h] = state;
+  for (int i = 0; i < 64; i++) {
+    auto s1 = Rotr(e, 6) ^ Rotr(e, 11) ^ Rotr(e, 25);
+    auto choice = (e & f) ^ (~e & g);
+    auto t1 = h + s1 + choice + K[i] + w[i];
+    auto s0 = Rotr(a, 2) ^ Rotr(a, 13) ^ Rotr(a, 22);
+    auto majority = (a & b) ^ (a & c) ^ (b & c);
+    auto t2 = s0 + majority;
+    h = g;
+    g = f;
+    f = e;
+    e = d + t1;
+    d = c;
+    c = b;
+    b = a;
+    a = t1 + t2;
+  }
+  std::uint32_t values[8] = {a, b, c, d, e, f, g, h};
+  for (int i = 0; i < 8; i++) {
+    state[i] += values[i];
+  }
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+/*******************************************************************************
+ *                                   SHA-256                                    *
+ *******************************************************************************/
+
+/// The content hash the caches are keyed by. The parts of a key are fed one by
+/// one, nothing is concatenated in memory
+class TSha256 {
+ public:
+  TSha256();
+
+  TSha256& Update(std::string_view data);
+
+  /// Updates with the text and a zero byte after it, so that the boundaries
+  /// between the parts of a key are part of the hash
+  TSha256& UpdatePart(std::string_view part) { return Update(part).Update({"", 1}); }
+
+  /// The hash as 64 lowercase hex digits. The object can't be updated after
+  std::string HexDigest();
+
+ private:
+  void Compress(const unsigned char* block);
+
+  std::array<std::uint32_t, 8> state;
+  std::array<unsigned char, 64> pending;
+  std::size_t pendingSize = 0;
+  std::uint64_t totalSize = 0;
+};
@@ -0,0 +1,687 @@
+#include "ir.hh"
+
+#include <algorithm>
+#include <cassert>
+#include <charconv>
+#include <iterator>
+#include <limits>
+#include <ostream>
+#include <unordered_map>
+
+namespace {
+
+/*******************************************************************************
+ *                                 Local passes                                 *
+ *******************************************************************************/
+
+/// Computes an operator the way C does, like the constant folder of the AST.
+/// Returns nullopt if the arithmetic overflows
+std::optional<int> Evaluate(EIrOp op, int lhs, int rhs) {
+  long long a = lhs;
+  long long b = rhs;
+  long long result = 0;
+  switch (op) {
+    case EIrOp::Copy:
+      return lhs;
+    case EIrOp::Eq:
+      return a == b;
+    case EIrOp::Neq:
+      return a != b;
+    case EIrOp::Less:
+      return a < b;
+    case EIrOp::Greater:
+      return a > b;
+    case EIrOp::Not:
+      return a == 0;
+    case EIrOp::Minus:
+      result = a - b;
+      break;
+    case EIrOp::Plus:
+      result = a + b;
+      break;
+    case EIrOp::Mul:
+      result = a * b;
+      break;
+    default:
+      return std::nullopt;
+  }
+  // The overflow is left to the runtime, it's undefined in C
+  if (result < std::numeric_limits<int>::min() || result > std::numeric_limits<int>::max()) {
+    return std::nullopt;
+  }
+  return static_cast<int>(result);
+}
+
+bool IsCommutative(EIrOp op) {
+  return op == EIrOp::Eq || op == EIrOp::Neq || op == EIrOp::Plus || op == EIrOp::Mul;
+}
+
+/// The values the block has computed so far, as long as none of their operands
+/// is assigned again. Every assignment bumps the version of the value, the
+/// entries that saw an older version are stale
+class TLocalValues {
+ public:
+  /// The value a use of `value` can read instead
+  TIrValue Resolve(TIrValue value) const {
+    auto it = copies.find(Key(value));
+    if (it == copies.end() || !Valid(it->second.dst) || !Valid(it->second.src)) {
+      return value;
+    }
+    return it->second.src.value;
+  }
+
+  /// A value that already holds `op lhs rhs`
+  TIrValue Find(EIrOp op, TIrValue lhs, TIrValue rhs) const {
+    auto it = computed.find({op, Key(lhs), Key(rhs)});
+    if (it == computed.end() || !Valid(it->second.holder) || !Valid(it->second.lhs) ||
+        !Valid(it->second.rhs)) {
+      return {};
+    }
+    return it->second.holder.value;
+  }
+
+  /// Forgets everything that reads `value`, it's about to change
+  void Kill(TIrValue value) { versions[Key(value)]++; }
+
+  void AddCopy(TIrValue dst, TIrValue src) { copies[Key(dst)] = {Seen(dst), Seen(src)}; }
+
+  void AddComputed(EIrOp op, TIrValue lhs, TIrValue rhs, TIrValue holder) {
+    computed[{op, Key(lhs), Key(rhs)}] = {Seen(holder), Seen(lhs), Seen(rhs)};
+  }
+
+ private:
+  struct TSeen {
+    TIrValue value;
+    std::uint32_t version;
+  };
+
+  struct TCopy {
+    TSeen dst;
+    TSeen src;
+  };
+
+  struct TComputed {
+    TSeen holder;
+    TSeen lhs;
+    TSeen rhs;
+  };
+
+  struct TExpr {
+    EIrOp op;
+    std::uint64_t lhs;
+    std::uint64_t rhs;
+
+    bool operator==(const TExpr& other) const {
+      return op == other.op && lhs == other.lhs && rhs == other.rhs;
+    }
+  };
+
+  struct TExprHash {
+    std::size_t operator()(const TExpr& expr) const {
+      std::hash<std::uint64_t> hash;
+      return hash(expr.lhs * 31 + expr.rhs) ^ static_cast<std::size_t>(expr.op);
+    }
+  };
+
+  static std::uint64_t Key(TIrValue value) {
+    return static_cast<std::uint64_t>(value.kind) << 32 | static_cast<std::uint32_t>(value.index);
+  }
+
+  TSeen Seen(TIrValue value) const {
+    auto it = versions.find(Key(value));
+    return {value, it == versions.end() ? 0 : it->second};
+  }
+
+  bool Valid(const TSeen& seen) const { return Seen(seen.value).version == seen.version; }
+
+  std::unordered_map<std::uint64_t, std::uint32_t> versions;
+  std::unordered_map<std::uint64_t, TCopy> copies;
+  std::unordered_map<TExpr, TComputed, TExprHash> computed;
+};
+
+/// Copy propagation, constant folding and common subexpression elimination
+/// within a block. Returns whether anything changed
+bool NumberValues(TIrBlock& block) {
+  bool changed = false;
+  TLocalValues known;
+  auto use = [&](TIrValue& value) {
+    if (auto resolved = known.Resolve(value); resolved != value) {
+      value = resolved;
+      changed = true;
+    }
+  };
+  for (auto& instr : block.instrs) {
+    use(instr.lhs);
+    use(instr.rhs);
+    for (auto& arg : instr.args) {
+      use(arg);
+    }
+    if (IsPure(instr.op) && instr.op != EIrOp::Copy) {
+      if (IsCommutative(instr.op) && std::pair{instr.rhs.kind, instr.rhs.index} <
+                                         std::pair{instr.lhs.kind, instr.lhs.index}) {
+        // The operands are ordered, so that `a * b` and `b * a` match
+        std::swap(instr.lhs, instr.rhs);
+      }
+      auto lhs = instr.lhs;
+      auto rhs = instr.rhs;
+      bool constant = lhs.kind == TIrValue::EKind::Const &&
+                      (instr.op == EIrOp::Not || rhs.kind == TIrValue::EKind::Const);
+      if (auto value = constant ? Evaluate(instr.op, lhs.index, rhs.index) : std::nullopt) {
+        instr = {EIrOp::Copy, instr.dst, TIrValue::Const(*value), {}, {}, {}};
+        changed = true;
+      } else if (auto holder = known.Find(instr.op, lhs, rhs); holder && holder != instr.dst) {
+        PYTOC_TRACE(Codegen, "reusing a common subexpression");
+        instr = {EIrOp::Copy, instr.dst, holder, {}, {}, {}};
+        changed = true;
+      }
+    }
+    if (!instr.dst) {
+      continue;
+    }
+    known.Kill(instr.dst);
+    if (instr.op == EIrOp::Copy) {
+      if (instr.lhs != instr.dst) {
+        known.AddCopy(instr.dst, instr.lhs);
+      }
+    } else if (IsPure(instr.op) && instr.lhs != instr.dst && instr.rhs != instr.dst) {
+      known.AddComputed(instr.op, instr.lhs, instr.rhs, instr.dst);
+    }
+  }
+  if (block.exit.kind == TIrExit::EKind::Branch) {
+    use(block.exit.condition);
+  }
+  return changed;
+}
+
+/*******************************************************************************
+ *                                 Global passes                                *
+ *******************************************************************************/
+
+std::size_t SuccessorCount(const TIrExit& exit) {
+  switch (exit.kind) {
+    case TIrExit::EKind::Return:
+      return 0;
+    case TIrExit::EKind::Jump:
+      return 1;
+    case TIrExit::EKind::Branch:
+      return 2;
+  }
+  return 0;
+}
+
+/// Where a jump to `target` ends up, skipping the empty blocks that only jump
+std::size_t FollowJumps(const TIrFunction& function, std::size_t target) {
+  // NOTE: the bound stops at the empty loops, like `while 1: pass`
+  for (std::size_t i = 0; i < function.blocks.size(); i++) {
+    auto& block = function.blocks[target];
+    if (!block.instrs.empty() || block.exit.kind != TIrExit::EKind::Jump) {
+      break;
+    }
+    target = block.exit.targets[0];
+  }
+  return target;
+}
+
+/// Folds the branches on constants, threads the jumps through the empty
+/// blocks and removes the blocks that can't be reached. Returns whether
+/// anything changed
+bool SimplifyCfg(TIrFunction& function) {
+  bool changed = false;
+  for (auto& block : function.blocks) {
+    auto& exit = block.exit;
+    if (exit.kind == TIrExit::EKind::Branch && exit.condition.kind == TIrValue::EKind::Const) {
+      PYTOC_TRACE(Codegen, "folding a branch on a constant");
+      exit = {TIrExit::EKind::Jump, {}, {exit.targets[exit.condition.index != 0 ? 0 : 1], 0}};
+      changed = true;
+    }
+    for (std::size_t i = 0; i < SuccessorCount(exit); i++) {
+      auto target = FollowJumps(function, exit.targets[i]);
+      changed |= target != exit.targets[i];
+      exit.targets[i] = target;
+    }
+    if (exit.kind == TIrExit::EKind::Branch && exit.targets[0] == exit.targets[1]) {
+      exit = {TIrExit::EKind::Jump, {}, {exit.targets[0], 0}};
+      changed = true;
+    }
+  }
+
+  std::vector<std::size_t> renumbered(function.blocks.size(), function.blocks.size());
+  std::vector<std::size_t> stack{0};
+  renumbered[0] = 0;
+  while (!stack.empty()) {
+    auto& exit = function.blocks[stack.back()].exit;
+    stack.pop_back();
+    for (std::size_t i = 0; i < SuccessorCount(exit); i++) {
+      if (renumbered[exit.targets[i]] == function.blocks.size()) {
+        renumbered[exit.targets[i]] = 0;
+        stack.push_back(exit.targets[i]);
+      }
+    }
+  }
+  // The order of the blocks is kept, it's the order of the source
+  std::size_t reachable = 0;
+  for (std::size_t i = 0; i < function.blocks.size(); i++) {
+    if (renumbered[i] != function.blocks.size()) {
+      renumbered[i] = reachable;
+      if (reachable != i) {
+        function.blocks[reachable] = std::move(function.blocks[i]);
+      }
+      reachable++;
+    }
+  }
+  if (reachable == function.blocks.size()) {
+    return changed;
+  }
+  PYTOC_TRACE(Codegen, "removing {} unreachable blocks", function.blocks.size() - reachable);
+  function.blocks.resize(reachable);
+  for (auto& block : function.blocks) {
+    for (std::size_t i = 0; i < SuccessorCount(block.exit); i++) {
+      block.exit.targets[i] = renumbered[block.exit.targets[i]];
+    }
+  }
+  return true;
+}
+
+/// The variables and the temporaries as bits of a set
+class TSlots {
+ public:
+  explicit TSlots(const TIrFunction& function) : vars{function.vars.size()} {}
+
+  std::size_t Size(const TIrFunction& function) const { return vars + function.temps; }
+
+  /// Returns Size() for the values that aren't stored
+  std::size_t Slot(TIrValue value) const {
+    switch (value.kind) {
+      case TIrValue::EKind::Var:
+        return value.index;
+      case TIrValue::EKind::Temp:
+        return vars + value.index;
+      default:
+        return std::numeric_limits<std::size_t>::max();
+    }
+  }
+
+ private:
+  std::size_t vars;
+};
+
+using TLiveSet = std::vector<bool>;
+
+template <typename F>
+void ForEachUse(const TIrInstr& instr, F&& f) {
+  f(instr.lhs);
+  f(instr.rhs);
+  for (auto& arg : instr.args) {
+    f(arg);
+  }
+}
+
+/// Removes the pure instructions whose results are never read, with the
+/// liveness of the whole function. Returns whether anything changed
+bool EliminateDeadStores(TIrFunction& function) {
+  TSlots slots{function};
+  auto size = slots.Size(function);
+  auto mark = [&](TLiveSet& live, TIrValue value, bool isLive) {
+    if (auto slot = slots.Slot(value); slot < size) {
+      live[slot] = isLive;
+    }
+  };
+  auto transfer = [&](const TIrBlock& block, TLiveSet& live) {
+    if (block.exit.kind == TIrExit::EKind::Branch) {
+      mark(live, block.exit.condition, true);
+    }
+    for (auto it = block.instrs.rbegin(); it != block.instrs.rend(); ++it) {
+      mark(live, it->dst, false);
+      ForEachUse(*it, [&](TIrValue value) { mark(live, value, true); });
+    }
+  };
+
+  // NOTE: the program ends at the Return, nothing is live after it
+  std::vector<TLiveSet> liveIn(function.blocks.size(), TLiveSet(size));
+  for (bool changed = true; changed;) {
+    changed = false;
+    for (auto i = function.blocks.size(); i-- > 0;) {
+      auto& block = function.blocks[i];
+      TLiveSet live(size);
+      for (std::size_t j = 0; j < SuccessorCount(block.exit); j++) {
+        auto& successor = liveIn[block.exit.targets[j]];
+        for (std::size_t slot = 0; slot < size; slot++) {
+          live[slot] = live[slot] || successor[slot];
+        }
+      }
+      transfer(block, live);
+      if (live != liveIn[i]) {
+        liveIn[i] = std::move(live);
+        changed = true;
+      }
+    }
+  }
+
+  bool removed = false;
+  for (auto& block : function.blocks) {
+    TLiveSet live(size);
+    for (std::size_t j = 0; j < SuccessorCount(block.exit); j++) {
+      auto& successor = liveIn[block.exit.targets[j]];
+      for (std::size_t slot = 0; slot < size; slot++) {
+        live[slot] = live[slot] || successor[slot];
+      }
+    }
+    if (block.exit.kind == TIrExit::EKind::Branch) {
+      mark(live, block.exit.condition, true);
+    }
+    auto& instrs = block.instrs;
+    auto kept = instrs.size();
+    for (auto i = instrs.size(); i-- > 0;) {
+      auto& instr = instrs[i];
+      auto slot = slots.Slot(instr.dst);
+      bool dead = instr.dst && !live[slot];
+      bool noop = instr.op == EIrOp::Copy && instr.lhs == instr.dst;
+      if (IsPure(instr.op) && (dead || noop)) {
+        continue;
+      }
+      if (dead && instr.op == EIrOp::Call) {
+        instr.dst = {};
+        removed = true;
+      }
+      mark(live, instr.dst, false);
+      ForEachUse(instr, [&](TIrValue value) { mark(live, value, true); });
+      instrs[--kept] = std::move(instr);
+    }
+    if (kept != 0) {
+      instrs.erase(instrs.begin(), instrs.begin() + kept);
+      removed = true;
+    }
+  }
+  return removed;
+}
+
+/*******************************************************************************
+ *                                   Printing                                   *
+ *******************************************************************************/
+
+std::string_view OpName(EIrOp op) {
+  constexpr std::string_view NAMES[] = {
+      "", "==", "!=", "<", ">", "-", "+", "*", "!",
+      "read_int", "input", "atoi", "print_int", "print_str", "call", "error",
+  };
+  static_assert(std::size(NAMES) == static_cast<std::size_t>(EIrOp::Error) + 1);
+  return NAMES[static_cast<std::size_t>(op)];
+}
+
+template <typename TOut>
+void WriteNumber(long long number, TOut& out) {
+  char digits[24];
+  auto [end, _] = std::to_chars(std::begin(digits), std::end(digits), number);
+  out.Write({digits, static_cast<std::size_t>(end - digits)});
+}
+
+/// Writes an operand as C, which the dump reads as well
+template <typename TOut>
+void WriteValue(const TIrFunction& function, TIrValue value, TOut& out) {
+  switch (value.kind) {
+    case TIrValue::EKind::None:
+      return;
+    case TIrValue::EKind::Const:
+      WriteNumber(value.index, out);
+      return;
+    case TIrValue::EKind::Var: {
+      auto& var = function.vars[value.index];
+      if (var.shadow == 0) {
+        out.Write(var.name);
+        return;
+      }
+      out.Write("__");
+      out.Write(var.name);
+      out.Write("_");
+      WriteNumber(var.shadow, out);
+      return;
+    }
+    case TIrValue::EKind::Temp:
+      out.Write("__t");
+      WriteNumber(value.index, out);
+      return;
+    case TIrValue::EKind::String:
+      out.Write("\"");
+      out.Write(function.strings[value.index]);
+      out.Write("\"");
+      return;
+  }
+}
+
+/// The blocks that `block` jumps to with a goto, the next one is entered by
+/// falling through
+std::vector<std::size_t> Gotos(const TIrExit& exit, std::size_t block) {
+  switch (exit.kind) {
+    case TIrExit::EKind::Return:
+      return {};
+    case TIrExit::EKind::Jump:
+      if (exit.targets[0] == block + 1) {
+        return {};
+      }
+      return {exit.targets[0]};
+    case TIrExit::EKind::Branch:
+      if (exit.targets[1] == block + 1) {
+        return {exit.targets[0]};
+      }
+      // The condition is negated when the next block is the one it picks
+      if (exit.targets[0] == block + 1) {
+        return {exit.targets[1]};
+      }
+      return {exit.targets[0], exit.targets[1]};
+  }
+  return {};
+}
+
+struct TStreamOut {
+  std::ostream& out;
+  void Write(std::string_view text) { out << text; }
+};
+
+}  // namespace
+
+void OptimizeIr(TIrFunction& function) {
+  // NOTE: every pass opens up work for the others: a folded branch leaves
+  // blocks to remove, a propagated copy leaves a dead store
+  constexpr int MAX_ROUNDS = 8;
+  for (int round = 0; round < MAX_ROUNDS; round++) {
+    bool changed = false;
+    for (auto& block : function.blocks) {
+      changed |= NumberValues(block);
+    }
+    changed |= SimplifyCfg(function);
+    changed |= EliminateDeadStores(function);
+    if (!changed) {
+      break;
+    }
+  }
+}
+
+void PrintIr(const TIrFunction& function, std::ostream& os) {
+  TStreamOut out{os};
+  auto value = [&](TIrValue v) { WriteValue(function, v, out); };
+  for (std::size_t i = 0; i < function.blocks.size(); i++) {
+    auto& block = function.blocks[i];
+    os << "B" << i << ":\n";
+    for (auto& instr : block.instrs) {
+      os << "  ";
+      if (instr.dst) {
+        value(instr.dst);
+        os << " = ";
+      }
+      switch (instr.op) {
+        case EIrOp::Copy:
+          value(instr.lhs);
+          break;
+        case EIrOp::Not:
+          os << "!";
+          value(instr.lhs);
+          break;
+        case EIrOp::Call:
+          os << instr.name << "(";
+          for (std::size_t j = 0; j < instr.args.size(); j++) {
+            os << (j != 0 ? ", " : "");
+            value(instr.args[j]);
+          }
+          os << ")";
+          break;
+        case EIrOp::Error:
+          os << "error \"" << instr.name << "\"";
+          break;
+        default:
+          if (!IsPure(instr.op)) {
+            os << OpName(instr.op);
+            if (instr.lhs) {
+              os << " ";
+              value(instr.lhs);
+            }
+            break;
+          }
+          value(instr.lhs);
+          os << " " << OpName(instr.op) << " ";
+          value(instr.rhs);
+          break;
+      }
+      os << "\n";
+    }
+    switch (block.exit.kind) {
+      case TIrExit::EKind::Return:
+        os << "  return\n";
+        break;
+      case TIrExit::EKind::Jump:
+        os << "  jump B" << block.exit.targets[0] << "\n";
+        break;
+      case TIrExit::EKind::Branch:
+        os << "  branch ";
+        value(block.exit.condition);
+        os << ", B" << block.exit.targets[0] << ", B" << block.exit.targets[1] << "\n";
+        break;
+    }
+  }
+}
+
+void GenerateC(const TIrFunction& function, TBufferedWriter& writer) {
+  TCodeWriter out{writer};
+  auto value = [&](TIrValue v) { WriteValue(function, v, out); };
+  auto label = [&](std::size_t block) {
+    out.Write("__L");
+    WriteNumber(block, out);
+  };
+
+  // A block needs a label unless it's only entered from the one before it
+  std::vector<bool> labeled(function.blocks.size());
+  for (std::size_t i = 0; i < function.blocks.size(); i++) {
+    for (auto target : Gotos(function.blocks[i].exit, i)) {
+      labeled[target] = true;
+    }
+  }
+
+  auto declare = [&](std::string_view prefix, std::size_t count, auto&& name) {
+    for (std::size_t i = 0; i < count; i++) {
+      out.Write(i == 0 ? prefix : ", ");
+      name(i);
+    }
+    if (count != 0) {
+      out.Write(";\n");
+    }
+  };
+  auto program = [&] {
+    std::vector<std::size_t> declared;
+    for (std::size_t i = 0; i < function.vars.size(); i++) {
+      if (function.vars[i].assigned) {
+        declared.push_back(i);
+      }
+    }
+    declare("int ", declared.size(), [&](std::size_t i) {
+      value(TIrValue::Var(declared[i]));
+      out.Write(" = 0");
+    });
+    declare("int ", function.temps, [&](std::size_t i) { value(TIrValue::Temp(i)); });
+
+    for (std::size_t i = 0; i < function.blocks.size(); i++) {
+      auto& block = function.blocks[i];
+      if (labeled[i]) {
+        label(i);
+        out.Write(":;\n");
+      }
+      for (auto& instr : block.instrs) {
+        if (instr.op == EIrOp::Error) {
+          out.Write("\n#error \"");
+          out.Write(instr.name);
+          out.Write("\"\n");
+          continue;
+        }
+        if (instr.dst) {
+          value(instr.dst);
+          out.Write(" = ");
+        }
+        switch (instr.op) {
+          case EIrOp::Copy:
+            value(instr.lhs);
+            break;
+          case EIrOp::Not:
+            out.Write("!");
+            value(instr.lhs);
+            break;
+          case EIrOp::ReadInt:
+            out.Write("__read_int()");
+            break;
+          case EIrOp::Input:
+            out.Write("input()");
+            break;
+          case EIrOp::Atoi:
+          case EIrOp::PrintInt:
+          case EIrOp::PrintStr:
+            out.Write(instr.op == EIrOp::Atoi ? "atoi(" : instr.op == EIrOp::PrintInt ? "__print_int(" : "__print_str(");
+            value(instr.lhs);
+            out.Write(")");
+            break;
+          case EIrOp::Call:
+            out.Write(instr.name);
+            out.Write("(");
+            for (std::size_t j = 0; j < instr.args.size(); j++) {
+              if (j != 0) {
+                out.Write(", ");
+              }
+              value(instr.args[j]);
+            }
+            out.Write(")");
+            break;
+          default:
+            value(instr.lhs);
+            out.Write(" ");
+            out.Write(OpName(instr.op));
+            out.Write(" ");
+            value(instr.rhs);
+            break;
+        }
+        out.Write(";\n");
+      }
+
+      // NOTE: the lowering ends the program in its last block, which stays
+      // the last one
+      assert(block.exit.kind != TIrExit::EKind::Return || i + 1 == function.blocks.size());
+      auto gotos = Gotos(block.exit, i);
+      for (std::size_t j = 0; j < gotos.size(); j++) {
+        if (j == 0 && block.exit.kind == TIrExit::EKind::Branch) {
+          out.Write(gotos[0] == block.exit.targets[0] ? "if (" : "if (!");
+          value(block.exit.condition);
+          out.Write(") ");
+        }
+        out.Write("goto ");
+        label(gotos[j]);
+        out.Write(";\n");
+      }
+    }
+  };
+
+  for (auto& segment : C_SEGMENTS) {
+    if (segment.slot == ESlot::None) {
+      out.Write(segment.text);
+      continue;
+    }
+    out.Open();
+    program();
+    out.Close();
+  }
+  out.Finish();
+}
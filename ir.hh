@@ -0,0 +1,549 @@
+#pragma once
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <iosfwd>
+#include <optional>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "ast.hh"
+#include "flat_ast.hh"
+#include "symbols.hh"
+#include "trace.hh"
+#include "writer.hh"
+
+/*******************************************************************************
+ *                              Three-address code                              *
+ *******************************************************************************/
+
+/// An operand of an instruction
+struct TIrValue {
+  enum class EKind : std::uint8_t {
+    None,
+    Const,
+    /// A variable of the program, `index` is in TIrFunction::vars
+    Var,
+    /// A temporary of the lowering, `index` is its number
+    Temp,
+    /// A string literal, `index` is in TIrFunction::strings
+    String,
+  };
+
+  EKind kind = EKind::None;
+  int index = 0;
+
+  static TIrValue Const(int value) { return {EKind::Const, value}; }
+  static TIrValue Var(int index) { return {EKind::Var, index}; }
+  static TIrValue Temp(int index) { return {EKind::Temp, index}; }
+
+  explicit operator bool() const { return kind != EKind::None; }
+  bool operator==(const TIrValue& other) const { return kind == other.kind && index == other.index; }
+  bool operator!=(const TIrValue& other) const { return !(*this == other); }
+};
+
+enum class EIrOp : std::uint8_t {
+  /// dst = lhs
+  Copy,
+  // dst = lhs op rhs, named after ETreeKind
+  Eq,
+  Neq,
+  Less,
+  Greater,
+  Minus,
+  Plus,
+  Mul,
+  /// dst = !lhs
+  Not,
+  // The builtins, they are never removed
+  ReadInt,
+  Input,
+  Atoi,
+  PrintInt,
+  PrintStr,
+  /// dst = name(args...), `dst` is None if the value isn't used
+  Call,
+  /// Fails the C compilation with the message in `name`
+  Error,
+};
+
+/// Whether the instruction only computes `dst`: it can be dropped if the value
+/// isn't used, and reused if it's computed again
+constexpr bool IsPure(EIrOp op) { return op <= EIrOp::Not; }
+
+struct TIrInstr {
+  EIrOp op;
+  TIrValue dst;
+  TIrValue lhs;
+  TIrValue rhs;
+  std::string_view name;
+  std::vector<TIrValue> args;
+};
+
+/// How a basic block ends
+struct TIrExit {
+  enum class EKind : std::uint8_t {
+    Return,
+    Jump,
+    /// Goes to targets[0] if `condition` isn't 0, to targets[1] otherwise
+    Branch,
+  };
+
+  EKind kind = EKind::Return;
+  TIrValue condition;
+  std::size_t targets[2] = {0, 0};
+};
+
+struct TIrBlock {
+  std::vector<TIrInstr> instrs;
+  TIrExit exit;
+};
+
+struct TIrVariable {
+  std::string_view name;
+  /// The program assigns it somewhere, so it's declared. A variable that is
+  /// only read is left undeclared, as by the AST codegen
+  bool assigned = false;
+  /// The number of the variables with the same name before it (the iterator
+  /// of a loop hides the variable outside of it), the C name is `__name_N`
+  /// unless it's 0
+  int shadow = 0;
+};
+
+/// The whole program as a control flow graph, it starts at the first block.
+/// The variables aren't in SSA form, the temporaries are assigned once except
+/// for the results of `or` and `and`
+struct TIrFunction {
+  std::vector<TIrBlock> blocks;
+  std::vector<TIrVariable> vars;
+  std::vector<std::string_view> strings;
+  int temps = 0;
+};
+
+/// Rewrites the function until nothing changes: copy propagation, constant
+/// folding and common subexpression elimination in every block, then
+/// branch folding, jump threading and the removal of the dead stores and the
+/// unreachable blocks
+void OptimizeIr(TIrFunction& function);
+
+/// Prints the instructions in a readable form, for --dump-ir
+void PrintIr(const TIrFunction& function, std::ostream& out);
+
+/// Streams the C code of the function to a writer: the same runtime as
+/// GenerateC, with the blocks as labels and gotos in main
+void GenerateC(const TIrFunction& function, TBufferedWriter& out);
+
+/*******************************************************************************
+ *                                   Lowering                                   *
+ *******************************************************************************/
+
+/// Lowers an AST into three-address code. TLayout gives access to the nodes of
+/// one of the layouts (see TCGenerator).
+/// The expressions are walked with an explicit stack, the statements are
+/// lowered recursively: they nest only as deep as the blocks of the source
+template <typename TLayout>
+class TIrBuilder {
+ public:
+  using TNode = typename TLayout::TNode;
+
+  explicit TIrBuilder(const TLayout& layout_) : layout{layout_} {}
+
+  /// `root` must be a file
+  TIrFunction Lower(TNode root) {
+    assert(layout.Kind(root) == ENodeKind::Tree && layout.TreeKind(root) == ETreeKind::File);
+    current = NewBlock();
+    LowerStatements(root);
+    auto end = NewBlock();
+    Jump(end);
+    return std::move(function);
+  }
+
+ private:
+  std::size_t NewBlock() {
+    function.blocks.emplace_back();
+    return function.blocks.size() - 1;
+  }
+
+  TIrValue NewTemp() { return TIrValue::Temp(function.temps++); }
+
+  TIrValue Var(TSymbol symbol) {
+    auto [it, inserted] = vars.emplace(symbol.id, static_cast<int>(function.vars.size()));
+    if (inserted) {
+      NewVar(symbol);
+    }
+    return TIrValue::Var(it->second);
+  }
+
+  TIrValue NewVar(TSymbol symbol) {
+    function.vars.push_back({symbol.name, false, shadows[symbol.id]++});
+    return TIrValue::Var(static_cast<int>(function.vars.size() - 1));
+  }
+
+  void Emit(TIrInstr instr) { function.blocks[current].instrs.push_back(std::move(instr)); }
+
+  TIrValue Emit(EIrOp op, TIrValue lhs, TIrValue rhs = {}) {
+    auto dst = NewTemp();
+    Emit({op, dst, lhs, rhs, {}, {}});
+    return dst;
+  }
+
+  void Jump(std::size_t target) {
+    auto& exit = function.blocks[current].exit;
+    exit.kind = TIrExit::EKind::Jump;
+    exit.targets[0] = target;
+  }
+
+  void Branch(TIrValue condition, std::size_t then, std::size_t otherwise) {
+    auto& exit = function.blocks[current].exit;
+    exit.kind = TIrExit::EKind::Branch;
+    exit.condition = condition;
+    exit.targets[0] = then;
+    exit.targets[1] = otherwise;
+  }
+
+  void LowerStatements(TNode node) {
+    for (auto child : layout.Children(node)) {
+      LowerStatement(child);
+    }
+  }
+
+  void LowerStatement(TNode node) {
+    auto children = layout.Children(node);
+    switch (layout.TreeKind(node)) {
+      case ETreeKind::SimpleStmt:
+        LowerExpr(children[0]);
+        return;
+      case ETreeKind::IfStmt: {
+        auto condition = LowerExpr(layout.Children(children[0])[0]);
+        auto then = NewBlock();
+        auto otherwise = NewBlock();
+        auto join = NewBlock();
+        Branch(condition, then, otherwise);
+        current = then;
+        LowerStatements(children[1]);
+        Jump(join);
+        current = otherwise;
+        if (layout.TreeKind(children[2]) == ETreeKind::ElseStmt) {
+          LowerStatements(layout.Children(children[2])[0]);
+        } else {
+          LowerStatement(children[2]);
+        }
+        Jump(join);
+        current = join;
+        return;
+      }
+      case ETreeKind::WhileLoop: {
+        auto head = NewBlock();
+        Jump(head);
+        current = head;
+        auto condition = LowerExpr(layout.Children(children[0])[0]);
+        auto body = NewBlock();
+        auto exit = NewBlock();
+        Branch(condition, body, exit);
+        current = body;
+        LowerStatements(children[1]);
+        Jump(head);
+        current = exit;
+        return;
+      }
+      case ETreeKind::ForLoop:
+        LowerFor(layout.Children(children[0])[0], layout.Children(children[1])[0], children[2]);
+        return;
+      default:
+        assert(false && "not a statement");
+        return;
+    }
+  }
+
+  /// A counted loop over the iterator itself, as the C loop of TCGenerator:
+  /// the iterator is a variable of its own that hides the one with the same
+  /// name outside of the loop, and assigning it in the body changes the
+  /// iteration
+  void LowerFor(TNode iterator, TNode range, TNode statements) {
+    if (!IsInvokeOf(range, builtins::RANGE)) {
+      Emit({EIrOp::Error, {}, {}, {}, "only range(...) can be iterated over", {}});
+      return;
+    }
+    auto args = layout.Children(layout.Children(range)[1]);
+    TIrValue from = TIrValue::Const(0);
+    TIrValue to = TIrValue::Const(0);
+    TIrValue step = TIrValue::Const(1);
+    // NOTE: the bounds are computed once, before the loop, in the order of
+    // the arguments
+    switch (args.size()) {
+      case 1:
+        to = Snapshot(LowerExpr(args[0]));
+        break;
+      case 2:
+        from = LowerExpr(args[0]);
+        to = Snapshot(LowerExpr(args[1]));
+        break;
+      case 3:
+        from = LowerExpr(args[0]);
+        to = Snapshot(LowerExpr(args[1]));
+        step = Snapshot(LowerExpr(args[2]));
+        break;
+      default:
+        break;  // an empty range on invalid call
+    }
+    auto symbol = layout.Symbol(iterator);
+    auto counter = NewVar(symbol);
+    function.vars[counter.index].assigned = true;
+    std::optional<int> hidden;
+    if (auto it = vars.find(symbol.id); it != vars.end()) {
+      hidden = it->second;
+    }
+    vars[symbol.id] = counter.index;
+    Emit({EIrOp::Copy, counter, from, {}, {}, {}});
+
+    auto head = NewBlock();
+    Jump(head);
+    current = head;
+    TIrValue condition;
+    if (step.kind == TIrValue::EKind::Const && step.index != 0) {
+      condition = Emit(step.index > 0 ? EIrOp::Less : EIrOp::Greater, counter, to);
+    } else {
+      // The direction is only known at runtime, a zero step makes an empty
+      // range
+      PYTOC_TRACE(Codegen, "lowering a for loop with a dynamic step");
+      condition = NewTemp();
+      auto up = NewBlock();
+      auto notUp = NewBlock();
+      auto down = NewBlock();
+      auto decided = NewBlock();
+      Branch(Emit(EIrOp::Greater, step, TIrValue::Const(0)), up, notUp);
+      current = up;
+      Emit({EIrOp::Less, condition, counter, to, {}, {}});
+      Jump(decided);
+      current = notUp;
+      Emit({EIrOp::Less, condition, step, TIrValue::Const(0), {}, {}});
+      Branch(condition, down, decided);
+      current = down;
+      Emit({EIrOp::Greater, condition, counter, to, {}, {}});
+      Jump(decided);
+      current = decided;
+    }
+    auto body = NewBlock();
+    auto exit = NewBlock();
+    Branch(condition, body, exit);
+
+    current = body;
+    LowerStatements(statements);
+    Emit({EIrOp::Plus, counter, counter, step, {}, {}});
+    Jump(head);
+    current = exit;
+
+    if (hidden) {
+      vars[symbol.id] = *hidden;
+    } else {
+      vars.erase(symbol.id);
+    }
+  }
+
+  /// Keeps the value of a variable from before the loop
+  TIrValue Snapshot(TIrValue value) {
+    if (value.kind != TIrValue::EKind::Var) {
+      return value;
+    }
+    return Emit(EIrOp::Copy, value);
+  }
+
+  bool IsInvokeOf(TNode node, TSymbolId func) const {
+    return layout.Kind(node) == ENodeKind::Tree && layout.TreeKind(node) == ETreeKind::Invoke &&
+           layout.Symbol(layout.Children(node)[0]).id == func;
+  }
+
+  struct TFrame {
+    TNode node;
+    std::size_t next;
+    /// Where the values of the children start
+    std::size_t base;
+    /// The result of `or` and `and`, and the block where the paths join
+    TIrValue result;
+    std::size_t join;
+  };
+
+  TIrValue LowerExpr(TNode root) {
+    assert(frames.empty() && values.empty());
+    if (layout.Kind(root) != ENodeKind::Tree) {
+      PushLeaf(root);
+    } else {
+      frames.push_back({root, 0, 0, {}, 0});
+    }
+    while (!frames.empty()) {
+      auto& frame = frames.back();
+      auto children = layout.Children(frame.node);
+      if (frame.next < children.size()) {
+        auto index = frame.next++;
+        auto child = children[index];
+        BeforeChild(frame, index);
+        if (layout.TreeKind(frame.node) == ETreeKind::Invoke && index == 0) {
+          // The name of the function isn't a variable
+          values.push_back({});
+        } else if (layout.Kind(child) == ENodeKind::Tree) {
+          frames.push_back({child, 0, values.size(), {}, 0});
+        } else {
+          PushLeaf(child);
+        }
+        continue;
+      }
+      auto done = frame;
+      frames.pop_back();
+      Complete(done);
+    }
+    assert(values.size() == 1);
+    auto result = values.back();
+    values.clear();
+    return result;
+  }
+
+  void PushLeaf(TNode node) {
+    switch (layout.Kind(node)) {
+      case ENodeKind::Number:
+        values.push_back(TIrValue::Const(layout.Number(node)));
+        return;
+      case ENodeKind::String:
+        function.strings.push_back(layout.String(node));
+        values.push_back({TIrValue::EKind::String, static_cast<int>(function.strings.size() - 1)});
+        return;
+      case ENodeKind::Id:
+        values.push_back(Var(layout.Symbol(node)));
+        return;
+      case ENodeKind::Tree:
+        break;
+    }
+    assert(false && "not a leaf");
+  }
+
+  /// The right hand side of `or` and `and` only runs if the left one doesn't
+  /// decide, it gets a block of its own
+  void BeforeChild(TFrame& frame, std::size_t index) {
+    auto kind = layout.TreeKind(frame.node);
+    if (index != 1 || (kind != ETreeKind::Or && kind != ETreeKind::And)) {
+      return;
+    }
+    frame.result = NewTemp();
+    Emit({EIrOp::Neq, frame.result, values.back(), TIrValue::Const(0), {}, {}});
+    values.pop_back();
+    auto right = NewBlock();
+    frame.join = NewBlock();
+    if (kind == ETreeKind::Or) {
+      Branch(frame.result, frame.join, right);
+    } else {
+      Branch(frame.result, right, frame.join);
+    }
+    current = right;
+  }
+
+  void Complete(const TFrame& frame) {
+    auto kind = layout.TreeKind(frame.node);
+    auto children = layout.Children(frame.node);
+    auto base = frame.base;
+    TIrValue result;
+    switch (kind) {
+      case ETreeKind::Or:
+      case ETreeKind::And:
+        Emit({EIrOp::Neq, frame.result, values[base], TIrValue::Const(0), {}, {}});
+        Jump(frame.join);
+        current = frame.join;
+        result = frame.result;
+        break;
+      case ETreeKind::Eq:
+      case ETreeKind::Neq:
+      case ETreeKind::Less:
+      case ETreeKind::Greater:
+      case ETreeKind::Minus:
+      case ETreeKind::Plus:
+      case ETreeKind::Mul: {
+        static_assert(static_cast<int>(EIrOp::Mul) - static_cast<int>(EIrOp::Eq) ==
+                      static_cast<int>(ETreeKind::Mul) - static_cast<int>(ETreeKind::Eq));
+        auto op = static_cast<EIrOp>(static_cast<int>(EIrOp::Eq) + static_cast<int>(kind) -
+                                     static_cast<int>(ETreeKind::Eq));
+        result = Emit(op, values[base], values[base + 1]);
+        break;
+      }
+      case ETreeKind::Not:
+        result = Emit(EIrOp::Not, values[base]);
+        break;
+      case ETreeKind::Assign: {
+        result = values[base];
+        Emit({EIrOp::Copy, result, values[base + 1], {}, {}, {}});
+        function.vars[result.index].assigned = true;
+        PYTOC_TRACE(Codegen, "assigning to {}", function.vars[result.index].name);
+        break;
+      }
+      case ETreeKind::Invoke:
+        result = CompleteInvoke(layout.Symbol(children[0]), base + 1);
+        break;
+      case ETreeKind::Arglist:
+        // The arguments stay on the stack for the call
+        return;
+      default:
+        assert(false && "not an expression");
+        return;
+    }
+    values.resize(base);
+    values.push_back(result);
+  }
+
+  TIrValue CompleteInvoke(TSymbol func, std::size_t args) {
+    auto count = values.size() - args;
+    switch (func.id) {
+      case builtins::PRINT:
+        assert(count == 1);
+        if (values[args].kind == TIrValue::EKind::String) {
+          Emit({EIrOp::PrintStr, {}, values[args], {}, {}, {}});
+        } else {
+          Emit({EIrOp::PrintInt, {}, values[args], {}, {}, {}});
+        }
+        return TIrValue::Const(0);
+      case builtins::INT: {
+        assert(count == 1);
+        auto& instrs = function.blocks[current].instrs;
+        if (!instrs.empty() && instrs.back().op == EIrOp::Input && instrs.back().dst == values[args]) {
+          // NOTE: the most common way to read a number, it's parsed right
+          // in the input buffer
+          instrs.back().op = EIrOp::ReadInt;
+          return values[args];
+        }
+        auto dst = NewTemp();
+        Emit({EIrOp::Atoi, dst, values[args], {}, {}, {}});
+        return dst;
+      }
+      case builtins::INPUT: {
+        assert(count == 0);
+        auto dst = NewTemp();
+        Emit({EIrOp::Input, dst, {}, {}, {}, {}});
+        return dst;
+      }
+      case builtins::RANGE:
+        Emit({EIrOp::Error, {}, {}, {}, "range(...) can only be iterated over", {}});
+        return TIrValue::Const(0);
+      default: {
+        auto dst = NewTemp();
+        Emit({EIrOp::Call, dst, {}, {}, func.name, {values.begin() + args, values.end()}});
+        return dst;
+      }
+    }
+  }
+
+  const TLayout& layout;
+  TIrFunction function;
+  std::size_t current = 0;
+  /// The variable a name refers to at the current point of the lowering
+  std::unordered_map<TSymbolId, int> vars;
+  /// The number of the variables with the name so far
+  std::unordered_map<TSymbolId, int> shadows;
+  std::vector<TFrame> frames;
+  std::vector<TIrValue> values;
+};
+
+inline TIrFunction LowerToIr(TPtr root) {
+  TTreeLayout layout;
+  return TIrBuilder<TTreeLayout>{layout}.Lower(root);
+}
+
+inline TIrFunction LowerToIr(const TFlatAst& ast) { return TIrBuilder<TFlatAst>{ast}.Lower(ast.root); }
@@ -0,0 +1,145 @@
+#include "libpytoc.hh"
+
+#include <memory>
+#include <utility>
+
+#include "driver.hh"
+#include "ir.hh"
+#include "optimize.hh"
+#include "parser.hh"
+#include "trace.hh"
+
+namespace {
+
+/// flex wants two zero bytes after the text
+std::string PadSource(std::string_view source) {
+  std::string buffer;
+  buffer.reserve(source.size() + 2);
+  buffer.append(source);
+  buffer.append(2, '\0');
+  return buffer;
+}
+
+/// Runs the parser over the input of the lexer, the AST is left in its context
+bool RunParser(TMyLexer& lex, const TParseOptions& options) {
+  if (options.pipeline) {
+    lex.RunAhead();
+  }
+  yy::parser p{&lex};
+#if YYDEBUG
+  p.set_debug_level(trace::IsEnabled(ETraceCategory::Parser));
+#endif
+  // NOTE: bison reports every failure through parser::error, the check only
+  // keeps the promise of TParsed
+  if (p.parse() != 0 && lex.ctx.errors.empty()) {
+    lex.ctx.errors.push_back({1, 1, 1, 1, "the parser failed"});
+  }
+  return lex.ctx.errors.empty();
+}
+
+/// Streams the C code of the folded AST, through the three-address code at
+/// -O2. NOTE: the three-address code refers to the strings of the AST
+void GenerateFolded(const TAst& ast, int level, TBufferedWriter& out) {
+  if (level < 2) {
+    GenerateC(ast.root, out);
+    return;
+  }
+  auto ir = LowerToIr(ast.root);
+  OptimizeIr(ir);
+  GenerateC(ir, out);
+}
+
+void GenerateFolded(const TFlatAst& ast, int level, TBufferedWriter& out) {
+  if (level < 2) {
+    GenerateC(ast, out);
+    return;
+  }
+  auto ir = LowerToIr(ast);
+  OptimizeIr(ir);
+  GenerateC(ir, out);
+}
+
+}  // namespace
+
+std::string TDiagnostic::Format(std::string_view file) const {
+  std::string result{file};
+  if (!result.empty()) {
+    result += ':';
+  }
+  result += std::to_string(line) + "." + std::to_string(column);
+  if (endLine > line) {
+    result += "-" + std::to_string(endLine) + "." + std::to_string(endColumn);
+  } else if (endColumn > column) {
+    result += "-" + std::to_string(endColumn);
+  }
+  return result + ": " + message;
+}
+
+TParsed<TAst> Parse(char* base, std::size_t size, const TParseOptions& options) {
+  TMyLexer lex{base, size};
+  if (!RunParser(lex, options)) {
+    return {std::nullopt, std::move(lex.ctx.errors)};
+  }
+  return {TAst{lex.ctx.result, lex.ctx.arena, lex.ctx.names}, {}};
+}
+
+TParsed<TFlatAst> ParseFlat(char* base, std::size_t size, const TParseOptions& options) {
+  TMyLexer lex{base, size};
+  lex.ctx.flat = std::make_unique<TFlatAstBuilder>();
+  if (!RunParser(lex, options)) {
+    return {std::nullopt, std::move(lex.ctx.errors)};
+  }
+  return {std::move(*lex.ctx.flat).Build(lex.ctx.flatRoot, lex.ctx.names), {}};
+}
+
+TParsed<TAst> Parse(std::string_view source, const TParseOptions& options) {
+  auto buffer = PadSource(source);
+  return Parse(buffer.data(), source.size(), options);
+}
+
+TParsed<TFlatAst> ParseFlat(std::string_view source, const TParseOptions& options) {
+  auto buffer = PadSource(source);
+  return ParseFlat(buffer.data(), source.size(), options);
+}
+
+void GenerateC(const TAst& ast, const TTranslateOptions& options, TBufferedWriter& out) {
+  if (options.level >= 1) {
+    GenerateFolded(FoldConstants(ast), options.level, out);
+  } else {
+    GenerateFolded(ast, options.level, out);
+  }
+}
+
+void GenerateC(const TFlatAst& ast, const TTranslateOptions& options, TBufferedWriter& out) {
+  if (options.level >= 1) {
+    GenerateFolded(FoldConstants(ast), options.level, out);
+  } else {
+    GenerateFolded(ast, options.level, out);
+  }
+}
+
+std::vector<TDiagnostic> Translate(char* base, std::size_t size, const TTranslateOptions& options,
+                                   TBufferedWriter& out) {
+  if (options.flat) {
+    auto parsed = ParseFlat(base, size, options.parse);
+    if (parsed.ast) {
+      GenerateC(*parsed.ast, options, out);
+    }
+    return std::move(parsed.errors);
+  }
+  auto parsed = Parse(base, size, options.parse);
+  if (parsed.ast) {
+    GenerateC(*parsed.ast, options, out);
+  }
+  return std::move(parsed.errors);
+}
+
+TTranslation Translate(std::string_view source, const TTranslateOptions& options) {
+  auto buffer = PadSource(source);
+  TTranslation result;
+  {
+    TBufferedWriter out{result.code};
+    result.errors = Translate(buffer.data(), source.size(), options, out);
+  }
+  return result;
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <cstddef>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "ast.hh"
+#include "flat_ast.hh"
+#include "writer.hh"
+
+/*******************************************************************************
+ *                                   libpytoc                                   *
+ *******************************************************************************/
+
+// The translator as a library. Every call owns all of its state (the lexer,
+// the arena, the names), so any number of threads can parse and translate at
+// once. Nothing is printed: the syntax errors come back as values. The only
+// process-wide setting is the tracing (see trace.hh), which is off unless
+// trace::Enable is called
+
+/// A syntax error. The lines and the columns start at 1, the end is the last
+/// character of the error
+struct TDiagnostic {
+  unsigned line = 0;
+  unsigned column = 0;
+  unsigned endLine = 0;
+  unsigned endColumn = 0;
+  std::string message;
+
+  /// "file:1.5-7: message", the way bison prints the locations
+  std::string Format(std::string_view file = {}) const;
+};
+
+/// The AST handle or the reasons there's none. The AST owns everything it
+/// refers to, the source may be gone by the time it is used
+template <class TTree>
+struct TParsed {
+  std::optional<TTree> ast;
+  std::vector<TDiagnostic> errors;
+};
+
+struct TParseOptions {
+  /// Lex on a separate thread while parsing, pays off for large inputs
+  bool pipeline = false;
+};
+
+/// Parses `size` bytes at `base` in place, without copying them. The buffer
+/// must be writable and have two zero bytes right after its end (see
+/// TMappedFile), flex writes into it while scanning
+TParsed<TAst> Parse(char* base, std::size_t size, const TParseOptions& options = {});
+TParsed<TFlatAst> ParseFlat(char* base, std::size_t size, const TParseOptions& options = {});
+
+/// Copies `source` into a buffer flex can scan
+TParsed<TAst> Parse(std::string_view source, const TParseOptions& options = {});
+TParsed<TFlatAst> ParseFlat(std::string_view source, const TParseOptions& options = {});
+
+struct TTranslateOptions {
+  /// 0: translate the code as it is written, 1: fold the constants, 2:
+  /// optimize the three-address code as well (see -O of pytoc)
+  int level = 1;
+  /// Build the flat AST, the C code is the same
+  bool flat = false;
+  TParseOptions parse;
+};
+
+/// Streams the C code of the parsed program to `out`
+void GenerateC(const TAst& ast, const TTranslateOptions& options, TBufferedWriter& out);
+void GenerateC(const TFlatAst& ast, const TTranslateOptions& options, TBufferedWriter& out);
+
+/// Parses the buffer in place (see Parse) and streams its C code to `out`.
+/// Returns the syntax errors, nothing is written if there are any
+std::vector<TDiagnostic> Translate(char* base, std::size_t size, const TTranslateOptions& options,
+                                   TBufferedWriter& out);
+
+/// The C code of a program or its syntax errors
+struct TTranslation {
+  std::string code;
+  std::vector<TDiagnostic> errors;
+};
+
+TTranslation Translate(std::string_view source, const TTranslateOptions& options = {});
@@ -0,0 +1,139 @@
+#include "linescan.hh"
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+namespace {
+
+/// The state of the sweep, shared by the vectorized and the scalar parts
+struct TLineScanner {
+  explicit TLineScanner(std::size_t size) {
+    // A rough guess to avoid most of the reallocations
+    lines.reserve(size / 32 + 1);
+  }
+
+  /// Handles a single character at `offset`
+  void Step(char c, std::size_t offset) {
+    if (c == '\n') {
+      NewLine(offset);
+    } else if (inLeading) {
+      if (c == ' ') {
+        current.indent++;
+      } else {
+        current.blank = false;
+        inLeading = false;
+      }
+    }
+  }
+
+  /// Handles `width` characters starting at `base` described by two bit masks:
+  /// bit i is set if the i-th character is a newline or a space respectively
+  void Step(std::uint32_t newlines, std::uint32_t spaces, std::size_t base, unsigned width) {
+    unsigned pos = 0;
+    while (pos < width) {
+      std::uint32_t ahead = ~std::uint32_t{0} << pos;
+      if (inLeading) {
+        std::uint32_t nonSpaces = ~spaces & ahead & WidthMask(width);
+        if (!nonSpaces) {
+          current.indent += width - pos;
+          return;
+        }
+        unsigned first = __builtin_ctz(nonSpaces);
+        current.indent += first - pos;
+        pos = first;
+        if (!(newlines >> first & 1)) {
+          current.blank = false;
+          inLeading = false;
+        }
+      }
+      std::uint32_t nextNewlines = newlines & ahead;
+      if (!nextNewlines) {
+        return;
+      }
+      unsigned nl = __builtin_ctz(nextNewlines);
+      NewLine(base + nl);
+      pos = nl + 1;
+    }
+  }
+
+  TLineIndex Finish() {
+    lines.push_back(current);
+    return std::move(lines);
+  }
+
+ private:
+  static std::uint32_t WidthMask(unsigned width) {
+    return width == 32 ? ~std::uint32_t{0} : (std::uint32_t{1} << width) - 1;
+  }
+
+  void NewLine(std::size_t offset) {
+    lines.push_back(current);
+    current = {static_cast<std::uint32_t>(offset + 1), 0, true};
+    inLeading = true;
+  }
+
+  TLineIndex lines;
+  TLineInfo current{0, 0, true};
+  bool inLeading = true;
+};
+
+}  // namespace
+
+namespace detail {
+
+TLineIndex ScanLinesScalar(std::string_view text) {
+  TLineScanner scanner{text.size()};
+  for (std::size_t i = 0; i < text.size(); i++) {
+    scanner.Step(text[i], i);
+  }
+  return scanner.Finish();
+}
+
+#if defined(__SSE2__)
+TLineIndex ScanLinesSse2(std::string_view text) {
+  TLineScanner scanner{text.size()};
+  const auto newline = _mm_set1_epi8('\n');
+  const auto space = _mm_set1_epi8(' ');
+  std::size_t i = 0;
+  for (; i + 16 <= text.size(); i += 16) {
+    auto chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(text.data() + i));
+    auto newlines = static_cast<std::uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, newline)));
+    auto spaces = static_cast<std::uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, space)));
+    scanner.Step(newlines, spaces, i, 16);
+  }
+  for (; i < text.size(); i++) {
+    scanner.Step(text[i], i);
+  }
+  return scanner.Finish();
+}
+
+__attribute__((target("avx2")))
+TLineIndex ScanLinesAvx2(std::string_view text) {
+  TLineScanner scanner{text.size()};
+  const auto newline = _mm256_set1_epi8('\n');
+  const auto space = _mm256_set1_epi8(' ');
+  std::size_t i = 0;
+  for (; i + 32 <= text.size(); i += 32) {
+    auto chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(text.data() + i));
+    auto newlines = static_cast<std::uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, newline)));
+    auto spaces = static_cast<std::uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, space)));
+    scanner.Step(newlines, spaces, i, 32);
+  }
+  for (; i < text.size(); i++) {
+    scanner.Step(text[i], i);
+  }
+  return scanner.Finish();
+}
+#endif
+
+}  // namespace detail
+
+TLineIndex ScanLines(std::string_view text) {
+#if defined(__SSE2__)
+  static const bool hasAvx2 = __builtin_cpu_supports("avx2");
+  return hasAvx2 ? detail::ScanLinesAvx2(text) : detail::ScanLinesSse2(text);
+#else
+  return detail::ScanLinesScalar(text);
+#endif
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <string_view>
+#include <vector>
+
+/*******************************************************************************
+ *                               Line pre-scan                                 *
+ *******************************************************************************/
+
+/// The longest text that can be scanned: the lines keep 32-bit offsets and
+/// flex keeps the size of its buffer, two end-of-buffer characters included,
+/// in an int
+constexpr std::size_t MAX_SCAN_SIZE = std::numeric_limits<int>::max() - 2;
+
+/// A line of the source as the indentation logic sees it
+struct TLineInfo {
+  /// Offset of the first character of the line
+  std::uint32_t begin;
+  /// The number of leading spaces
+  std::uint32_t indent;
+  /// Nothing but spaces before the newline (or the end of the text)
+  bool blank;
+
+  bool operator==(const TLineInfo& other) const {
+    return begin == other.begin && indent == other.indent && blank == other.blank;
+  }
+};
+
+/// One entry per line, the text after the last newline counts as a line too
+using TLineIndex = std::vector<TLineInfo>;
+
+/// Finds the lines of the whole text in one sweep, 32 or 16 bytes at a time
+/// when the CPU has AVX2 or SSE2
+TLineIndex ScanLines(std::string_view text);
+
+namespace detail {
+
+/// The implementations ScanLines picks from, exposed for the tests
+TLineIndex ScanLinesScalar(std::string_view text);
+#if defined(__SSE2__)
+TLineIndex ScanLinesSse2(std::string_view text);
+TLineIndex ScanLinesAvx2(std::string_view text);
+#endif
+
+}  // namespace detail
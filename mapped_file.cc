@@ -0,0 +1,84 @@
+#include "mapped_file.hh"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <utility>
+
+#include <spdlog/spdlog.h>
+
+std::optional<TMappedFile> TMappedFile::Open(const std::string& path) {
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    spdlog::error("can't open {}: {}", path, std::strerror(errno));
+    return std::nullopt;
+  }
+
+  struct stat st{};
+  if (::fstat(fd, &st) != 0) {
+    spdlog::error("can't stat {}: {}", path, std::strerror(errno));
+    ::close(fd);
+    return std::nullopt;
+  }
+
+  auto fileSize = static_cast<std::size_t>(st.st_size);
+  auto pageSize = static_cast<std::size_t>(::sysconf(_SC_PAGESIZE));
+  // Room for the two end-of-buffer characters, rounded up to whole pages
+  auto mappedSize = (fileSize + 2 + pageSize - 1) / pageSize * pageSize;
+
+  // Reserve zero-filled memory first and then put the file over its beginning.
+  // The bytes past the end of file are zero both in the last page of the file
+  // and in the anonymous pages after it, so no copy is needed to terminate it
+  void* region = ::mmap(nullptr, mappedSize, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (region == MAP_FAILED) {
+    spdlog::error("can't reserve memory for {}: {}", path, std::strerror(errno));
+    ::close(fd);
+    return std::nullopt;
+  }
+  if (fileSize > 0) {
+    void* file = ::mmap(region, fileSize, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_FIXED, fd, 0);
+    if (file == MAP_FAILED) {
+      spdlog::error("can't map {}: {}", path, std::strerror(errno));
+      ::munmap(region, mappedSize);
+      ::close(fd);
+      return std::nullopt;
+    }
+    ::madvise(file, fileSize, MADV_SEQUENTIAL);
+  }
+  // The mapping stays valid after the descriptor is closed
+  ::close(fd);
+
+  return TMappedFile{static_cast<char*>(region), fileSize, mappedSize};
+}
+
+TMappedFile::TMappedFile(TMappedFile&& other) noexcept
+    : base{std::exchange(other.base, nullptr)},
+      fileSize{std::exchange(other.fileSize, 0)},
+      mappedSize{std::exchange(other.mappedSize, 0)} {}
+
+TMappedFile& TMappedFile::operator=(TMappedFile&& other) noexcept {
+  if (this != &other) {
+    Unmap();
+    base = std::exchange(other.base, nullptr);
+    fileSize = std::exchange(other.fileSize, 0);
+    mappedSize = std::exchange(other.mappedSize, 0);
+  }
+  return *this;
+}
+
+TMappedFile::~TMappedFile() {
+  Unmap();
+}
+
+void TMappedFile::Unmap() {
+  if (base) {
+    ::munmap(base, mappedSize);
+    base = nullptr;
+  }
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <cstddef>
+#include <optional>
+#include <string>
+#include <string_view>
+
+/// A private writable mapping of a whole file that is followed by two zero
+/// bytes, i.e. exactly what flex wants from a buffer it scans in place (flex
+/// temporarily writes into the buffer, the writes never reach the file)
+class TMappedFile {
+ public:
+  /// Logs the reason and returns nullopt if the file can't be mapped
+  static std::optional<TMappedFile> Open(const std::string& path);
+
+  TMappedFile(TMappedFile&& other) noexcept;
+  TMappedFile& operator=(TMappedFile&& other) noexcept;
+  TMappedFile(const TMappedFile&) = delete;
+  TMappedFile& operator=(const TMappedFile&) = delete;
+  ~TMappedFile();
+
+  /// Size of the file contents, the two trailing zero bytes are not counted
+  std::size_t size() const { return fileSize; }
+
+  char* data() { return base; }
+
+  std::string_view view() const { return {base, fileSize}; }
+
+ private:
+  TMappedFile(char* base_, std::size_t fileSize_, std::size_t mappedSize_)
+      : base{base_}, fileSize{fileSize_}, mappedSize{mappedSize_} {}
+
+  void Unmap();
+
+  char* base = nullptr;
+  std::size_t fileSize = 0;
+  std::size_t mappedSize = 0;
+};
@@ -0,0 +1,89 @@
+#include "native.hh"
+
+#include <spawn.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <utility>
+
+#include <spdlog/spdlog.h>
+
+extern char** environ;
+
+namespace {
+
+/// The words of a variable like $CC="ccache gcc", without any shell quoting
+std::vector<std::string> SplitWords(const char* text) {
+  std::vector<std::string> words;
+  std::istringstream ss{text ? text : ""};
+  for (std::string word; ss >> word;) {
+    words.push_back(std::move(word));
+  }
+  return words;
+}
+
+}  // namespace
+
+TCCompiler TCCompiler::FromEnvironment() {
+  TCCompiler compiler;
+  compiler.command = SplitWords(std::getenv("CC"));
+  if (compiler.command.empty()) {
+    compiler.command.push_back("cc");
+  }
+  compiler.command.push_back("-O2");
+  // NOTE: a variable the program stores a string in is an int in the C code.
+  // That is the only warning the generated code is known to trigger, and an
+  // error by default in the newer compilers. The rest is up to $CFLAGS
+  compiler.command.push_back("-Wno-int-conversion");
+  for (auto& flag : SplitWords(std::getenv("CFLAGS"))) {
+    compiler.command.push_back(std::move(flag));
+  }
+  return compiler;
+}
+
+std::string TCCompiler::Describe() const {
+  std::string result;
+  for (auto& word : command) {
+    result += result.empty() ? "" : " ";
+    result += word;
+  }
+  return result;
+}
+
+bool TCCompiler::Compile(const std::string& source, const std::string& binary) const {
+  auto args = command;
+  args.insert(args.end(), {"-o", binary, source});
+  std::vector<char*> argv;
+  for (auto& arg : args) {
+    argv.push_back(arg.data());
+  }
+  argv.push_back(nullptr);
+
+  pid_t pid;
+  if (int error = ::posix_spawnp(&pid, argv[0], nullptr, nullptr, argv.data(), environ); error != 0) {
+    spdlog::error("can't run {}: {}", args[0], std::strerror(error));
+    return false;
+  }
+  int status = 0;
+  while (::waitpid(pid, &status, 0) < 0) {
+    if (errno != EINTR) {
+      spdlog::error("can't wait for {}: {}", args[0], std::strerror(errno));
+      return false;
+    }
+  }
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    spdlog::error("`{}` failed to compile {}", Describe(), source);
+    return false;
+  }
+  return true;
+}
+
+void ExecBinary(const std::string& path) {
+  char* argv[] = {const_cast<char*>(path.c_str()), nullptr};
+  ::execv(path.c_str(), argv);
+  spdlog::error("can't execute {}: {}", path, std::strerror(errno));
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+/// The system C compiler: $CC (or cc) with -O2, -Wno-int-conversion and the
+/// words of $CFLAGS
+class TCCompiler {
+ public:
+  static TCCompiler FromEnvironment();
+
+  /// The command without the files, part of the keys of the binaries
+  std::string Describe() const;
+
+  /// Compiles a C file into an executable, the diagnostics go to stderr.
+  /// Returns false if the compiler can't be run or fails
+  bool Compile(const std::string& source, const std::string& binary) const;
+
+ private:
+  std::vector<std::string> command;
+};
+
+/// Replaces the process with the binary, which gets the same stdin, stdout and
+/// stderr. Only returns if it can't be executed, the reason is logged
+void ExecBinary(const std::string& path);
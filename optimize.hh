@@ -0,0 +1,454 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <optional>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "arena.hh"
+#include "ast.hh"
+#include "flat_ast.hh"
+#include "symbols.hh"
+#include "trace.hh"
+
+/// Builds arena trees through the interface of TFlatAstBuilder, so that a pass
+/// can rebuild either layout
+class TTreeBuilder {
+ public:
+  explicit TTreeBuilder(TArena& arena_) : arena{arena_} {}
+
+  TPtr AddNumber(int val) { return arena.Make<TNumber>(val); }
+
+  /// `val` must live as long as the arena, it isn't copied
+  TPtr AddString(std::string_view val) { return arena.Make<TString>(val); }
+
+  TPtr AddId(TSymbol symbol) { return arena.Make<TId>(symbol); }
+
+  void AddChild(TPtr child) { children.push_back(child); }
+
+  /// A tree with the last `count` children passed to AddChild
+  TPtr AddTree(ETreeKind kind, std::size_t count) {
+    assert(count <= children.size());
+    auto first = children.data() + children.size() - count;
+    TPtr tree = arena.Make<TTree>(kind, arena.CopyArray(first, count));
+    children.resize(children.size() - count);
+    return tree;
+  }
+
+ private:
+  TArena& arena;
+  std::vector<TPtr> children;
+};
+
+/// Rebuilds an AST with the constant expressions folded, as the generated C
+/// would compute them: `2 * 3 + 1` becomes `7` and `1 == 1` becomes `1`.
+/// The variables assigned a constant are replaced with it until they may
+/// change, and an `if` or a `while` with a constant condition keeps only the
+/// branch that runs.
+/// TLayout reads the input (see TCGenerator) and TBuilder creates the output
+/// (TTreeBuilder or TFlatAstBuilder). The nodes are walked with an explicit
+/// stack, like in codegen
+template <typename TLayout, typename TBuilder>
+class TConstantFolder {
+ public:
+  using TNode = typename TLayout::TNode;
+  using TOut = decltype(std::declval<TBuilder&>().AddNumber(0));
+
+  TConstantFolder(const TLayout& layout_, TBuilder& out_) : layout{layout_}, out{out_} {}
+
+  /// Returns the root of the folded AST, `root` must be a file
+  TOut Fold(TNode root) {
+    assert(layout.Kind(root) == ENodeKind::Tree);
+    frames.push_back({root, 0, 0, {}, {}});
+    while (!frames.empty()) {
+      auto& frame = frames.back();
+      auto children = layout.Children(frame.node);
+      if (frame.next < children.size()) {
+        auto index = frame.next++;
+        auto child = children[index];
+        if (!BeforeChild(frame, index)) {
+          // A branch that never runs
+          results.push_back({EEntry::Block, {}, {}});
+        } else if (layout.Kind(child) == ENodeKind::Tree) {
+          frames.push_back({child, 0, results.size(), {}, {}});
+        } else {
+          PushLeaf(child, IsTarget(layout.TreeKind(frame.node), index));
+        }
+        continue;
+      }
+      auto done = std::move(frame);
+      frames.pop_back();
+      Complete(done);
+    }
+    assert(results.size() == 1 && results[0].kind == EEntry::Node);
+    return results[0].node;
+  }
+
+ private:
+  /// The constant values of the variables at the current point of the program
+  using TEnv = std::unordered_map<TSymbolId, int>;
+
+  enum class EEntry : std::uint8_t {
+    Node,
+    /// An expression that hasn't been built, only its value is known
+    Constant,
+    /// Closes the list of statements right before it. The lists are spliced
+    /// into the enclosing one, unless they have to become a node
+    Block,
+    /// A Block that is the body of an `else`
+    Else,
+  };
+
+  /// A folded node on the result stack. `value` is only known for the
+  /// expressions without side effects, so they can always be dropped
+  struct TEntry {
+    EEntry kind;
+    TOut node;
+    std::optional<int> value;
+  };
+
+  struct TFrame {
+    TNode node;
+    std::size_t next;
+    /// Where the results of the children start
+    std::size_t base;
+    /// The environments of the paths that join when the node is complete
+    TEnv saved;
+    TEnv other;
+  };
+
+  /// Returns false if the child never runs and must not be visited
+  bool BeforeChild(TFrame& frame, std::size_t index) {
+    switch (layout.TreeKind(frame.node)) {
+      case ETreeKind::IfStmt:
+        if (index == 1) {
+          if (auto condition = results[frame.base].value) {
+            return *condition != 0;
+          }
+          frame.saved = env;
+        } else if (index == 2) {
+          if (auto condition = results[frame.base].value) {
+            return *condition == 0;
+          }
+          frame.other = std::move(env);
+          env = std::move(frame.saved);
+        }
+        return true;
+      case ETreeKind::WhileLoop:
+        if (index == 0) {
+          Invalidate(frame.node);
+        } else if (index == 1) {
+          auto condition = results[frame.base].value;
+          if (condition && *condition == 0) {
+            return false;
+          }
+          frame.saved = env;
+        }
+        return true;
+      case ETreeKind::ForLoop:
+        // NOTE: the range is computed once, before the loop
+        if (index == 2) {
+          Invalidate(frame.node);
+          frame.saved = env;
+        }
+        return true;
+      case ETreeKind::Or:
+      case ETreeKind::And:
+        // The right hand side may not run
+        if (index == 1) {
+          frame.saved = env;
+        }
+        return true;
+      default:
+        return true;
+    }
+  }
+
+  /// Whether the identifier is a name rather than a use of a variable
+  static bool IsTarget(ETreeKind parent, std::size_t index) {
+    return index == 0 && (parent == ETreeKind::Assign || parent == ETreeKind::Iterator ||
+                          parent == ETreeKind::Invoke);
+  }
+
+  void PushLeaf(TNode node, bool target) {
+    switch (layout.Kind(node)) {
+      case ENodeKind::Number:
+        results.push_back({EEntry::Constant, {}, layout.Number(node)});
+        return;
+      case ENodeKind::String:
+        results.push_back({EEntry::Node, out.AddString(layout.String(node)), {}});
+        return;
+      case ENodeKind::Id: {
+        auto symbol = layout.Symbol(node);
+        if (auto it = env.find(symbol.id); !target && it != env.end()) {
+          results.push_back({EEntry::Constant, {}, it->second});
+        } else {
+          results.push_back({EEntry::Node, out.AddId(symbol), {}});
+        }
+        return;
+      }
+      case ENodeKind::Tree:
+        break;
+    }
+    assert(false && "not a leaf");
+  }
+
+  void Complete(TFrame& frame) {
+    auto kind = layout.TreeKind(frame.node);
+    auto base = frame.base;
+    switch (kind) {
+      case ETreeKind::File:
+        Splice(base);
+        Build(kind, base);
+        return;
+      case ETreeKind::Statements:
+        Splice(base);
+        results.push_back({EEntry::Block, {}, {}});
+        return;
+      case ETreeKind::ElseStmt:
+        assert(results.back().kind == EEntry::Block);
+        results.back().kind = EEntry::Else;
+        return;
+      case ETreeKind::IfStmt:
+        CompleteIf(frame);
+        return;
+      case ETreeKind::WhileLoop:
+        if (auto condition = results[base].value; condition && *condition == 0) {
+          PYTOC_TRACE(Codegen, "dropping a while loop that never runs");
+          results.resize(base);
+          results.push_back({EEntry::Block, {}, {}});
+          return;
+        }
+        env = std::move(frame.saved);
+        Collapse(base + 1, results.size() - 1);
+        Build(kind, base);
+        return;
+      case ETreeKind::ForLoop:
+        env = std::move(frame.saved);
+        Collapse(base + 2, results.size() - 1);
+        Build(kind, base);
+        return;
+      case ETreeKind::Condition:
+      case ETreeKind::RangeExpr:
+      case ETreeKind::Iterator:
+        Build(kind, base, results[base].value);
+        return;
+      case ETreeKind::Assign: {
+        auto symbol = layout.Symbol(layout.Children(frame.node)[0]);
+        if (auto value = results[base + 1].value) {
+          env[symbol.id] = *value;
+        } else {
+          env.erase(symbol.id);
+        }
+        Build(kind, base);
+        return;
+      }
+      case ETreeKind::Or:
+      case ETreeKind::And:
+        Join(frame.saved);
+        [[fallthrough]];
+      case ETreeKind::Eq:
+      case ETreeKind::Neq:
+      case ETreeKind::Less:
+      case ETreeKind::Greater:
+      case ETreeKind::Minus:
+      case ETreeKind::Plus:
+      case ETreeKind::Mul:
+        if (auto value = Evaluate(kind, results[base].value, results[base + 1].value)) {
+          results.resize(base);
+          results.push_back({EEntry::Constant, {}, value});
+          return;
+        }
+        Build(kind, base);
+        return;
+      case ETreeKind::Not:
+        if (auto value = results[base].value) {
+          results.resize(base);
+          results.push_back({EEntry::Constant, {}, *value == 0});
+          return;
+        }
+        Build(kind, base);
+        return;
+      case ETreeKind::SimpleStmt:
+      case ETreeKind::Invoke:
+      case ETreeKind::Arglist:
+        Build(kind, base);
+        return;
+    }
+  }
+
+  void CompleteIf(TFrame& frame) {
+    auto base = frame.base;
+    // The statements of the `if` end with the first Block after the condition
+    auto statementsEnd = base + 1;
+    while (results[statementsEnd].kind != EEntry::Block) {
+      statementsEnd++;
+    }
+    auto& cont = results.back();
+    if (auto condition = results[base].value) {
+      PYTOC_TRACE(Codegen, "dropping the {} branch of an if", *condition ? "else" : "then");
+      if (*condition) {
+        // the continuation is a dropped branch
+        results.pop_back();
+      } else {
+        if (cont.kind == EEntry::Node) {
+          // an `elif`
+          results.push_back({EEntry::Block, {}, {}});
+        } else {
+          cont.kind = EEntry::Block;
+        }
+        // the condition and the dropped statements
+        results.erase(results.begin() + base, results.begin() + statementsEnd + 1);
+        return;
+      }
+      results.erase(results.begin() + base);
+      return;
+    }
+
+    Join(frame.other);
+    if (cont.kind != EEntry::Node) {
+      // An `else` or the `elif`s that are left of a chain
+      Collapse(statementsEnd + 1, results.size() - 1);
+      Build(ETreeKind::ElseStmt, results.size() - 1);
+    }
+    Collapse(base + 1, statementsEnd);
+    Build(ETreeKind::IfStmt, base);
+  }
+
+  /// Removes the Block marks from the statements since `base`: the nested
+  /// lists become part of the list
+  void Splice(std::size_t base) {
+    auto it = std::remove_if(results.begin() + base, results.end(), [](const TEntry& entry) {
+      assert(entry.kind != EEntry::Else);
+      return entry.kind == EEntry::Block;
+    });
+    results.erase(it, results.end());
+  }
+
+  /// Builds the statements between `begin` and the Block mark at `end`
+  void Collapse(std::size_t begin, std::size_t end) {
+    assert(results[end].kind == EEntry::Block || results[end].kind == EEntry::Else);
+    for (auto i = begin; i < end; i++) {
+      out.AddChild(results[i].node);
+    }
+    auto statements = out.AddTree(ETreeKind::Statements, end - begin);
+    results.erase(results.begin() + begin + 1, results.begin() + end + 1);
+    results[begin] = {EEntry::Node, statements, {}};
+  }
+
+  /// Replaces the results since `base` with a tree of them
+  void Build(ETreeKind kind, std::size_t base, std::optional<int> value = std::nullopt) {
+    for (auto i = base; i < results.size(); i++) {
+      auto& entry = results[i];
+      assert(entry.kind == EEntry::Node || entry.kind == EEntry::Constant);
+      out.AddChild(entry.kind == EEntry::Constant ? out.AddNumber(*entry.value) : entry.node);
+    }
+    auto tree = out.AddTree(kind, results.size() - base);
+    results.resize(base);
+    results.push_back({EEntry::Node, tree, value});
+  }
+
+  /// Computes an operator the way C does. Returns nullopt if the result isn't
+  /// known: an operand isn't or the arithmetic overflows
+  static std::optional<int> Evaluate(ETreeKind kind, std::optional<int> lhs, std::optional<int> rhs) {
+    // NOTE: the right hand side doesn't run if the left one decides
+    if (kind == ETreeKind::Or && lhs && *lhs != 0) {
+      return 1;
+    } else if (kind == ETreeKind::And && lhs && *lhs == 0) {
+      return 0;
+    }
+    if (!lhs || !rhs) {
+      return std::nullopt;
+    }
+    long long a = *lhs;
+    long long b = *rhs;
+    long long result = 0;
+    switch (kind) {
+      case ETreeKind::Or:
+        return a != 0 || b != 0;
+      case ETreeKind::And:
+        return a != 0 && b != 0;
+      case ETreeKind::Eq:
+        return a == b;
+      case ETreeKind::Neq:
+        return a != b;
+      case ETreeKind::Less:
+        return a < b;
+      case ETreeKind::Greater:
+        return a > b;
+      case ETreeKind::Minus:
+        result = a - b;
+        break;
+      case ETreeKind::Plus:
+        result = a + b;
+        break;
+      case ETreeKind::Mul:
+        result = a * b;
+        break;
+      default:
+        return std::nullopt;
+    }
+    // The overflow is left to the runtime, it's undefined in C
+    if (result < std::numeric_limits<int>::min() || result > std::numeric_limits<int>::max()) {
+      return std::nullopt;
+    }
+    return static_cast<int>(result);
+  }
+
+  /// Forgets the variables that `loop` assigns, they change from one
+  /// iteration to the next
+  void Invalidate(TNode loop) {
+    std::vector<TNode> stack{loop};
+    while (!stack.empty()) {
+      auto node = stack.back();
+      stack.pop_back();
+      auto kind = layout.TreeKind(node);
+      auto children = layout.Children(node);
+      if (kind == ETreeKind::Assign || kind == ETreeKind::Iterator) {
+        env.erase(layout.Symbol(children[0]).id);
+      }
+      for (auto child : children) {
+        if (layout.Kind(child) == ENodeKind::Tree) {
+          stack.push_back(child);
+        }
+      }
+    }
+  }
+
+  /// Keeps the values that are the same on both paths
+  void Join(const TEnv& other) {
+    for (auto it = env.begin(); it != env.end();) {
+      auto found = other.find(it->first);
+      if (found == other.end() || found->second != it->second) {
+        it = env.erase(it);
+      } else {
+        ++it;
+      }
+    }
+  }
+
+  const TLayout& layout;
+  TBuilder& out;
+  TEnv env;
+  std::vector<TFrame> frames;
+  std::vector<TEntry> results;
+};
+
+/// The folded tree is allocated in the arena of `ast`
+inline TAst FoldConstants(const TAst& ast) {
+  TTreeLayout layout;
+  TTreeBuilder builder{*ast.arena};
+  auto root = TConstantFolder<TTreeLayout, TTreeBuilder>{layout, builder}.Fold(ast.root);
+  return {root, ast.arena, ast.names};
+}
+
+inline TFlatAst FoldConstants(const TFlatAst& ast) {
+  TFlatAstBuilder builder;
+  auto root = TConstantFolder<TFlatAst, TFlatAstBuilder>{ast, builder}.Fold(ast.root);
+  return std::move(builder).Build(root, ast.names);
+}
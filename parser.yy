@@ -15,9 +15,11 @@
 {
 #include <memory> // std::unique_ptr
 #include <string>
+#include <string_view>
 #include <vector>
 
 #include "ast.hh"
+#include "flat_ast.hh"
 
 namespace yy {}
 
@@ -32,19 +34,73 @@ struct TMyLexer;
 
 %code // *.cc
 {
+#include <charconv> // std::from_chars
 #include <climits>  // INT_MIN, INT_MAX
 #include <iostream>
 #include <sstream>
 
 #include "driver.hh"
 
+namespace {
+
+/// The nodes go either to the arena of the lexer, where they live as long as
+/// the AST, or to the flat AST if the parse was asked to build one
+TNodeRef Number(TMyLexer* lex, int val) {
+  if (auto& flat = lex->ctx.flat) {
+    return {nullptr, flat->AddNumber(val)};
+  }
+  return {lex->ctx.arena->Make<TNumber>(val)};
+}
+
+TNodeRef String(TMyLexer* lex, std::string_view val) {
+  if (auto& flat = lex->ctx.flat) {
+    return {nullptr, flat->AddString(val)};
+  }
+  return {lex->ctx.arena->Make<TString>(lex->ctx.arena->CopyString(val))};
+}
+
+TNodeRef Id(TMyLexer* lex, TSymbol symbol) {
+  if (auto& flat = lex->ctx.flat) {
+    return {nullptr, flat->AddId(symbol)};
+  }
+  return {lex->ctx.arena->Make<TId>(symbol)};
+}
+
+TNodeRef Tree(TMyLexer* lex, ETreeKind kind, const std::vector<TNodeRef>& children) {
+  if (auto& flat = lex->ctx.flat) {
+    for (auto& child : children) {
+      flat->AddChild(child.index);
+    }
+    return {nullptr, flat->AddTree(kind, children.size())};
+  }
+  auto& arena = *lex->ctx.arena;
+  auto array = arena.AllocateArray<TPtr>(children.size());
+  for (std::size_t i = 0; i < children.size(); i++) {
+    array[i] = children[i].ptr;
+  }
+  return {arena.Make<TTree>(kind, array)};
+}
+
+template <typename... Args>
+TNodeRef Tree(TMyLexer* lex, ETreeKind kind, Args... children) {
+  if (auto& flat = lex->ctx.flat) {
+    (flat->AddChild(children.index), ...);
+    return {nullptr, flat->AddTree(kind, sizeof...(children))};
+  }
+  return {MakeTree(*lex->ctx.arena, kind, children.ptr...)};
+}
+
+} // namespace
+
 }
 
 
 /* https://www.gnu.org/software/bison/manual/html_node/Token-Decl.html */
-%token <std::string> ID;
-%token <std::string> STRING;
-%token <std::string> NUMBER;
+/* The token texts point into the source buffer owned by the lexer, only the */
+/* nodes that keep them make a copy */
+%token <TSymbol> ID;
+%token <std::string_view> STRING;
+%token <std::string_view> NUMBER;
 %token INDENT;
 %token DEDENT;
 %token LF;
@@ -70,36 +126,40 @@ struct TMyLexer;
 %token ELSE "else";
 %token WHILE "while";
 
-%printer { yyo << $$; } <std::string>;
+%printer { yyo << $$; } <std::string_view>;
+%printer { yyo << $$.name; } <TSymbol>;
 
 %%
 
 %start file;
 
-%nterm <std::shared_ptr<TTree>> file;
+%nterm <TNodeRef> file;
 file:
     statements {
-        $$ = std::make_shared<TTree>(
-            "file",
+        $$ = Tree(
+            lex,
+            ETreeKind::File,
             $1
         );
-        lex->ctx.result = $$;
+        lex->ctx.result = $$.ptr;
+        lex->ctx.flatRoot = $$.index;
     }
 ;
 
-%nterm <std::vector<TPtr>> statements;
+/* The lists are left-recursive: every element is appended to the vector that */
+/* has been built so far, which is moved rather than copied */
+%nterm <std::vector<TNodeRef>> statements;
 statements:
-    statement statements {
-        $$ = std::vector<TPtr>{};
-        $$.push_back($1);
-        $$.insert($$.end(), $2.begin(), $2.end());
+    %empty {
+        $$ = std::vector<TNodeRef>{};
     }
-    | %empty {
-        $$ = std::vector<TPtr>{};
+    | statements statement {
+        $$ = $1;
+        $$.push_back($2);
     }
 ;
 
-%nterm <std::shared_ptr<TTree>> statement;
+%nterm <TNodeRef> statement;
 statement:
     compound_stmt {
         $$ = $1;
@@ -109,63 +169,69 @@ statement:
     }
 ;
 
-%nterm <std::shared_ptr<TTree>> simple_stmt;
+%nterm <TNodeRef> simple_stmt;
 simple_stmt:
     expr LF {
-        $$ = std::make_shared<TTree>("simple_stmt", $1);
+        $$ = Tree(lex, ETreeKind::SimpleStmt, $1);
     }
 ;
 
 // expr in `if` must be of type int
 // expr in `for` must be of special `range` type
-%nterm <std::shared_ptr<TTree>> compound_stmt;
+%nterm <TNodeRef> compound_stmt;
 compound_stmt:
     "if" expr ":" LF INDENT statements DEDENT if_cont {
-        $$ = std::make_shared<TTree>(
-             "if_stmt",
-             std::make_shared<TTree>("condition", $2),
-             std::make_shared<TTree>("statements", $6),
+        $$ = Tree(
+            lex,
+             ETreeKind::IfStmt,
+             Tree(lex, ETreeKind::Condition, $2),
+             Tree(lex, ETreeKind::Statements, $6),
              $8
         );
     }
     | "for" ID "in" expr ":" LF INDENT statements DEDENT {
 
-        $$ = std::make_shared<TTree>(
-            "for_loop",
-            std::make_shared<TTree>("iterator", std::make_shared<TId>($2)),
-            std::make_shared<TTree>("range_expr", $4),
-            std::make_shared<TTree>("statements", $8)
+        $$ = Tree(
+            lex,
+            ETreeKind::ForLoop,
+            Tree(lex, ETreeKind::Iterator, Id(lex, $2)),
+            Tree(lex, ETreeKind::RangeExpr, $4),
+            Tree(lex, ETreeKind::Statements, $8)
         );
     }
     | "while" expr ":" LF INDENT statements DEDENT {
-         $$ = std::make_shared<TTree>(
-            "while_loop",
-             std::make_shared<TTree>("condition", $2),
-            std::make_shared<TTree>("statements", $6)
+         $$ = Tree(
+            lex,
+            ETreeKind::WhileLoop,
+             Tree(lex, ETreeKind::Condition, $2),
+            Tree(lex, ETreeKind::Statements, $6)
          );
     }
 ;
 
-%nterm <std::shared_ptr<TTree>> if_cont;
+%nterm <TNodeRef> if_cont;
 if_cont:
     "elif" expr ":" LF INDENT statements DEDENT if_cont {
-        $$ = std::make_shared<TTree>(
-            "if_stmt",
-            std::make_shared<TTree>("condition", $2),
-            std::make_shared<TTree>("statements", $6),
+        $$ = Tree(
+            lex,
+            ETreeKind::IfStmt,
+            Tree(lex, ETreeKind::Condition, $2),
+            Tree(lex, ETreeKind::Statements, $6),
             $8
         );
     }
     | "else" ":" LF INDENT statements DEDENT {
-        $$ = std::make_shared<TTree>(
-            "else_stmt",
-            std::make_shared<TTree>("statements", $5)
+        $$ = Tree(
+            lex,
+            ETreeKind::ElseStmt,
+            Tree(lex, ETreeKind::Statements, $5)
         );
     }
     | %empty {
-        $$ = std::make_shared<TTree>(
-            "else_stmt",
-            std::make_shared<TTree>("statements")
+        $$ = Tree(
+            lex,
+            ETreeKind::ElseStmt,
+            Tree(lex, ETreeKind::Statements)
         );
     }
 ;
@@ -186,55 +252,61 @@ if_cont:
 %left "*";
 
 /* TODO: use union in generated C code for values (it's safe in C) */
-%nterm <TPtr> expr;
+%nterm <TNodeRef> expr;
 expr:
     NUMBER {
-        $$ = std::make_shared<TNumber>(std::stoi($1));
+        auto text = $1;
+        int val{};
+        auto [_, ec] = std::from_chars(text.data(), text.data() + text.size(), val);
+        if (ec != std::errc{}) {
+            throw syntax_error(@1, "invalid integer literal");
+        }
+        $$ = Number(lex, val);
     }
     | STRING {
-        $$ = std::make_shared<TString>($1);
+        $$ = String(lex, $1);
     }
     | ID {
-        $$ = std::make_shared<TId>($1);
+        $$ = Id(lex, $1);
     }
     | ID "=" expr {
-        $$ = std::make_shared<TTree>("assign", std::make_shared<TId>($1), $3);
+        $$ = Tree(lex, ETreeKind::Assign, Id(lex, $1), $3);
     }
     | ID "(" arglist ")" {
-        $$ = std::make_shared<TTree>("invoke", std::make_shared<TId>($1), std::make_shared<TTree>("arglist", $3));
+        $$ = Tree(lex, ETreeKind::Invoke, Id(lex, $1), Tree(lex, ETreeKind::Arglist, $3));
     }
     | "(" expr ")" { $$ = $2; }
-    | expr "or" expr { $$ = std::make_shared<TTree>("||", $1, $3); }
-    | expr "and" expr { $$ = std::make_shared<TTree>("&&", $1, $3); }
-    | "not" expr { $$ = std::make_shared<TTree>("!", $2); }
-    | expr "==" expr { $$ = std::make_shared<TTree>("==", $1, $3); }
-    | expr "!=" expr { $$ = std::make_shared<TTree>("!=", $1, $3); }
-    | expr "<" expr { $$ = std::make_shared<TTree>("<", $1, $3); }
-    | expr ">" expr { $$ = std::make_shared<TTree>(">", $1, $3); }
-    | expr "-" expr { $$ = std::make_shared<TTree>("-", $1, $3); }
-    | expr "+" expr { $$ = std::make_shared<TTree>("+", $1, $3); }
-    | expr "*" expr { $$ = std::make_shared<TTree>("*", $1, $3); }
+    | expr "or" expr { $$ = Tree(lex, ETreeKind::Or, $1, $3); }
+    | expr "and" expr { $$ = Tree(lex, ETreeKind::And, $1, $3); }
+    | "not" expr { $$ = Tree(lex, ETreeKind::Not, $2); }
+    | expr "==" expr { $$ = Tree(lex, ETreeKind::Eq, $1, $3); }
+    | expr "!=" expr { $$ = Tree(lex, ETreeKind::Neq, $1, $3); }
+    | expr "<" expr { $$ = Tree(lex, ETreeKind::Less, $1, $3); }
+    | expr ">" expr { $$ = Tree(lex, ETreeKind::Greater, $1, $3); }
+    | expr "-" expr { $$ = Tree(lex, ETreeKind::Minus, $1, $3); }
+    | expr "+" expr { $$ = Tree(lex, ETreeKind::Plus, $1, $3); }
+    | expr "*" expr { $$ = Tree(lex, ETreeKind::Mul, $1, $3); }
 ;
 
-%nterm <std::vector<TPtr>> arglist;
+%nterm <std::vector<TNodeRef>> arglist;
 arglist:
-    expr arglist-cont {
-        $$ = std::move($2);
-        $$.insert($$.begin(), $1);
+    args {
+        $$ = $1;
     }
     | %empty {
-        $$ = std::vector<TPtr>{};
+        $$ = std::vector<TNodeRef>{};
     }
 ;
 
-%nterm <std::vector<TPtr>> arglist-cont;
-arglist-cont:
-    %empty {
-        $$ = std::vector<TPtr>{};
+%nterm <std::vector<TNodeRef>> args;
+args:
+    expr {
+        $$ = std::vector<TNodeRef>{};
+        $$.push_back($1);
     }
-    | "," expr arglist-cont {
-        $$ = std::move($3);
-        $$.insert($$.begin(), $2);
+    | args "," expr {
+        $$ = $1;
+        $$.push_back($3);
     }
 ;
 
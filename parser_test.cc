@@ -1,8 +1,23 @@
 #include <gtest/gtest.h>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <functional>
 #include <iostream>
+#include <optional>
+#include <random>
+#include <sstream>
+#include <thread>
+#include <tuple>
 #include <vector>
 
+#include <pthread.h>
+#include <unistd.h>
+
 // #include <fmt/core.h>
 // #include <fmt/ranges.h>
 
@@ -19,8 +34,19 @@
 #include "ast.hh"
 #include "cpputils/common.hh"
 
+#include "batch.hh"
+#include "cache.hh"
 #include "driver.hh"
+#include "hash.hh"
+#include "ir.hh"
+#include "libpytoc.hh"
+#include "linescan.hh"
+#include "mapped_file.hh"
+#include "native.hh"
+#include "optimize.hh"
 #include "parser.hh"
+#include "serve.hh"
+#include "vm.hh"
 
 using TParam = std::pair<std::string, std::vector<std::pair<yy::parser::token_kind_type, std::string>>>;
 
@@ -169,6 +195,15 @@ const std::vector<TParam> PARAMS = {
       {tkt::NUMBER, "8"},
     }
   },
+  {
+    "a\n    \n  \n\nb\n   ",
+    {
+      {tkt::ID, "a"},
+      {tkt::LF, ""},
+      {tkt::ID, "b"},
+      {tkt::LF, ""},
+    }
+  },
   {
     "a = 1\nb = 2",
     {
@@ -250,23 +285,1039 @@ TEST_P(TTokenizerTest, Tokens) {
   EXPECT_EQ(expected, got);
 }
 
+TEST_P(TTokenizerTest, MappedTokens) {
+  auto [contents, expected] = GetParam();
+  auto path = std::filesystem::temp_directory_path() / "parser_test_mapped.py";
+  std::ofstream{path} << contents;
+
+  auto file = TMappedFile::Open(path);
+  ASSERT_TRUE(file);
+  ASSERT_EQ(file->view(), contents);
+  TMyLexer lex{file->data(), file->size()};
+
+  std::vector<std::pair<yy::parser::token_kind_type, std::string>> got;
+  for (auto lexRes = lex.mylex(); lexRes.type != yy::parser::token_kind_type::YYEOF; lexRes = lex.mylex()) {
+    got.emplace_back(lexRes.type, lexRes.text);
+  }
+  std::filesystem::remove(path);
+
+  EXPECT_EQ(expected, got);
+}
+
+TEST_P(TTokenizerTest, PipelinedTokens) {
+  auto [contents, expected] = GetParam();
+  std::stringstream ss{contents};
+  TMyLexer lex{&ss};
+  lex.RunAhead();
+
+  std::vector<std::pair<yy::parser::token_kind_type, std::string>> got;
+  for (auto lexRes = lex.next(); lexRes.type != yy::parser::token_kind_type::YYEOF; lexRes = lex.next()) {
+    got.emplace_back(lexRes.type, lexRes.text);
+  }
+
+  EXPECT_EQ(expected, got);
+}
+
 INSTANTIATE_TEST_SUITE_P(Parametrized, TTokenizerTest, testing::ValuesIn(PARAMS));
 
+TEST(LineScanTest, Lines) {
+  TLineIndex expected = {
+    {0, 0, false},
+    {3, 4, false},
+    {9, 2, true},
+    {12, 0, true},
+    {13, 1, false},
+    {16, 0, true},
+  };
+  EXPECT_EQ(ScanLines("a:\n    b\n  \n\n c\n"), expected);
+  EXPECT_EQ(ScanLines(""), (TLineIndex{{0, 0, true}}));
+}
+
+TEST(LineScanTest, VectorizedMatchesScalar) {
+  // Long runs of spaces and newlines cross the chunk boundaries in every way
+  std::mt19937 gen{42};
+  const std::string alphabet = "      \n\nab";
+  std::uniform_int_distribution<std::size_t> pick{0, alphabet.size() - 1};
+  for (int size : {0, 1, 15, 16, 17, 31, 32, 33, 100, 1000, 10000}) {
+    std::string text;
+    for (int i = 0; i < size; i++) {
+      text.push_back(alphabet[pick(gen)]);
+    }
+    auto expected = detail::ScanLinesScalar(text);
+    EXPECT_EQ(ScanLines(text), expected);
+#if defined(__SSE2__)
+    EXPECT_EQ(detail::ScanLinesSse2(text), expected);
+    if (__builtin_cpu_supports("avx2")) {
+      EXPECT_EQ(detail::ScanLinesAvx2(text), expected);
+    }
+#endif
+  }
+}
+
+TEST(LineScanTest, TooLarge) {
+  // the text isn't read, its size is enough
+  char text[] = "print(1)\n\0";
+  auto parsed = Parse(text, MAX_SCAN_SIZE + 1);
+  EXPECT_FALSE(parsed.ast);
+  ASSERT_EQ(parsed.errors.size(), 1);
+  EXPECT_NE(parsed.errors[0].message.find("too large"), std::string::npos);
+  EXPECT_TRUE(Parse(text, sizeof(text) - 2).ast);
+}
+
+TEST(InternerTest, Ids) {
+  TInterner names;
+  EXPECT_EQ(names.Intern("print").id, builtins::PRINT);
+  EXPECT_EQ(names.Intern("int").id, builtins::INT);
+  EXPECT_EQ(names.Intern("input").id, builtins::INPUT);
+  EXPECT_EQ(names.Intern("range").id, builtins::RANGE);
+
+  std::string name = "counter";
+  auto first = names.Intern(name);
+  name = "other";
+  auto second = names.Intern("counter");
+  EXPECT_EQ(first.id, second.id);
+  EXPECT_EQ(first.name.data(), second.name.data());
+  EXPECT_EQ(names.Name(first.id), "counter");
+  EXPECT_NE(names.Intern(name).id, first.id);
+}
+
+TEST(InternerTest, VariablesInAssignmentOrder) {
+  std::stringstream ss{"zeta = 1\nalpha = 2\nzeta = alpha\nmid = 3\n"};
+  TMyLexer lex{&ss};
+  yy::parser p{&lex};
+  ASSERT_EQ(p.parse(), 0);
+
+  TPyToCVisitor visitor;
+  auto code = lex.ctx.result->accept(&visitor);
+  EXPECT_NE(code.find("int zeta = 0, alpha = 0, mid = 0;"), std::string::npos) << code;
+}
+
+TEST(PipelineTest, SameTreeAsSequential) {
+  // Long enough to wrap around the ring a few times
+  std::string program;
+  for (int i = 0; i < 5000; i++) {
+    program += "if a" + std::to_string(i) + " < 3:\n    print(a" + std::to_string(i) + ")\n";
+  }
+
+  auto print = [&](bool pipelined) {
+    std::stringstream ss{program};
+    TMyLexer lex{&ss};
+    if (pipelined) {
+      lex.RunAhead();
+    }
+    yy::parser p{&lex};
+    EXPECT_EQ(p.parse(), 0);
+    std::stringstream out;
+    TPrintVisitor pv{out};
+    lex.ctx.result->accept(&pv);
+    return out.str();
+  };
+
+  EXPECT_EQ(print(false), print(true));
+}
+
+TEST(PipelineTest, ParserStopsEarly) {
+  // The lexing thread must not hang when the parser gives up on an error
+  std::string program = ") (\n";
+  for (int i = 0; i < 100000; i++) {
+    program += "a = 1\n";
+  }
+  std::stringstream ss{program};
+  TMyLexer lex{&ss};
+  lex.RunAhead();
+  yy::parser p{&lex};
+  EXPECT_NE(p.parse(), 0);
+}
+
+TEST(ParserScalingTest, LinearInStatementsAndArguments) {
+  auto program = [](int n) {
+    std::string result = "f(0";
+    for (int i = 1; i < n; i++) {
+      result += ", " + std::to_string(i);
+    }
+    result += ")\n";
+    for (int i = 0; i < n; i++) {
+      result += "a = a + " + std::to_string(i) + "\n";
+    }
+    return result;
+  };
+  // the best of a few runs to keep the noise out
+  auto parseSeconds = [](const std::string& text) {
+    double best = 1e100;
+    for (int i = 0; i < 3; i++) {
+      std::stringstream ss{text};
+      TMyLexer lex{&ss};
+      yy::parser p{&lex};
+      auto start = std::chrono::steady_clock::now();
+      EXPECT_EQ(p.parse(), 0);
+      std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+      best = std::min(best, elapsed.count());
+    }
+    return best;
+  };
+
+  constexpr int N = 20000;
+  auto small = parseSeconds(program(N));
+  auto large = parseSeconds(program(8 * N));
+  // 8 times the input: linear growth gives ~8x, quadratic would give ~64x
+  EXPECT_LT(large / small, 20) << "small: " << small << "s, large: " << large << "s";
+}
+
+TEST(FlatAstTest, SameOutputAsTree) {
+  const std::string program = R"(n = int(input())
+if n < 0 and not n == 1:
+    print("negative")
+elif n != 0 or n > 10:
+    for i in range(1, n * 2 + 1, 3):
+        print(i - 1)
+else:
+    while n < 10:
+        n = n + 1
+print(n)
+)";
+
+  auto parse = [&](bool flat) {
+    std::stringstream ss{program};
+    auto lex = std::make_unique<TMyLexer>(&ss);
+    if (flat) {
+      lex->ctx.flat = std::make_unique<TFlatAstBuilder>();
+    }
+    yy::parser p{lex.get()};
+    EXPECT_EQ(p.parse(), 0);
+    return lex;
+  };
+
+  auto tree = parse(false);
+  auto flatLex = parse(true);
+  EXPECT_EQ(flatLex->ctx.result, nullptr);
+  auto flat = std::move(*flatLex->ctx.flat).Build(flatLex->ctx.flatRoot, flatLex->ctx.names);
+
+  std::stringstream treeText, flatText;
+  TPrintVisitor pv{treeText};
+  tree->ctx.result->accept(&pv);
+  PrintFlatAst(flat, flatText);
+  EXPECT_EQ(treeText.str(), flatText.str());
+
+  TPyToCVisitor visitor;
+  EXPECT_EQ(tree->ctx.result->accept(&visitor), TFlatPyToC{flat}.Translate());
+
+  // Pre-order: the first child of every tree follows it right away
+  for (TFlatAst::TIndex node = 0; node < flat.size(); node++) {
+    auto children = flat.Children(node);
+    if (children.size() != 0) {
+      EXPECT_EQ(children[0], node + 1);
+    }
+  }
+}
+
+/// Runs `f` on a thread with a small stack: recursing once per nesting level
+/// would overflow it long before the depths below
+void RunWithSmallStack(const std::function<void()>& f) {
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setstacksize(&attr, 512 << 10);
+  pthread_t thread;
+  auto call = [](void* arg) -> void* {
+    (*static_cast<const std::function<void()>*>(arg))();
+    return nullptr;
+  };
+  ASSERT_EQ(pthread_create(&thread, &attr, call, const_cast<std::function<void()>*>(&f)), 0);
+  pthread_join(thread, nullptr);
+  pthread_attr_destroy(&attr);
+}
+
+TEST(DeepNestingTest, BoundedStack) {
+  constexpr int DEPTH = 100000;
+
+  // `not not ... 1` nests to the right and `1 + 1 + ... 1` to the left
+  auto nots = [](int depth) {
+    std::string program = "a = ";
+    for (int i = 0; i < depth; i++) {
+      program += "not ";
+    }
+    return program + "1\n";
+  };
+  auto sums = [](int depth) {
+    std::string program = "b = 1";
+    for (int i = 0; i < depth; i++) {
+      program += " + 1";
+    }
+    return program + "\n";
+  };
+
+  auto lines = [](const std::string& text) {
+    return std::count(text.begin(), text.end(), '\n');
+  };
+
+  // The number of printed nodes: file, simple_stmt, assign and the variable
+  // come on top of the expression
+  const std::pair<std::string, long> cases[] = {
+    {nots(DEPTH), DEPTH + 5},
+    {sums(DEPTH), 2 * DEPTH + 5},
+  };
+  for (const auto& test : cases) {
+    RunWithSmallStack([&] {
+      std::stringstream ss{test.first};
+      auto lex = std::make_unique<TMyLexer>(&ss);
+      yy::parser p{lex.get()};
+      ASSERT_EQ(p.parse(), 0);
+      std::stringstream out;
+      TPrintVisitor pv{out, ""};
+      lex->ctx.result->accept(&pv);
+      EXPECT_EQ(lines(out.str()), test.second);
+      // the tree is torn down with the lexer
+    });
+
+    RunWithSmallStack([&] {
+      std::stringstream ss{test.first};
+      auto lex = std::make_unique<TMyLexer>(&ss);
+      lex->ctx.flat = std::make_unique<TFlatAstBuilder>();
+      yy::parser p{lex.get()};
+      ASSERT_EQ(p.parse(), 0);
+      auto flat = std::move(*lex->ctx.flat).Build(lex->ctx.flatRoot, lex->ctx.names);
+      std::stringstream out;
+      PrintFlatAst(flat, out, "");
+      EXPECT_EQ(lines(out.str()), test.second);
+
+      // the whole expression folds into a number
+      std::stringstream folded;
+      PrintFlatAst(FoldConstants(flat), folded, "");
+      EXPECT_EQ(lines(folded.str()), 5);
+
+      // and so it does in the three-address code, where nothing reads it
+      auto ir = LowerToIr(flat);
+      OptimizeIr(ir);
+      for (auto& block : ir.blocks) {
+        EXPECT_TRUE(block.instrs.empty());
+      }
+    });
+  }
+
+  for (auto program : {nots(DEPTH), sums(DEPTH)}) {
+    RunWithSmallStack([&] {
+      std::stringstream ss{program};
+      auto lex = std::make_unique<TMyLexer>(&ss);
+      lex->ctx.flat = std::make_unique<TFlatAstBuilder>();
+      yy::parser p{lex.get()};
+      ASSERT_EQ(p.parse(), 0);
+      auto flat = std::move(*lex->ctx.flat).Build(lex->ctx.flatRoot, lex->ctx.names);
+      auto code = TFlatPyToC{flat}.Translate();
+
+      std::stringstream again{program};
+      auto treeLex = std::make_unique<TMyLexer>(&again);
+      yy::parser treeParser{treeLex.get()};
+      ASSERT_EQ(treeParser.parse(), 0);
+      TPyToCVisitor visitor;
+      EXPECT_EQ(treeLex->ctx.result->accept(&visitor), code);
+    });
+  }
+}
+
+TEST(FoldTest, SameAsFoldedSource) {
+  const std::pair<std::string, std::string> cases[] = {
+    {"x = 2 * 3 + 1\nprint(x + 1)\n", "x = 7\nprint(8)\n"},
+    {"if 1 == 1:\n    print(1)\nelse:\n    print(2)\n", "print(1)\n"},
+    {"if not 1:\n    print(1)\nelif 0:\n    print(2)\nelse:\n    print(3)\nprint(4)\n",
+     "print(3)\nprint(4)\n"},
+    {"if n:\n    print(1)\nelif 1 < 2:\n    print(2)\nelse:\n    print(3)\n",
+     "if n:\n    print(1)\nelse:\n    print(2)\n"},
+    {"while 0:\n    print(1)\nprint(2)\n", "print(2)\n"},
+    // the value depends on the path or the iteration
+    {"x = 1\nif n:\n    x = 2\nprint(x)\n", "x = 1\nif n:\n    x = 2\nprint(x)\n"},
+    {"x = 1\nif n:\n    x = 1\nprint(x)\n", "x = 1\nif n:\n    x = 1\nprint(1)\n"},
+    {"x = 1\nwhile x < 10:\n    x = x * 2\nprint(x)\n",
+     "x = 1\nwhile x < 10:\n    x = x * 2\nprint(x)\n"},
+    {"n = 3\nfor i in range(n):\n    n = i\nprint(n)\n",
+     "n = 3\nfor i in range(3):\n    n = i\nprint(n)\n"},
+    {"x = 1\ny = n or (x = 2)\nprint(x)\n", "x = 1\ny = n or (x = 2)\nprint(x)\n"},
+    // `input` never runs, the overflow is left to C
+    {"print(0 and input())\nprint(2147483647 + 1)\n", "print(0)\nprint(2147483647 + 1)\n"},
+  };
+
+  auto parse = [](const std::string& program, bool flat) {
+    std::stringstream ss{program};
+    auto lex = std::make_unique<TMyLexer>(&ss);
+    if (flat) {
+      lex->ctx.flat = std::make_unique<TFlatAstBuilder>();
+    }
+    yy::parser p{lex.get()};
+    EXPECT_EQ(p.parse(), 0);
+    return lex;
+  };
+
+  for (const auto& test : cases) {
+    std::stringstream expected;
+    TPrintVisitor pv{expected};
+    parse(test.second, false)->ctx.result->accept(&pv);
+
+    auto tree = parse(test.first, false);
+    auto folded = FoldConstants(TAst{tree->ctx.result, tree->ctx.arena, tree->ctx.names});
+    std::stringstream treeText;
+    TPrintVisitor treePv{treeText};
+    folded.root->accept(&treePv);
+    EXPECT_EQ(treeText.str(), expected.str()) << test.first;
+
+    auto flatLex = parse(test.first, true);
+    auto flat = std::move(*flatLex->ctx.flat).Build(flatLex->ctx.flatRoot, flatLex->ctx.names);
+    std::stringstream flatText;
+    PrintFlatAst(FoldConstants(flat), flatText);
+    EXPECT_EQ(flatText.str(), expected.str()) << test.first;
+  }
+}
+
+/// Compiles the C code with the system compiler (see TCCompiler) and runs it
+/// on `stdinText`. Returns the output, nullopt if the code doesn't compile
+std::optional<std::string> RunC(const std::string& code, const std::string& stdinText) {
+  auto dir = std::filesystem::temp_directory_path() / ("parser_test_c." + std::to_string(::getpid()));
+  std::filesystem::create_directories(dir);
+  std::ofstream{dir / "program.c"} << code;
+  std::ofstream{dir / "stdin"} << stdinText;
+  std::optional<std::string> output;
+  if (TCCompiler::FromEnvironment().Compile(dir / "program.c", dir / "program")) {
+    auto command = (dir / "program").string() + " < " + (dir / "stdin").string() + " > " +
+                   (dir / "stdout").string();
+    // NOTE: the runtime exits with an error at the end of the input, the
+    // output is compared anyway
+    [[maybe_unused]] int status = std::system(command.c_str());
+    std::ifstream in{dir / "stdout"};
+    output.emplace(std::istreambuf_iterator<char>{in}, std::istreambuf_iterator<char>{});
+  }
+  std::filesystem::remove_all(dir);
+  return output;
+}
+
+TEST(IrTest, Optimizations) {
+  auto lower = [](const std::string& program) {
+    std::stringstream ss{program};
+    auto lex = std::make_unique<TMyLexer>(&ss);
+    yy::parser p{lex.get()};
+    EXPECT_EQ(p.parse(), 0);
+    auto ir = LowerToIr(lex->ctx.result);
+
+    std::stringstream flatSs{program};
+    auto flatLex = std::make_unique<TMyLexer>(&flatSs);
+    flatLex->ctx.flat = std::make_unique<TFlatAstBuilder>();
+    yy::parser flatParser{flatLex.get()};
+    EXPECT_EQ(flatParser.parse(), 0);
+    auto flatIr = LowerToIr(std::move(*flatLex->ctx.flat).Build(flatLex->ctx.flatRoot, flatLex->ctx.names));
+    std::stringstream text;
+    std::stringstream flatText;
+    PrintIr(ir, text);
+    PrintIr(flatIr, flatText);
+    EXPECT_EQ(text.str(), flatText.str());
+
+    OptimizeIr(ir);
+    return ir;
+  };
+  auto count = [](const TIrFunction& function, EIrOp op) {
+    std::size_t result = 0;
+    for (auto& block : function.blocks) {
+      result += std::count_if(block.instrs.begin(), block.instrs.end(),
+                              [&](const TIrInstr& instr) { return instr.op == op; });
+    }
+    return result;
+  };
+  auto size = [](const TIrFunction& function) {
+    std::size_t result = 0;
+    for (auto& block : function.blocks) {
+      result += block.instrs.size();
+    }
+    return result;
+  };
+
+  // the same value is computed once
+  auto cse = lower("n = int(input())\na = n * 3 + 1\nb = 3 * n + 1\nprint(a)\nprint(b)\n");
+  EXPECT_EQ(count(cse, EIrOp::Mul), 1);
+  EXPECT_EQ(count(cse, EIrOp::Plus), 1);
+
+  // the copies are read through, then nothing reads the variables
+  auto copies = lower("n = int(input())\nx = 1\nx = 2\ny = n\nz = y\nprint(z + x)\n");
+  EXPECT_EQ(count(copies, EIrOp::Copy), 0);
+  EXPECT_EQ(size(copies), 3);
+
+  // the branch that never runs is removed with its blocks
+  auto branches = lower("x = 1\nif x:\n    print(1)\nelse:\n    print(2)\nwhile 0:\n    print(3)\n");
+  EXPECT_EQ(count(branches, EIrOp::PrintInt), 1);
+  for (auto& block : branches.blocks) {
+    EXPECT_NE(block.exit.kind, TIrExit::EKind::Branch);
+  }
+
+  // the iterator is the counter, as in the C loop of the AST codegen
+  auto loop = lower("for i in range(n):\n    i = i * 2\n    print(i)\n");
+  std::string code;
+  {
+    TBufferedWriter out{code};
+    GenerateC(loop, out);
+  }
+  for (auto expected : {"int main() {\n  int i = 0;\n", "__print_int(", "goto __L", "  __flush();\n}\n"}) {
+    EXPECT_NE(code.find(expected), std::string::npos) << expected << "\n" << code;
+  }
+  EXPECT_EQ(count(loop, EIrOp::Plus), 1);
+}
+
+TEST(IrTest, SameOutputAsAstCodegen) {
+  auto run = [](const std::string& program, int level) {
+    TTranslateOptions options;
+    options.level = level;
+    auto translation = Translate(program, options);
+    EXPECT_TRUE(translation.errors.empty()) << program;
+    return RunC(translation.code, "4\n");
+  };
+  if (!RunC("int main() { return 0; }\n", "")) {
+    GTEST_SKIP() << "no C compiler";
+  }
+
+  // the iterator is a variable of the loop, which hides the one outside
+  const std::pair<std::string, std::string> cases[] = {
+    {"for i in range(3):\n    print(i)\n    i = 10\n", "0\n"},
+    {"i = 7\nfor i in range(3):\n    print(i)\nprint(i)\n", "0\n1\n2\n7\n"},
+    {"for i in range(2):\n    for i in range(3):\n        print(i)\n    print(i)\n", "0\n1\n2\n0\n0\n1\n2\n1\n"},
+    {"n = int(input())\nfor i in range(10, 0, 0 - n):\n    i = i - 1\n    print(i)\n", "9\n4\n"},
+    {"s = 0\nfor i in range(int(input())):\n    s = s + i\n    i = i + 1\nprint(s)\n", "2\n"},
+  };
+  for (const auto& [program, expected] : cases) {
+    auto o1 = run(program, 1);
+    ASSERT_TRUE(o1) << program;
+    EXPECT_EQ(*o1, expected) << program;
+    EXPECT_EQ(run(program, 2), o1) << program;
+  }
+}
+
+TEST(VmTest, SameAsGeneratedC) {
+  auto compile = [](const std::string& program) {
+    std::stringstream ss{program};
+    auto lex = std::make_unique<TMyLexer>(&ss);
+    yy::parser p{lex.get()};
+    EXPECT_EQ(p.parse(), 0);
+    auto ir = LowerToIr(lex->ctx.result);
+    OptimizeIr(ir);
+    return CompileBytecode(ir);
+  };
+  auto run = [&](const std::string& program, std::string_view stdinText, bool ok = true) {
+    auto bytecode = compile(program);
+    EXPECT_TRUE(bytecode) << program;
+    std::string output;
+    if (bytecode) {
+      TVmInput in{stdinText};
+      TBufferedWriter out{output};
+      EXPECT_EQ(RunBytecode(*bytecode, in, out), ok) << program;
+    }
+    return output;
+  };
+
+  // the expected output is the one of the C code pytoc generates by default
+  const std::pair<std::string, std::string> cases[] = {
+    {"n = int(input())\ns = 0\nfor i in range(n):\n    s = s + int(input())\nprint(s)\n"
+     "print(\"done\\n\")\nwhile n > 0:\n    n = n - 2\nprint(n)\n",
+     "3\n1\n 2 and more\n-4\n"},
+    {"for i in range(3):\n    print(i)\n    i = 10\n", ""},
+    {"i = 7\nfor i in range(3):\n    print(i)\nprint(i)\n", ""},
+    {"n = int(input())\nfor i in range(5, 0, n):\n    print(i)\n", "-2\n"},
+    {"x = 1\nif x > 0 and not x == 2 or 0:\n    print(\"yes\")\nelse:\n    print(\"no\")\n", ""},
+  };
+  for (const auto& [program, stdinText] : cases) {
+    auto expected = RunC(Translate(program).code, stdinText);
+    if (!expected) {
+      GTEST_SKIP() << "no C compiler";
+    }
+    EXPECT_EQ(run(program, stdinText), *expected) << program;
+  }
+
+  // the behavior of the C code is undefined: a string doesn't fit the int
+  // variable, and the overflow lets the compiler drop the sign
+  EXPECT_EQ(run("s = input()\nprint(int(s) * 2)\nprint(int(7))\n", "  21\n"), "42\n7\n");
+  EXPECT_EQ(run("print(2147483647 + int(input()))\n", "1\n"), "-2147483648\n");
+
+  // the C code aborts at the end of the input
+  EXPECT_EQ(run("print(1)\nx = int(input())\nprint(x)\n", "", false), "1\n");
+  // and doesn't compile the calls to unknown functions
+  EXPECT_FALSE(compile("x = foo(1)\nprint(x)\n"));
+  EXPECT_FALSE(compile("print(y)\n"));
+}
+
+TEST(CacheTest, Sha256AndEviction) {
+  EXPECT_EQ(TSha256{}.HexDigest(), "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855");
+  EXPECT_EQ(TSha256{}.Update("abc").HexDigest(), "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad");
+  // a long input fed in pieces that straddle the blocks
+  std::string text(1000, 'x');
+  TSha256 pieces;
+  for (std::size_t pos = 0; pos < text.size(); pos += 37) {
+    pieces.Update(std::string_view{text}.substr(pos, 37));
+  }
+  EXPECT_EQ(pieces.HexDigest(), TSha256{}.Update(text).HexDigest());
+  EXPECT_NE(TSha256{}.UpdatePart("ab").UpdatePart("c").HexDigest(),
+            TSha256{}.UpdatePart("a").UpdatePart("bc").HexDigest());
+
+  auto dir = std::filesystem::temp_directory_path() / ("parser_test_cache." + std::to_string(::getpid()));
+  auto cache = TFileCache::Open(dir, 10);
+  ASSERT_TRUE(cache);
+  auto insert = [&](const std::string& key, const std::string& contents) {
+    auto file = cache->TempPath();
+    std::ofstream{file} << contents;
+    return cache->Insert(key, file);
+  };
+  EXPECT_FALSE(cache->Find("a"));
+  ASSERT_TRUE(insert("a", "123456"));
+  ASSERT_TRUE(insert("b", "123456"));
+  // "b" was last used a minute ago and "a" is used now
+  auto old = std::filesystem::file_time_type::clock::now() - std::chrono::minutes{1};
+  std::filesystem::last_write_time(dir / "b", old);
+  EXPECT_EQ(cache->Find("a"), dir / "a");
+  cache->SaveStats();
+  cache->Evict();
+  EXPECT_TRUE(cache->Find("a"));
+  EXPECT_FALSE(cache->Find("b"));
+
+  // the counters of the processes add up, the eviction keeps them
+  cache->SaveStats();
+  auto stats = cache->LoadStats();
+  EXPECT_EQ(stats.hits, 2);
+  EXPECT_EQ(stats.misses, 2);
+  std::filesystem::remove_all(dir);
+}
+
+TEST(BatchTest, WorkStealing) {
+  // every index runs once, the ones dealt to the slow thread get stolen
+  constexpr std::size_t COUNT = 1000;
+  std::vector<std::atomic<int>> runs(COUNT);
+  std::atomic<std::size_t> byOthers{0};
+  RunWorkStealing(COUNT, 4, [&](std::size_t index, unsigned worker) {
+    ASSERT_LT(worker, 4u);
+    runs[index]++;
+    if (worker == 0) {
+      std::this_thread::sleep_for(std::chrono::milliseconds{1});
+    } else {
+      byOthers++;
+    }
+  });
+  EXPECT_TRUE(std::all_of(runs.begin(), runs.end(), [](auto& count) { return count == 1; }));
+  EXPECT_GT(byOthers, COUNT * 3 / 4);
+
+  auto dir = std::filesystem::temp_directory_path() / ("parser_test_batch." + std::to_string(::getpid()));
+  std::filesystem::create_directories(dir / "sub");
+  std::ofstream{dir / "a.py"} << "x = 1 + 2\nprint(x)\n";
+  std::ofstream{dir / "sub" / "b.py"} << "for i in range(3):\n    print(i)\n";
+  std::ofstream{dir / "sub" / "bad.py"} << "x = = 1\n";
+  std::ofstream{dir / "notes.txt"} << "not python\n";
+  auto files = CollectBatch({dir.string()}, {});
+  ASSERT_TRUE(files);
+  EXPECT_EQ(files->size(), 3);
+  TBatchOptions options;
+  options.jobs = 2;
+  auto stats = TranslateBatch(*files, options);
+  EXPECT_EQ(stats.files, 3);
+  EXPECT_EQ(stats.failed, 1);
+  std::ifstream in{dir / "a.py.c"};
+  std::string code{std::istreambuf_iterator<char>{in}, std::istreambuf_iterator<char>{}};
+  EXPECT_NE(code.find("x = 3;"), std::string::npos) << code;
+  EXPECT_TRUE(std::filesystem::exists(dir / "sub" / "b.py.c"));
+  EXPECT_FALSE(std::filesystem::exists(dir / "sub" / "bad.py.c"));
+  std::filesystem::remove_all(dir);
+}
+
+TEST(LibraryTest, Reentrant) {
+  auto translated = Translate("x = 2 * 3\nprint(x)\n");
+  EXPECT_TRUE(translated.errors.empty());
+  EXPECT_NE(translated.code.find("x = 6;"), std::string::npos) << translated.code;
+
+  // the errors come back as values, nothing is printed
+  auto failed = Translate("x = 1\ny = = 2\nprint(x)\n");
+  EXPECT_TRUE(failed.code.empty());
+  ASSERT_EQ(failed.errors.size(), 1);
+  EXPECT_EQ(failed.errors[0].line, 2);
+  EXPECT_EQ(failed.errors[0].column, 5);
+  EXPECT_EQ(failed.errors[0].Format("a.py"), "a.py:2.5: syntax error, unexpected =");
+  EXPECT_FALSE(ParseFlat("print(\n").ast);
+
+  // the AST doesn't refer to the source
+  auto parsed = [] {
+    std::string source = "s = \"hi\"\nprint(s)\n";
+    return Parse(source);
+  }();
+  ASSERT_TRUE(parsed.ast);
+  std::string code;
+  {
+    TBufferedWriter out{code};
+    GenerateC(*parsed.ast, TTranslateOptions{}, out);
+  }
+  EXPECT_NE(code.find("\"hi\""), std::string::npos) << code;
+
+  // the same results from many threads at once, at every level and layout
+  std::vector<TTranslateOptions> variants;
+  for (int level = 0; level <= 2; level++) {
+    for (bool flat : {false, true}) {
+      TTranslateOptions options;
+      options.level = level;
+      options.flat = flat;
+      variants.push_back(options);
+    }
+  }
+  const std::string program = "n = int(input())\nfor i in range(n):\n    if i > 2 and i < 5:\n        print(i * 2)\n";
+  std::vector<std::string> expected;
+  for (auto& options : variants) {
+    expected.push_back(Translate(program, options).code);
+  }
+  std::atomic<int> mismatches{0};
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; t++) {
+    threads.emplace_back([&] {
+      for (int i = 0; i < 50; i++) {
+        auto variant = i % variants.size();
+        if (Translate(program, variants[variant]).code != expected[variant]) {
+          mismatches++;
+        }
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  EXPECT_EQ(mismatches, 0);
+}
+
+TEST(ServeTest, ConcurrentClients) {
+  auto socketPath = (std::filesystem::temp_directory_path() / ("parser_test_serve." + std::to_string(::getpid())))
+                      .string();
+  auto server = TTranslationServer::Start({socketPath, 2});
+  ASSERT_TRUE(server);
+  std::thread loop{[&] { server->Run(); }};
+  // the socket is taken while the server lives
+  EXPECT_FALSE(TTranslationServer::Start({socketPath, 1}));
+
+  auto request = [](int level, std::string_view source) {
+    return std::string(1, static_cast<char>(level)) + std::string{source};
+  };
+  const std::string program = "x = 2 * 3\nprint(x)\n";
+  auto expected = Translate(program).code;
+
+  // every client sends all of its requests before reading the responses,
+  // which come in the same order
+  std::atomic<int> mismatches{0};
+  std::vector<std::thread> clients;
+  for (int c = 0; c < 8; c++) {
+    clients.emplace_back([&] {
+      auto client = TServeClient::Connect(socketPath);
+      if (!client) {
+        mismatches++;
+        return;
+      }
+      for (int i = 0; i < 10; i++) {
+        client->Send(EServeRequest::Translate, request(1, i % 2 ? program : "y = = 2\n"));
+      }
+      for (int i = 0; i < 10; i++) {
+        auto response = client->Receive();
+        bool ok = i % 2 ? response && response->first == EServeResponse::Code && response->second == expected
+                        : response && response->first == EServeResponse::Errors &&
+                            response->second == "1.5: syntax error, unexpected =\n";
+        mismatches += !ok;
+      }
+    });
+  }
+  for (auto& client : clients) {
+    client.join();
+  }
+  EXPECT_EQ(mismatches, 0);
+
+  auto client = TServeClient::Connect(socketPath);
+  ASSERT_TRUE(client);
+  ASSERT_TRUE(client->Send(EServeRequest::Stats, {}));
+  auto stats = client->Receive();
+  ASSERT_TRUE(stats);
+  EXPECT_EQ(stats->first, EServeResponse::Stats);
+  EXPECT_EQ(stats->second.rfind("requests: 80\np50: ", 0), 0) << stats->second;
+
+  // a malformed request is answered and the connection is closed
+  ASSERT_TRUE(client->Send(static_cast<EServeRequest>(7), "?"));
+  auto bad = client->Receive();
+  ASSERT_TRUE(bad);
+  EXPECT_EQ(bad->first, EServeResponse::BadRequest);
+  EXPECT_FALSE(client->Receive());
+  // the level is a raw byte, not a digit
+  for (auto level : {'1', '\xff'}) {
+    auto levelClient = TServeClient::Connect(socketPath);
+    ASSERT_TRUE(levelClient);
+    ASSERT_TRUE(levelClient->Send(EServeRequest::Translate, std::string(1, level) + program));
+    auto badLevel = levelClient->Receive();
+    ASSERT_TRUE(badLevel);
+    EXPECT_EQ(badLevel->first, EServeResponse::BadRequest) << static_cast<int>(level);
+  }
+
+  server->Stop();
+  loop.join();
+  EXPECT_EQ(server->Latency().Count(), 80);
+  server.reset();
+  EXPECT_FALSE(std::filesystem::exists(socketPath));
+}
+
+TEST(ServeTest, Backpressure) {
+  auto socketPath = (std::filesystem::temp_directory_path() / ("parser_test_backpressure." + std::to_string(::getpid())))
+                      .string();
+  auto server = TTranslationServer::Start({socketPath, 1});
+  ASSERT_TRUE(server);
+  std::thread loop{[&] { server->Run(); }};
+
+  // a client that sends all of its requests before reading any responses is
+  // stopped by the full socket buffers, the server doesn't read them all
+  auto source = "print(\"" + std::string(60'000, 'a') + "\")\n";
+  auto request = std::string(1, '\1') + source;
+  auto client = TServeClient::Connect(socketPath);
+  ASSERT_TRUE(client);
+  constexpr int REQUESTS = 64;
+  std::atomic<int> sent{0};
+  std::thread sender{[&] {
+    for (int i = 0; i < REQUESTS; i++) {
+      if (!client->Send(EServeRequest::Translate, request)) {
+        return;
+      }
+      sent++;
+    }
+  }};
+  std::this_thread::sleep_for(std::chrono::milliseconds(500));
+  EXPECT_LT(sent, REQUESTS);
+
+  auto expected = Translate(source).code;
+  for (int i = 0; i < REQUESTS; i++) {
+    auto response = client->Receive();
+    ASSERT_TRUE(response);
+    EXPECT_EQ(response->first, EServeResponse::Code);
+    EXPECT_EQ(response->second.size(), expected.size());
+  }
+  sender.join();
+  EXPECT_EQ(sent, REQUESTS);
+
+  server->Stop();
+  loop.join();
+}
+
+TEST(ServeTest, HalfClose) {
+  auto socketPath = (std::filesystem::temp_directory_path() / ("parser_test_half_close." + std::to_string(::getpid())))
+                      .string();
+  auto server = TTranslationServer::Start({socketPath, 1});
+  ASSERT_TRUE(server);
+  std::thread loop{[&] { server->Run(); }};
+
+  // the client shuts its side right after its requests, the responses still
+  // come in order
+  const std::string programs[] = {"print(1)\n", "print(2)\n"};
+  auto client = TServeClient::Connect(socketPath);
+  ASSERT_TRUE(client);
+  for (auto& program : programs) {
+    ASSERT_TRUE(client->Send(EServeRequest::Translate, std::string(1, '\1') + program));
+  }
+  ASSERT_TRUE(client->FinishSending());
+  for (auto& program : programs) {
+    auto response = client->Receive();
+    ASSERT_TRUE(response) << program;
+    EXPECT_EQ(response->first, EServeResponse::Code);
+    EXPECT_EQ(response->second, Translate(program).code);
+  }
+  EXPECT_FALSE(client->Receive());
+
+  server->Stop();
+  loop.join();
+}
+
+TEST(ServeTest, LatencyPercentiles) {
+  TLatencyHistogram histogram;
+  EXPECT_EQ(histogram.Percentile(0.5), 0);
+  for (std::uint64_t i = 1; i <= 1000; i++) {
+    histogram.Record(i * 1000);
+  }
+  EXPECT_EQ(histogram.Count(), 1000);
+  // within the 12.5% of a bucket
+  for (auto [fraction, exact] : {std::pair{0.5, 500'000.0}, {0.9, 900'000.0}, {0.99, 990'000.0}}) {
+    auto percentile = histogram.Percentile(fraction);
+    EXPECT_GE(percentile, exact) << fraction;
+    EXPECT_LE(percentile, exact * 1.125) << fraction;
+  }
+  EXPECT_EQ(histogram.Percentile(1), 1'000'000);
+}
+
+TEST(ForLoopTest, CountedLoops) {
+  auto translate = [](const std::string& program) {
+    std::stringstream ss{program};
+    auto lex = std::make_unique<TMyLexer>(&ss);
+    yy::parser p{lex.get()};
+    EXPECT_EQ(p.parse(), 0);
+    TPyToCVisitor visitor;
+    return lex->ctx.result->accept(&visitor);
+  };
+
+  const std::pair<std::string, std::string> cases[] = {
+    {"for k in range(3):\n    print(k)\n",
+     "for (int __k_from = 0, __k_to = 3, k = __k_from;\n"
+     "       k < __k_to; k += 1) {\n    __print_int(k);\n  }"},
+    {"for k in range(10, 0, -3):\n    print(k)\n",
+     "for (int __k_from = 10, __k_to = 0, k = __k_from;\n       k > __k_to; k += -3) {"},
+    {"for k in range(0, n, n - 1):\n    print(k)\n",
+     "for (int __k_from = 0, __k_to = n, __k_step = (n - 1),\n"
+     "           k = __k_from;\n"
+     "       __k_step > 0 ? k < __k_to : __k_step < 0 && k > __k_to;\n"
+     "       k += __k_step) {"},
+    {"for k in range(1, 2, 0):\n    print(k)\n", "__k_step = 0,"},
+  };
+  for (const auto& test : cases) {
+    auto code = translate(test.first);
+    EXPECT_NE(code.find(test.second), std::string::npos) << code;
+    EXPECT_EQ(code.find("InRange"), std::string::npos);
+  }
+}
+
+TEST(ForLoopTest, BoundsBeforeIterator) {
+  auto run = [](const std::string& program, int level) {
+    TTranslateOptions options;
+    options.level = level;
+    auto translation = Translate(program, options);
+    EXPECT_TRUE(translation.errors.empty()) << program;
+    return RunC(translation.code, "3\n");
+  };
+  if (!RunC("int main() { return 0; }\n", "")) {
+    GTEST_SKIP() << "no C compiler";
+  }
+
+  // `range` is evaluated before the iterator hides the variable outside. NOTE:
+  // `i` is read, so that the constants aren't folded into the bounds
+  const std::pair<std::string, std::string> cases[] = {
+    {"i = int(input())\nfor i in range(i):\n    print(i)\n", "0\n1\n2\n"},
+    {"i = int(input())\nn = 6\nfor i in range(i, n):\n    print(i)\n", "3\n4\n5\n"},
+    {"i = int(input())\nfor i in range(i + 4, 0, 0 - i + 1):\n    print(i)\n", "7\n5\n3\n1\n"},
+  };
+  for (const auto& [program, expected] : cases) {
+    auto o1 = run(program, 1);
+    ASSERT_TRUE(o1) << program;
+    EXPECT_EQ(*o1, expected) << program;
+    EXPECT_EQ(run(program, 2), o1) << program;
+  }
+}
+
+TEST(LocalsTest, NarrowestScope) {
+  std::stringstream ss{R"(n = int(input())
+while n > 0:
+    t = n * 2
+    print(t)
+    s = s + t
+    n = n - 1
+if n:
+    u = 1
+    u = u * 2
+    print(u)
+else:
+    v = 1
+    if v:
+        w = v
+    print(w)
+for i in range(3):
+    x = 1
+print(x)
+)"};
+  auto lex = std::make_unique<TMyLexer>(&ss);
+  yy::parser p{lex.get()};
+  ASSERT_EQ(p.parse(), 0);
+  TPyToCVisitor visitor;
+  auto code = lex->ctx.result->accept(&visitor);
+  // `s` keeps its value between the iterations, `w` may be read unassigned
+  // and `x` is used after the loop
+  for (auto expected : {"int main() {\n  int n = 0, s = 0, w = 0, x = 0;\n  n = __read_int();",
+                        "while ((n > 0)) {\n    int t;\n    t = (n * 2);",
+                        "if (n) {\n    int u;\n    u = 1;",
+                        "} else {\n    int v;\n    v = 1;"}) {
+    EXPECT_NE(code.find(expected), std::string::npos) << expected << "\n" << code;
+  }
+  EXPECT_EQ(code.find("int __dummy"), std::string::npos);
+}
+
+TEST(RuntimeIoTest, BufferedCalls) {
+  std::stringstream ss{"n = int(input())\ns = input()\nprint(n)\nprint(\"done\")\n"};
+  auto lex = std::make_unique<TMyLexer>(&ss);
+  yy::parser p{lex.get()};
+  ASSERT_EQ(p.parse(), 0);
+  TPyToCVisitor visitor;
+  auto code = lex->ctx.result->accept(&visitor);
+  for (auto expected : {"n = __read_int();", "s = input();", "__print_int(n);",
+                        "__print_str(\"done\");", "  __flush();\n}\n"}) {
+    EXPECT_NE(code.find(expected), std::string::npos) << expected;
+  }
+  EXPECT_EQ(code.find("malloc"), std::string::npos);
+  EXPECT_EQ(code.find("printf"), std::string::npos);
+}
+
+TEST(TemplateTest, Segments) {
+  constexpr auto tmpl = ParseTemplate<CountSegments("if ({{condition}}) {\n{{statements}}\n}")>(
+      "if ({{condition}}) {\n{{statements}}\n}");
+  static_assert(tmpl.segments.size() == 5);
+  static_assert(tmpl.segments[1].slot == ESlot::Condition);
+  static_assert(tmpl.segments[3].slot == ESlot::Statements);
+
+  std::string text;
+  for (auto& segment : IF_SEGMENTS) {
+    text += segment.slot == ESlot::None ? std::string{segment.text} : "_";
+  }
+  EXPECT_EQ(text, "\nif (_) {\n_\n} else {\n_\n}\n");
+}
+
+TEST(CodeWriterTest, Blocks) {
+  std::string result;
+  {
+    TBufferedWriter out{result};
+    TCodeWriter writer{out};
+    writer.Write("a {\n");
+    writer.Open();
+    writer.Write("b;\n\nc;\n");
+    writer.Close();
+    writer.Write("\n}\nd {\n");
+    writer.Open();
+    writer.Close();
+    writer.Write("\n}\n");
+    writer.Finish();
+  }
+  // The blocks lose their last newline and the empty lines in them are
+  // indented
+  EXPECT_EQ(result, "a {\n  b;\n  \n  c;\n}\nd {\n  \n}\n");
+}
+
+TEST(BufferedWriterTest, LargeWrites) {
+  char path[] = "/tmp/pytoc_writer_XXXXXX";
+  int fd = mkstemp(path);
+  ASSERT_GE(fd, 0);
+  std::string expected;
+  {
+    TBufferedWriter out{fd};
+    for (std::size_t size : {std::size_t{10}, TBufferedWriter::BUFFER_SIZE - 5,
+                             std::size_t{3}, 3 * TBufferedWriter::BUFFER_SIZE}) {
+      std::string chunk(size, static_cast<char>('a' + expected.size() % 26));
+      out.Write(chunk);
+      expected += chunk;
+    }
+    out.Put('\n');
+    expected += '\n';
+    EXPECT_TRUE(out.Flush());
+  }
+  close(fd);
+  std::ifstream in{path};
+  std::string written{std::istreambuf_iterator<char>{in}, {}};
+  unlink(path);
+  EXPECT_EQ(written, expected);
+}
+
 TEST(VisitorTest, BasicAssertions) {
-  std::shared_ptr<TNode> t = std::make_shared<TTree>("an empty node", std::vector<TPtr>{});
+  TInterner names;
+  TArena arena;
+  TPtr t = MakeTree(arena, ETreeKind::Statements);
 
   TNameVisitor nv;
   ASSERT_EQ(t->accept(&nv), "tree");
+  EXPECT_EQ(t->As<TTree>(), t);
+  EXPECT_EQ(t->As<TId>(), nullptr);
 
-  t = std::make_shared<TTree>("branch", std::vector<TPtr>{
-      std::make_shared<TId>("identifier1"),
-      std::make_shared<TString>("string literal 1"),
-      std::make_shared<TNumber>(42),
-      std::make_shared<TTree>("nested branch", std::vector<TPtr>{
-          std::make_shared<TNumber>(228),
-          std::make_shared<TId>("identifier2"),
-      }),
-  });
+  t = MakeTree(arena, ETreeKind::Statements,
+      arena.Make<TId>(names.Intern("identifier1")),
+      arena.Make<TString>(arena.CopyString("string literal 1")),
+      arena.Make<TNumber>(42),
+      MakeTree(arena, ETreeKind::Arglist,
+          arena.Make<TNumber>(228),
+          arena.Make<TId>(names.Intern("identifier2"))
+      )
+  );
 
   spdlog::info("Started printing AST");
   {
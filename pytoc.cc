@@ -1,29 +1,39 @@
+#include <algorithm>
+#include <csignal>
+#include <filesystem>
 #include <type_traits>
 #include <iostream>
-#include <sstream>
-#include <fstream>
+#include <vector>
+#include <unistd.h>
 
 #include <spdlog/spdlog.h>
 #include <argparse/argparse.hpp>
 
+#include "batch.hh"
+#include "cache.hh"
 #include "driver.hh"
+#include "libpytoc.hh"
+#include "hash.hh"
+#include "ir.hh"
+#include "mapped_file.hh"
+#include "native.hh"
+#include "optimize.hh"
 #include "parser.hh"
+#include "serve.hh"
+#include "trace.hh"
+#include "vm.hh"
+#include "writer.hh"
 
-TPrintVisitor PV{std::cout, "    "};
-TNameVisitor NV;
-argparse::ArgumentParser program{"pytoc"};
-
-std::optional<TPtr> DoParse(std::istream& is) {
-    auto lex = std::make_shared<TMyLexer>(&is);
-    auto p = yy::parser{lex.get()};
-    if (program["-v"] == true) {
-      p.set_debug_level(true);
+/// Prints the syntax errors to stderr, returns the AST if there are none
+template <class TTree>
+std::optional<TTree> DoParse(TParsed<TTree> parsed, std::string_view file) {
+    for (auto& error : parsed.errors) {
+      std::cerr << error.Format(file) << '\n';
     }
-    if (auto code = p.parse(); code != 0) {
-      spdlog::error("parser failed with code {}", code);
-      return std::nullopt;
+    if (!parsed.ast) {
+      spdlog::error("parser failed");
     }
-    return lex->ctx.result;
+    return std::move(parsed.ast);
 }
 
 int main(int argc, const char *argv[]) {
@@ -32,13 +42,73 @@ int main(int argc, const char *argv[]) {
   ****************************************************************************/
 
   argparse::ArgumentParser program("parser");
+  program.add_argument("files")
+    .help("translate these files (and the *.py files in these directories) in parallel, each into <file>.c "
+          "next to it. Goes after the options")
+    .remaining();
+  program.add_argument("--manifest")
+    .help("translate the files listed in this file, one per line, like the ones after the options")
+    .append();
+  program.add_argument("-j", "--jobs")
+    .help("the number of threads to translate several files or the --serve requests with (all of the cores by "
+          "default)")
+    .default_value(0)
+    .scan<'i', int>();
   program.add_argument("-f", "--file")
     .help("accept input from this file");
   program.add_argument("-o", "--outfile")
     .help("print the converted code to this file (write to stdout if not provided)");
   program.add_argument("-v", "--verbose")
+    .help("enable all of the trace categories")
+    .default_value(false)
+    .implicit_value(true);
+  program.add_argument("--pipeline")
+    .help("lex the file on a separate thread while parsing it")
+    .default_value(false)
+    .implicit_value(true);
+  program.add_argument("--flat-ast")
+    .help("build the AST in the flat structure-of-arrays layout")
     .default_value(false)
     .implicit_value(true);
+  program.add_argument("-O", "--opt-level")
+    .help("0: translate the code as it is written, 1: fold the constants, "
+          "2: optimize the three-address code as well")
+    .default_value(1)
+    .action([](const std::string& value) {
+      // NOTE: the server rejects the other levels too (see serve.hh)
+      if (value != "0" && value != "1" && value != "2") {
+        throw std::runtime_error{"-O takes 0, 1 or 2, not " + value};
+      }
+      return value[0] - '0';
+    });
+  program.add_argument("--run")
+    .help("run the program in the bytecode VM instead of translating it")
+    .default_value(false)
+    .implicit_value(true);
+  program.add_argument("--exec")
+    .help("translate, compile and run this script, the binaries are cached by its contents");
+  program.add_argument("--cache")
+    .help("reuse the C code translated from the same file contents before")
+    .default_value(false)
+    .implicit_value(true);
+  program.add_argument("--cache-dir")
+    .help("where to keep the caches ($PYTOC_CACHE_DIR, $XDG_CACHE_HOME/pytoc or ~/.cache/pytoc by default)");
+  program.add_argument("--cache-size")
+    .help("the size limit of each cache in MiB, the least recently used entries are evicted past it")
+    .default_value(256)
+    .scan<'i', int>();
+  program.add_argument("--cache-stats")
+    .help("print the hits and misses of the caches and exit")
+    .default_value(false)
+    .implicit_value(true);
+  program.add_argument("--serve")
+    .help("translate the requests from this Unix socket until SIGINT or SIGTERM (see serve.hh for the protocol)");
+  program.add_argument("--dump-ir")
+    .help("print the three-address code to stderr, before and after the optimizations")
+    .default_value(false)
+    .implicit_value(true);
+  program.add_argument("--trace")
+    .help("comma separated trace categories to enable: lexer, parser, codegen or all");
 
   try {
     program.parse_args(argc, argv);
@@ -47,28 +117,288 @@ int main(int argc, const char *argv[]) {
     return 1;
   }
 
+  unsigned traced = 0;
   if (program["-v"] == true) {  // heh
+    traced = trace::ALL;
+  }
+  if (auto categories = program.present("--trace")) {
+    auto mask = trace::ParseCategories(*categories);
+    if (!mask) {
+      spdlog::error("unknown trace category in `{}`", *categories);
+      return 1;
+    }
+    traced |= *mask;
+  }
+
+  if (traced) {
     spdlog::set_level(spdlog::level::info);
     spdlog::info("enabled verbose logging");
+    if (!PYTOC_TRACING) {
+      spdlog::warn("the trace points were compiled out (ENABLE_TRACING=OFF)");
+    }
   } else {
     spdlog::set_level(spdlog::level::err);
   }
+  trace::Enable(traced);
+
+  auto cacheDir = program.present("--cache-dir") ? std::filesystem::path{program.get<std::string>("--cache-dir")}
+                                                 : TFileCache::DefaultDir();
+  auto openCache = [&](const char* name) {
+    return TFileCache::Open(cacheDir / name, std::uint64_t(program.get<int>("--cache-size")) << 20);
+  };
+  if (program["--cache-stats"] == true) {
+    for (auto name : {"c", "bin"}) {
+      auto cache = openCache(name);
+      if (!cache) {
+        return 1;
+      }
+      auto stats = cache->LoadStats();
+      std::cout << cache->Dir().string() << ": " << stats.hits << " hits, " << stats.misses << " misses\n";
+    }
+    return 0;
+  }
+
+  /****************************************************************************
+  *                                  Serve                                   *
+  ****************************************************************************/
+
+  if (auto socketPath = program.present("--serve")) {
+    TServeOptions options;
+    options.socketPath = *socketPath;
+    options.workers = std::max(0, program.get<int>("-j"));
+    static std::unique_ptr<TTranslationServer> server;
+    server = TTranslationServer::Start(options);
+    if (!server) {
+      return 1;
+    }
+    for (int signal : {SIGINT, SIGTERM}) {
+      std::signal(signal, [](int) { server->Stop(); });
+    }
+    server->Run();
+    // NOTE: the handlers would find no server while it's being destroyed, a
+    // second signal stops the process instead
+    for (int signal : {SIGINT, SIGTERM}) {
+      std::signal(signal, SIG_DFL);
+    }
+    std::cerr << server->Latency().Format();
+    server.reset();
+    return 0;
+  }
+
+  /****************************************************************************
+  *                                  Batch                                   *
+  ****************************************************************************/
+
+  auto files = program.present<std::vector<std::string>>("files");
+  auto manifests = program.present<std::vector<std::string>>("--manifest");
+  if (files || manifests) {
+    if (program.present("-f") || program.present("-o") || program.present("--exec")) {
+      spdlog::error("-f, -o and --exec translate a single file, they can't go with several");
+      return 1;
+    }
+    auto batch = CollectBatch(files.value_or(std::vector<std::string>{}),
+                              manifests.value_or(std::vector<std::string>{}));
+    if (!batch) {
+      return 1;
+    }
+    TBatchOptions options;
+    options.translate.level = program.get<int>("-O");
+    options.translate.flat = program["--flat-ast"] == true;
+    options.jobs = std::max(0, program.get<int>("-j"));
+    if (program["--cache"] == true) {
+      options.cacheDir = cacheDir / "c";
+      options.cacheBytes = std::uint64_t(program.get<int>("--cache-size")) << 20;
+    }
+    auto stats = TranslateBatch(*batch, options);
+    spdlog::info("translated {} files ({} failed) with {} threads in {:.3f} s: {:.0f} files/s, {:.1f} MiB/s in, "
+                 "{:.1f} MiB/s out, {} cache hits, {} misses",
+                 stats.files, stats.failed, stats.jobs, stats.seconds, stats.files / stats.seconds,
+                 stats.inputBytes / stats.seconds / (1 << 20), stats.outputBytes / stats.seconds / (1 << 20),
+                 stats.cache.hits, stats.cache.misses);
+    return stats.failed == 0 ? 0 : 1;
+  }
 
   /****************************************************************************
   *                                 Parsing                                  *
   ****************************************************************************/
 
-  if (program.present("-f")) {
-      std::fstream fs{program.get<std::string>("-f")};
-      if (auto res = DoParse(fs)) {
-        TPyToCVisitor PTCV;
-        auto src = res.value()->accept(&PTCV);
+  auto script = program.present("--exec");
+  auto path = script ? script : program.present("-f");
+  if (path) {
+      // The file is scanned right in the mapping, without reading it through
+      // a stream
+      auto file = TMappedFile::Open(*path);
+      if (!file) {
+        return 1;
+      }
+      auto level = program.get<int>("-O");
+      bool run = program["--run"] == true && !script;
+      bool dump = program["--dump-ir"] == true;
+
+      // The C code goes to -o or to stdout
+      auto output = [&](auto&& generate) {
         if (program.present("-o")) {
-          std::ofstream outfile{program.get<std::string>("-o")};
-          outfile << src;
+          auto out = TBufferedWriter::Open(program.get<std::string>("-o"));
+          if (!out) {
+            return false;
+          }
+          generate(*out);
+          return out->Flush();
+        }
+        std::cout.flush();
+        TBufferedWriter out{STDOUT_FILENO};
+        generate(out);
+        out.Write("\n");
+        return out.Flush();
+      };
+
+      auto compiler = TCCompiler::FromEnvironment();
+      std::optional<TFileCache> binaries;
+      std::optional<TFileCache> translations;
+      std::string key;
+      if (program["--cache"] == true && !script && !run && !dump) {
+        translations = openCache("c");
+        if (!translations) {
+          return 1;
+        }
+        key = TSha256{}
+                  .UpdatePart("c")
+                  .UpdatePart(TRANSLATOR_VERSION)
+                  .UpdatePart(std::to_string(level))
+                  .Update(file->view())
+                  .HexDigest();
+        auto entry = translations->Find(key);
+        translations->SaveStats();
+        if (auto cached = entry ? TMappedFile::Open(entry->string()) : std::nullopt) {
+          spdlog::info("using the cached {}", entry->string());
+          return output([&](TBufferedWriter& out) { out.Write(cached->view()); }) ? 0 : 1;
+        }
+        // evicted meanwhile, it's translated again
+      }
+      if (script) {
+        binaries = openCache("bin");
+        if (!binaries) {
+          return 1;
+        }
+        // NOTE: the hash is taken before flex scans the buffer in place
+        key = TSha256{}
+                  .UpdatePart("exec")
+                  .UpdatePart(TRANSLATOR_VERSION)
+                  .UpdatePart(std::to_string(level))
+                  .UpdatePart(compiler.Describe())
+                  .Update(file->view())
+                  .HexDigest();
+        auto binary = binaries->Find(key);
+        binaries->SaveStats();
+        if (binary) {
+          spdlog::info("running the cached {}", binary->string());
+          ExecBinary(binary->string());
+          // evicted meanwhile, it's built again
+        }
+      }
+      TParseOptions parseOptions;
+      parseOptions.pipeline = program["--pipeline"] == true;
+      std::optional<TFlatAst> flat;
+      std::optional<TAst> tree;
+      if (program["--flat-ast"] == true) {
+        flat = DoParse(ParseFlat(file->data(), file->size(), parseOptions), *path);
+      } else {
+        tree = DoParse(Parse(file->data(), file->size(), parseOptions), *path);
+      }
+      if (!flat && !tree) {
+        return script ? 1 : 0;
+      }
+      if (level >= 1) {
+        if (flat) {
+          flat = FoldConstants(*flat);
+        } else {
+          tree = FoldConstants(*tree);
+        }
+      }
+      // The VM always runs the three-address code, optimized unless -O0
+      bool optimize = level >= 2 || (run && level >= 1);
+      std::optional<TIrFunction> ir;
+      if (optimize || run || dump) {
+        ir = flat ? LowerToIr(*flat) : LowerToIr(tree->root);
+        if (dump) {
+          std::cerr << "; lowered\n";
+          PrintIr(*ir, std::cerr);
+        }
+        if (optimize) {
+          OptimizeIr(*ir);
+          if (dump) {
+            std::cerr << "; optimized\n";
+            PrintIr(*ir, std::cerr);
+          }
+        }
+      }
+      if (run) {
+        auto bytecode = CompileBytecode(*ir);
+        if (!bytecode) {
+          return 1;
+        }
+        std::cout.flush();
+        TVmInput in{STDIN_FILENO};
+        TBufferedWriter out{STDOUT_FILENO};
+        return RunBytecode(*bytecode, in, out) ? 0 : 1;
+      }
+      if (level < 2) {
+        ir.reset();
+      }
+      // The code is streamed to the output as it is generated, it's never
+      // held in memory as a whole
+      auto generate = [&](TBufferedWriter& out) {
+        if (ir) {
+          GenerateC(*ir, out);
+        } else if (flat) {
+          GenerateC(*flat, out);
         } else {
-          std::cout << src << std::endl;
+          GenerateC(tree->root, out);
+        }
+      };
+      if (script) {
+        auto source = binaries->TempPath().string() + ".c";
+        auto out = TBufferedWriter::Open(source);
+        if (!out) {
+          return 1;
+        }
+        generate(*out);
+        auto built = binaries->TempPath();
+        bool compiled = out->Flush() && compiler.Compile(source, built.string());
+        std::filesystem::remove(source);
+        if (!compiled) {
+          std::filesystem::remove(built);
+          return 1;
+        }
+        // NOTE: evicted before the insert, so that the new binary stays even
+        // if it alone is over the limit
+        binaries->Evict();
+        auto binary = binaries->Insert(key, built);
+        if (!binary) {
+          return 1;
+        }
+        ExecBinary(binary->string());
+        return 1;
+      } else if (translations) {
+        // NOTE: the output is copied from the temporary file, an entry could
+        // be evicted by another process before it is read
+        auto temp = translations->TempPath();
+        auto entry = TBufferedWriter::Open(temp.string());
+        if (!entry) {
+          return 1;
+        }
+        generate(*entry);
+        auto written = entry->Flush() ? TMappedFile::Open(temp.string()) : std::nullopt;
+        if (!written || !output([&](TBufferedWriter& out) { out.Write(written->view()); })) {
+          std::filesystem::remove(temp);
+          return 1;
+        }
+        translations->Evict();
+        if (!translations->Insert(key, temp)) {
+          return 1;
         }
+      } else if (!output(generate)) {
+        return 1;
       }
   } else {
     // interactive mode
@@ -90,10 +420,9 @@ int main(int argc, const char *argv[]) {
       }
 
       line.push_back('\n');
-      std::stringstream ss{line};
-      if (auto res = DoParse(ss)) {
+      if (auto res = DoParse(Parse(line), {})) {
         TPyToCVisitor PTCV;
-        std::cout << res.value()->accept(&PTCV) << std::endl;
+        std::cout << res->root->accept(&PTCV) << std::endl;
       }
     }
   }
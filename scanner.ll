@@ -10,6 +10,7 @@
 #include <stdio.h>
 #include <assert.h>
 #include <string>
+#include <string_view>
 
 #include "driver.hh"
 #include "parser.hh"
@@ -18,9 +19,13 @@
     ctx.loc.step(); \
     ctx.loc.columns(YYLeng()); \
 
+/* The source buffer is never refilled, so the matched text can be referenced */
+/* directly instead of being copied */
+#define CURRENT_TEXT() std::string_view{YYText(), static_cast<std::size_t>(YYLeng())}
+
 #define DEFAULT_TOKEN(x) \
     { \
-        ctx.curToken = YYText(); \
+        ctx.curToken = CURRENT_TEXT(); \
         ctx.curTokenKind = yy::parser::token_kind_type::x; \
         return ctx.curTokenKind; \
     }
@@ -34,158 +39,99 @@ LF [ ]*\n
 
 %%
 
-^[ ]*\n       {}
-^[ ]*$       {}
-^[ ]*  {
-    // TODO: move location everytime w
-    // NOTE: this won't match on empty lines as the empty line rule precedes us
-    ctx.curToken = YYText();
-    ctx.curTokenKind = yy::parser::token_kind_type::INDENT;
-    return ctx.curTokenKind;
+[ ]+ {
+    // skip the spaces
+    // NOTE: the leading spaces and the blank lines never get here, TMyLexer
+    // skips them using the line index (see linescan.hh)
 }
 
-[ ]+ { /* skip the spaces */ }
-
 "("  DEFAULT_TOKEN(LPAREN)
-")"  {
-        ctx.curToken = YYText();
-        ctx.curTokenKind = yy::parser::token_kind_type::RPAREN;
-        return ctx.curTokenKind;
-     }
-"+"  {
-        ctx.curToken = YYText();
-        ctx.curTokenKind = yy::parser::token_kind_type::PLUS;
-        return ctx.curTokenKind;
-     }
-"-"  {
-        ctx.curToken = YYText();
-        ctx.curTokenKind = yy::parser::token_kind_type::MINUS;
-        return ctx.curTokenKind;
-     }
-"*"  {
-        ctx.curToken = YYText();
-        ctx.curTokenKind = yy::parser::token_kind_type::ASTERISK;
-        return ctx.curTokenKind;
-     }
-"="  {
-        ctx.curToken = YYText();
-        ctx.curTokenKind = yy::parser::token_kind_type::ASS;
-        return ctx.curTokenKind;
-     }
-"=="  {
-        ctx.curToken = YYText();
-        ctx.curTokenKind = yy::parser::token_kind_type::EQ;
-        return ctx.curTokenKind;
-      }
-"!="  {
-        ctx.curToken = YYText();
-        ctx.curTokenKind = yy::parser::token_kind_type::NEQ;
-        return ctx.curTokenKind;
-      }
-"not"  {
-        ctx.curToken = YYText();
-        ctx.curTokenKind = yy::parser::token_kind_type::NOT;
-        return ctx.curTokenKind;
-      }
-"and"  {
-        ctx.curToken = YYText();
-        ctx.curTokenKind = yy::parser::token_kind_type::AND;
-        return ctx.curTokenKind;
-      }
-"or"  {
-        ctx.curToken = YYText();
-        ctx.curTokenKind = yy::parser::token_kind_type::OR;
-        return ctx.curTokenKind;
-      }
-"if"  {
-        ctx.curToken = YYText();
-        ctx.curTokenKind = yy::parser::token_kind_type::IF;
-        return ctx.curTokenKind;
-      }
-"for"  {
-        ctx.curToken = YYText();
-        ctx.curTokenKind = yy::parser::token_kind_type::FOR;
-        return ctx.curTokenKind;
-      }
-"in"  {
-        ctx.curToken = YYText();
-        ctx.curTokenKind = yy::parser::token_kind_type::IN;
-        return ctx.curTokenKind;
-      }
-"elif"  {
-        ctx.curToken = YYText();
-        ctx.curTokenKind = yy::parser::token_kind_type::ELIF;
-        return ctx.curTokenKind;
-     }
-"else"  {
-        ctx.curToken = YYText();
-        ctx.curTokenKind = yy::parser::token_kind_type::ELSE;
-        return ctx.curTokenKind;
-     }
-"while"  {
-         ctx.curToken = YYText();
-         ctx.curTokenKind = yy::parser::token_kind_type::WHILE;
-         return ctx.curTokenKind;
-     }
-":"  {
-        ctx.curToken = YYText();
-        ctx.curTokenKind = yy::parser::token_kind_type::COLON;
-        return ctx.curTokenKind;
-     }
-"<"  {
-        ctx.curToken = YYText();
-        ctx.curTokenKind = yy::parser::token_kind_type::LESS;
-        return ctx.curTokenKind;
-     }
-">"  {
-        ctx.curToken = YYText();
-        ctx.curTokenKind = yy::parser::token_kind_type::GREATER;
-        return ctx.curTokenKind;
-     }
-","  {
-        ctx.curToken = YYText();
-        ctx.curTokenKind = yy::parser::token_kind_type::COMMA;
-        return ctx.curTokenKind;
-     }
-
-
-{ID} {
-        ctx.curToken = YYText();
-        ctx.curTokenKind = yy::parser::token_kind_type::ID;
-        return ctx.curTokenKind;
-     }
+")"  DEFAULT_TOKEN(RPAREN)
+"+"  DEFAULT_TOKEN(PLUS)
+"-"  DEFAULT_TOKEN(MINUS)
+"*"  DEFAULT_TOKEN(ASTERISK)
+"="  DEFAULT_TOKEN(ASS)
+"=="  DEFAULT_TOKEN(EQ)
+"!="  DEFAULT_TOKEN(NEQ)
+"not"  DEFAULT_TOKEN(NOT)
+"and"  DEFAULT_TOKEN(AND)
+"or"  DEFAULT_TOKEN(OR)
+"if"  DEFAULT_TOKEN(IF)
+"for"  DEFAULT_TOKEN(FOR)
+"in"  DEFAULT_TOKEN(IN)
+"elif"  DEFAULT_TOKEN(ELIF)
+"else"  DEFAULT_TOKEN(ELSE)
+"while"  DEFAULT_TOKEN(WHILE)
+":"  DEFAULT_TOKEN(COLON)
+"<"  DEFAULT_TOKEN(LESS)
+">"  DEFAULT_TOKEN(GREATER)
+","  DEFAULT_TOKEN(COMMA)
+
+
+{ID} DEFAULT_TOKEN(ID)
 {STRING} {
-            std::string result{YYText()};
             // remove the quotes
-            result.erase(result.begin());
-            result.pop_back();
-
-            // TODO: it's actually more efficient to do all of the operations on
-            // curToken without any moves
-            ctx.curToken = std::move(result);
+            ctx.curToken = CURRENT_TEXT().substr(1, YYLeng() - 2);
             ctx.curTokenKind = yy::parser::token_kind_type::STRING;
             return ctx.curTokenKind;
          }
 {NUMBER} {
-            /* (std::stoi(std::string{yytext}), ctx.loc) */
-            ctx.curToken = YYText();
+            ctx.curToken = CURRENT_TEXT();
             ctx.curTokenKind = yy::parser::token_kind_type::NUMBER;
             return ctx.curTokenKind;
          }
 
 {LF}    {
-            ctx.curToken = "";
+            ctx.curToken = {};
             ctx.curTokenKind = yy::parser::token_kind_type::LF;
             return ctx.curTokenKind;
         }
 
 <<EOF>>  {
-            ctx.curToken = "";
+            ctx.curToken = {};
             ctx.curTokenKind = yy::parser::token_kind_type::YYEOF;
             return ctx.curTokenKind;
         }
 
-. { return yy::parser::token_kind_type::YYerror; }
+.  DEFAULT_TOKEN(YYerror)
 
 %%
 
+// ScanBuffer and SkipTo do what the flex 2.6 skeleton does to its buffers, in
+// yy_scan_buffer() and yy_switch_to_buffer(). Recheck them against the skeleton
+// of any other version
+#if YY_FLEX_MAJOR_VERSION != 2 || YY_FLEX_MINOR_VERSION != 6
+#error "TMyLexer::ScanBuffer and TMyLexer::SkipTo rely on the buffers of flex 2.6"
+#endif
+
+void TMyLexer::ScanBuffer(char* base, std::size_t size) {
+  // This is what yy_scan_buffer() does in C scanners, flex doesn't generate it
+  // for the C++ ones
+  assert(size >= 2);
+  assert(base[size - 2] == YY_END_OF_BUFFER_CHAR);
+  assert(base[size - 1] == YY_END_OF_BUFFER_CHAR);
+
+  auto b = static_cast<YY_BUFFER_STATE>(yyalloc(sizeof(struct yy_buffer_state)));
+  if (!b) {
+    YY_FATAL_ERROR("out of dynamic memory in TMyLexer::ScanBuffer()");
+  }
+  b->yy_buf_size = static_cast<int>(size - 2);  // "- 2" to take care of EOB's
+  b->yy_buf_pos = b->yy_ch_buf = base;
+  b->yy_is_our_buffer = 0;
+  b->yy_input_file = nullptr;
+  b->yy_n_chars = b->yy_buf_size;
+  b->yy_is_interactive = 0;
+  b->yy_at_bol = 1;
+  b->yy_fill_buffer = 0;
+  b->yy_buffer_status = YY_BUFFER_NEW;
+
+  yy_switch_to_buffer(b);
+}
+
+void TMyLexer::SkipTo(char* pos) {
+  // Put back the character flex replaced with '\0' after the last match and
+  // carry on from `pos` as if everything before it had been matched already
+  *yy_c_buf_p = yy_hold_char;
+  YY_CURRENT_BUFFER_LVALUE->yy_buf_pos = yy_c_buf_p = pos;
+  yy_hold_char = *pos;
+}
@@ -0,0 +1,588 @@
+#include "serve.hh"
+
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <spdlog/spdlog.h>
+
+#include "libpytoc.hh"
+#include "writer.hh"
+
+namespace {
+
+using TClock = std::chrono::steady_clock;
+
+constexpr std::size_t HEADER_SIZE = 5;
+
+/// The highest -O level (see TTranslateOptions)
+constexpr unsigned char MAX_LEVEL = 2;
+
+/// A connection isn't read while more than that waits to be written to it
+constexpr std::size_t MAX_PENDING_OUTPUT = 1 << 20;
+
+std::uint32_t GetLength(const char* bytes) {
+  auto byte = [&](int i) { return std::uint32_t{static_cast<unsigned char>(bytes[i])}; };
+  return byte(0) << 24 | byte(1) << 16 | byte(2) << 8 | byte(3);
+}
+
+/// A frame with room for the header, the payload is appended to it
+std::string StartFrame(std::uint8_t kind) {
+  std::string frame(HEADER_SIZE, '\0');
+  frame[4] = static_cast<char>(kind);
+  return frame;
+}
+
+/// Fills in the length once the payload is in place
+void FinishFrame(std::string& frame) {
+  auto length = static_cast<std::uint32_t>(frame.size() - 4);
+  for (int i = 0; i < 4; i++) {
+    frame[i] = static_cast<char>(length >> (24 - 8 * i));
+  }
+}
+
+std::string MakeFrame(std::uint8_t kind, std::string_view payload) {
+  auto frame = StartFrame(kind);
+  frame.append(payload);
+  FinishFrame(frame);
+  return frame;
+}
+
+/// A Translate request on its way to a worker
+struct TJob {
+  int fd;
+  std::uint64_t connection;
+  TClock::time_point start;
+  int level;
+  /// Followed by the two zero bytes flex wants
+  std::string source;
+};
+
+/// The response of a worker on its way back to the loop
+struct TDone {
+  int fd;
+  std::uint64_t connection;
+  TClock::time_point start;
+  std::string frame;
+};
+
+struct TConnection {
+  /// Tells a connection from an earlier one that had the same descriptor
+  std::uint64_t id = 0;
+  std::string in;
+  std::string out;
+  std::size_t written = 0;
+  /// A request is with the workers, the next ones wait for its response
+  bool busy = false;
+  /// No more requests are read, the connection is closed once the ones in
+  /// `in` are answered and `out` is written
+  bool closing = false;
+  /// What the loop waits for on the socket
+  std::uint32_t events = EPOLLIN;
+};
+
+/// Whether `in` starts with a complete request
+bool HasRequest(const std::string& in) {
+  return in.size() >= 4 && in.size() >= 4 + std::size_t{GetLength(in.data())};
+}
+
+/// Whether to read more requests. Not while a complete request waits for the
+/// response to the previous one or the responses pile up: a client that
+/// doesn't read them is left with full socket buffers, not the server
+bool IsReading(const TConnection& connection) {
+  if (connection.closing || connection.out.size() - connection.written >= MAX_PENDING_OUTPUT) {
+    return false;
+  }
+  return !connection.busy || !HasRequest(connection.in);
+}
+
+void TranslateJob(TJob& job, std::string& frame) {
+  TTranslateOptions options;
+  options.level = job.level;
+  frame = StartFrame(static_cast<std::uint8_t>(EServeResponse::Code));
+  std::vector<TDiagnostic> errors;
+  {
+    TBufferedWriter out{frame};
+    errors = Translate(job.source.data(), job.source.size() - 2, options, out);
+  }
+  if (!errors.empty()) {
+    frame = StartFrame(static_cast<std::uint8_t>(EServeResponse::Errors));
+    for (auto& error : errors) {
+      frame += error.Format();
+      frame += '\n';
+    }
+  }
+  FinishFrame(frame);
+}
+
+}  // namespace
+
+/*******************************************************************************
+ *                                   Latency                                    *
+ *******************************************************************************/
+
+std::size_t TLatencyHistogram::Bucket(std::uint64_t nanoseconds) {
+  if (nanoseconds < SUB_BUCKETS) {
+    return nanoseconds;
+  }
+  // The leading one and the 3 bits after it
+  int exponent = 63 - __builtin_clzll(nanoseconds);
+  auto mantissa = (nanoseconds >> (exponent - 3)) & (SUB_BUCKETS - 1);
+  return (exponent - 2) * SUB_BUCKETS + mantissa;
+}
+
+std::uint64_t TLatencyHistogram::UpperBound(std::size_t bucket) {
+  if (bucket < SUB_BUCKETS) {
+    return bucket;
+  }
+  int exponent = bucket / SUB_BUCKETS + 2;
+  auto lower = (SUB_BUCKETS + bucket % SUB_BUCKETS) << (exponent - 3);
+  return lower + (std::uint64_t{1} << (exponent - 3)) - 1;
+}
+
+void TLatencyHistogram::Record(std::uint64_t nanoseconds) {
+  buckets[Bucket(nanoseconds)]++;
+  count++;
+  max = std::max(max, nanoseconds);
+}
+
+std::uint64_t TLatencyHistogram::Percentile(double fraction) const {
+  if (count == 0) {
+    return 0;
+  }
+  auto rank = std::max<std::uint64_t>(1, static_cast<std::uint64_t>(fraction * count + 0.999999));
+  std::uint64_t seen = 0;
+  for (std::size_t bucket = 0; bucket < buckets.size(); bucket++) {
+    seen += buckets[bucket];
+    if (seen >= rank) {
+      return std::min(UpperBound(bucket), max);
+    }
+  }
+  return max;
+}
+
+std::string TLatencyHistogram::Format() const {
+  auto micros = [](std::uint64_t nanoseconds) { return std::to_string(nanoseconds / 1000) + " us\n"; };
+  return "requests: " + std::to_string(count) + "\n" +
+         "p50: " + micros(Percentile(0.5)) +
+         "p90: " + micros(Percentile(0.9)) +
+         "p99: " + micros(Percentile(0.99)) +
+         "p99.9: " + micros(Percentile(0.999)) +
+         "max: " + micros(max);
+}
+
+/*******************************************************************************
+ *                                    Server                                    *
+ *******************************************************************************/
+
+struct TTranslationServer::TState {
+  std::string socketPath;
+  int listenFd = -1;
+  int epollFd = -1;
+
+  std::mutex jobsMutex;
+  std::condition_variable jobsReady;
+  std::deque<TJob> jobs;
+  bool quit = false;
+
+  std::mutex doneMutex;
+  std::vector<TDone> done;
+
+  std::vector<std::thread> workers;
+  std::unordered_map<int, TConnection> connections;
+  std::uint64_t nextConnection = 0;
+
+  ~TState() {
+    {
+      std::lock_guard lock{jobsMutex};
+      quit = true;
+    }
+    jobsReady.notify_all();
+    for (auto& worker : workers) {
+      worker.join();
+    }
+    for (auto& [fd, connection] : connections) {
+      ::close(fd);
+    }
+    if (listenFd >= 0) {
+      ::close(listenFd);
+      ::unlink(socketPath.c_str());
+    }
+    if (epollFd >= 0) {
+      ::close(epollFd);
+    }
+  }
+};
+
+std::unique_ptr<TTranslationServer> TTranslationServer::Start(const TServeOptions& options) {
+  sockaddr_un address{};
+  address.sun_family = AF_UNIX;
+  if (options.socketPath.size() >= sizeof(address.sun_path)) {
+    spdlog::error("the socket path {} is too long", options.socketPath);
+    return nullptr;
+  }
+  std::strcpy(address.sun_path, options.socketPath.c_str());
+
+  auto state = std::make_unique<TState>();
+  state->listenFd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (state->listenFd < 0) {
+    spdlog::error("can't create a socket: {}", std::strerror(errno));
+    return nullptr;
+  }
+  auto bindSocket = [&] { return ::bind(state->listenFd, reinterpret_cast<sockaddr*>(&address), sizeof(address)); };
+  int bound = bindSocket();
+  if (bound != 0 && errno == EADDRINUSE) {
+    // NOTE: a server that is gone leaves its socket behind, nobody accepts on
+    // it any more
+    if (TServeClient::Connect(options.socketPath)) {
+      spdlog::error("another server listens on {}", options.socketPath);
+      ::close(std::exchange(state->listenFd, -1));
+      return nullptr;
+    }
+    ::unlink(options.socketPath.c_str());
+    bound = bindSocket();
+  }
+  if (bound != 0 || ::listen(state->listenFd, SOMAXCONN) != 0) {
+    spdlog::error("can't listen on {}: {}", options.socketPath, std::strerror(errno));
+    ::close(std::exchange(state->listenFd, -1));
+    return nullptr;
+  }
+  state->socketPath = options.socketPath;
+
+  state->epollFd = ::epoll_create1(EPOLL_CLOEXEC);
+  int wakeFd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (state->epollFd < 0 || wakeFd < 0) {
+    spdlog::error("can't create the event loop: {}", std::strerror(errno));
+    if (wakeFd >= 0) {
+      ::close(wakeFd);
+    }
+    return nullptr;
+  }
+  for (int fd : {state->listenFd, wakeFd}) {
+    epoll_event event{};
+    event.events = EPOLLIN;
+    event.data.fd = fd;
+    ::epoll_ctl(state->epollFd, EPOLL_CTL_ADD, fd, &event);
+  }
+
+  auto workers = options.workers ? options.workers : std::max(1u, std::thread::hardware_concurrency());
+  for (unsigned i = 0; i < workers; i++) {
+    state->workers.emplace_back([state = state.get(), wakeFd] {
+      while (true) {
+        TJob job;
+        {
+          std::unique_lock lock{state->jobsMutex};
+          state->jobsReady.wait(lock, [&] { return state->quit || !state->jobs.empty(); });
+          if (state->quit) {
+            return;
+          }
+          job = std::move(state->jobs.front());
+          state->jobs.pop_front();
+        }
+        TDone done{job.fd, job.connection, job.start, {}};
+        TranslateJob(job, done.frame);
+        {
+          std::lock_guard lock{state->doneMutex};
+          state->done.push_back(std::move(done));
+        }
+        std::uint64_t one = 1;
+        [[maybe_unused]] auto written = ::write(wakeFd, &one, sizeof(one));
+      }
+    });
+  }
+
+  std::unique_ptr<TTranslationServer> server{new TTranslationServer{std::move(state)}};
+  server->wakeFd = wakeFd;
+  spdlog::info("serving on {} with {} workers", options.socketPath, workers);
+  return server;
+}
+
+TTranslationServer::TTranslationServer(std::unique_ptr<TState> state_) : state{std::move(state_)} {}
+
+TTranslationServer::~TTranslationServer() {
+  // NOTE: the workers are joined before the descriptor they wake the loop
+  // with is closed
+  state.reset();
+  ::close(wakeFd);
+}
+
+void TTranslationServer::Stop() {
+  stopping.store(true, std::memory_order_relaxed);
+  std::uint64_t one = 1;
+  [[maybe_unused]] auto written = ::write(wakeFd, &one, sizeof(one));
+}
+
+void TTranslationServer::Run() {
+  auto& s = *state;
+
+  auto close = [&](int fd) {
+    ::epoll_ctl(s.epollFd, EPOLL_CTL_DEL, fd, nullptr);
+    ::close(fd);
+    s.connections.erase(fd);
+  };
+
+  // Writes as much as the socket takes, watches for it to take more and for
+  // the requests if it's reading. Returns false if the connection got closed
+  auto flush = [&](int fd, TConnection& connection) {
+    while (connection.written < connection.out.size()) {
+      auto written = ::send(fd, connection.out.data() + connection.written,
+                            connection.out.size() - connection.written, MSG_NOSIGNAL);
+      if (written < 0 && errno == EINTR) {
+        continue;
+      }
+      if (written < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        break;
+      }
+      if (written < 0) {
+        close(fd);
+        return false;
+      }
+      connection.written += written;
+    }
+    if (connection.written == connection.out.size()) {
+      connection.out.clear();
+      connection.written = 0;
+      if (connection.closing && !connection.busy && !HasRequest(connection.in)) {
+        close(fd);
+        return false;
+      }
+    }
+    std::uint32_t events = (IsReading(connection) ? std::uint32_t{EPOLLIN} : 0) |
+                           (connection.out.empty() ? 0 : std::uint32_t{EPOLLOUT});
+    if (events != connection.events) {
+      epoll_event event{};
+      event.events = events;
+      event.data.fd = fd;
+      ::epoll_ctl(s.epollFd, EPOLL_CTL_MOD, fd, &event);
+      connection.events = events;
+    }
+    return true;
+  };
+
+  // Takes the next complete requests of the connection, one at a time: each
+  // waits for the response to the previous one
+  auto dispatch = [&](int fd, TConnection& connection) {
+    do {
+      while (!connection.busy && connection.in.size() >= 4 &&
+             connection.out.size() - connection.written < MAX_PENDING_OUTPUT) {
+        auto length = GetLength(connection.in.data());
+        std::string_view rejected;
+        if (length == 0 || length > MAX_FRAME_SIZE) {
+          rejected = "bad frame length";
+        } else if (connection.in.size() < 4 + length) {
+          break;
+        } else {
+          auto kind = static_cast<EServeRequest>(connection.in[4]);
+          std::string_view payload{connection.in.data() + HEADER_SIZE, length - 1};
+          if (kind == EServeRequest::Stats) {
+            connection.out += MakeFrame(static_cast<std::uint8_t>(EServeResponse::Stats), latency.Format());
+          } else if (kind == EServeRequest::Translate && !payload.empty() &&
+                     static_cast<unsigned char>(payload[0]) > MAX_LEVEL) {
+            rejected = "bad -O level";
+          } else if (kind == EServeRequest::Translate && !payload.empty()) {
+            TJob job{fd, connection.id, TClock::now(), static_cast<unsigned char>(payload[0]), {}};
+            job.source.reserve(payload.size() + 1);
+            job.source.append(payload.substr(1));
+            job.source.append(2, '\0');
+            {
+              std::lock_guard lock{s.jobsMutex};
+              s.jobs.push_back(std::move(job));
+            }
+            s.jobsReady.notify_one();
+            connection.busy = true;
+          } else {
+            rejected = "unknown request";
+          }
+        }
+        if (!rejected.empty()) {
+          connection.out += MakeFrame(static_cast<std::uint8_t>(EServeResponse::BadRequest), rejected);
+          connection.closing = true;
+          // NOTE: nothing after a bad request is answered
+          connection.in.clear();
+          break;
+        }
+        connection.in.erase(0, 4 + length);
+      }
+      if (!flush(fd, connection)) {
+        return false;
+      }
+      // NOTE: the output may have drained while the requests waited for room
+    } while (!connection.busy && HasRequest(connection.in) &&
+             connection.out.size() - connection.written < MAX_PENDING_OUTPUT);
+    return true;
+  };
+
+  std::vector<TDone> done;
+  epoll_event events[64];
+  while (!stopping.load(std::memory_order_relaxed)) {
+    int count = ::epoll_wait(s.epollFd, events, std::size(events), -1);
+    if (count < 0 && errno != EINTR) {
+      spdlog::error("the event loop failed: {}", std::strerror(errno));
+      return;
+    }
+    for (int i = 0; i < count; i++) {
+      int fd = events[i].data.fd;
+      if (fd == s.listenFd) {
+        while (true) {
+          int client = ::accept4(s.listenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+          if (client < 0) {
+            break;
+          }
+          epoll_event event{};
+          event.events = EPOLLIN;
+          event.data.fd = client;
+          ::epoll_ctl(s.epollFd, EPOLL_CTL_ADD, client, &event);
+          s.connections[client].id = s.nextConnection++;
+        }
+      } else if (fd == wakeFd) {
+        std::uint64_t wakes;
+        [[maybe_unused]] auto read = ::read(wakeFd, &wakes, sizeof(wakes));
+        {
+          std::lock_guard lock{s.doneMutex};
+          done.swap(s.done);
+        }
+        for (auto& response : done) {
+          latency.Record(std::chrono::duration_cast<std::chrono::nanoseconds>(TClock::now() - response.start).count());
+          auto it = s.connections.find(response.fd);
+          if (it == s.connections.end() || it->second.id != response.connection) {
+            continue;  // the client is gone
+          }
+          it->second.out += response.frame;
+          it->second.busy = false;
+          dispatch(response.fd, it->second);
+        }
+        done.clear();
+      } else if (auto it = s.connections.find(fd); it != s.connections.end()) {
+        auto& connection = it->second;
+        // NOTE: the requests that waited for the output to drain go first
+        if (events[i].events & EPOLLOUT && !dispatch(fd, connection)) {
+          continue;
+        }
+        if (events[i].events & (EPOLLHUP | EPOLLERR)) {
+          // NOTE: the client is gone, its pending responses have nowhere to
+          // go. The hangup is reported even while the socket isn't read
+          close(fd);
+          continue;
+        }
+        if (!(events[i].events & EPOLLIN)) {
+          continue;
+        }
+        char buffer[64 << 10];
+        bool open = true;
+        while (open && IsReading(connection)) {
+          auto got = ::read(fd, buffer, sizeof(buffer));
+          if (got > 0) {
+            connection.in.append(buffer, got);
+            open = dispatch(fd, connection);
+            continue;
+          }
+          if (got < 0 && errno == EINTR) {
+            continue;
+          }
+          if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+          }
+          // The client shut its side, possibly right after its last requests:
+          // they are answered before the connection is closed
+          connection.closing = true;
+          open = dispatch(fd, connection);
+        }
+      }
+    }
+  }
+}
+
+/*******************************************************************************
+ *                                    Client                                    *
+ *******************************************************************************/
+
+std::optional<TServeClient> TServeClient::Connect(const std::string& socketPath) {
+  sockaddr_un address{};
+  address.sun_family = AF_UNIX;
+  if (socketPath.size() >= sizeof(address.sun_path)) {
+    return std::nullopt;
+  }
+  std::strcpy(address.sun_path, socketPath.c_str());
+  int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    return std::nullopt;
+  }
+  if (::connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0) {
+    ::close(fd);
+    return std::nullopt;
+  }
+  return TServeClient{fd};
+}
+
+TServeClient::TServeClient(TServeClient&& other) noexcept : fd{std::exchange(other.fd, -1)} {}
+
+TServeClient::~TServeClient() {
+  if (fd >= 0) {
+    ::close(fd);
+  }
+}
+
+bool TServeClient::Send(EServeRequest kind, std::string_view payload) {
+  auto frame = MakeFrame(static_cast<std::uint8_t>(kind), payload);
+  std::string_view rest{frame};
+  while (!rest.empty()) {
+    auto written = ::send(fd, rest.data(), rest.size(), MSG_NOSIGNAL);
+    if (written < 0 && errno == EINTR) {
+      continue;
+    }
+    if (written < 0) {
+      return false;
+    }
+    rest.remove_prefix(written);
+  }
+  return true;
+}
+
+bool TServeClient::FinishSending() {
+  return ::shutdown(fd, SHUT_WR) == 0;
+}
+
+std::optional<std::pair<EServeResponse, std::string>> TServeClient::Receive() {
+  auto readExactly = [&](char* data, std::size_t size) {
+    while (size > 0) {
+      auto got = ::read(fd, data, size);
+      if (got < 0 && errno == EINTR) {
+        continue;
+      }
+      if (got <= 0) {
+        return false;
+      }
+      data += got;
+      size -= got;
+    }
+    return true;
+  };
+  char header[HEADER_SIZE];
+  if (!readExactly(header, HEADER_SIZE)) {
+    return std::nullopt;
+  }
+  auto length = GetLength(header);
+  if (length == 0 || length > MAX_FRAME_SIZE) {
+    return std::nullopt;
+  }
+  std::string payload(length - 1, '\0');
+  if (!readExactly(payload.data(), payload.size())) {
+    return std::nullopt;
+  }
+  return std::pair{static_cast<EServeResponse>(header[4]), std::move(payload)};
+}
@@ -0,0 +1,143 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+
+/*******************************************************************************
+ *                                   Protocol                                   *
+ *******************************************************************************/
+
+// Both ways a message is a frame: the length of the rest as 4 big-endian
+// bytes, a byte of kind and the payload. A client may send the next request
+// before the response to the previous one, the responses come in order. A
+// client that shuts its side of the socket still gets the responses to the
+// requests it has sent, then the server closes the connection
+
+enum class EServeRequest : std::uint8_t {
+  /// The -O level as a raw byte (0, 1 or 2, not the ASCII digit) and the
+  /// source. Any other level is a BadRequest
+  Translate = 0,
+  /// No payload, answered with EServeResponse::Stats
+  Stats = 1,
+};
+
+enum class EServeResponse : std::uint8_t {
+  /// The C code
+  Code = 0,
+  /// The syntax errors, one per line ("1.5: syntax error, ...")
+  Errors = 1,
+  /// "requests: N\np50: X us\n..." (see TLatencyHistogram::Format)
+  Stats = 2,
+  /// The request was malformed, the connection is closed after it
+  BadRequest = 3,
+};
+
+/// The frames longer than that are rejected
+constexpr std::size_t MAX_FRAME_SIZE = 64 << 20;
+
+/*******************************************************************************
+ *                                   Latency                                    *
+ *******************************************************************************/
+
+/// Counts the latencies in buckets that are 1/8 of a power of two wide, so a
+/// percentile is off by 12.5% at most and the memory never grows
+class TLatencyHistogram {
+ public:
+  void Record(std::uint64_t nanoseconds);
+
+  std::uint64_t Count() const { return count; }
+
+  /// The upper bound of the bucket the `fraction` (0.5 for p50) falls into
+  std::uint64_t Percentile(double fraction) const;
+
+  /// The count and p50, p90, p99, p99.9 and the max in microseconds, a line
+  /// each
+  std::string Format() const;
+
+ private:
+  static constexpr int SUB_BUCKETS = 8;
+
+  static std::size_t Bucket(std::uint64_t nanoseconds);
+  static std::uint64_t UpperBound(std::size_t bucket);
+
+  std::array<std::uint64_t, 64 * SUB_BUCKETS> buckets{};
+  std::uint64_t count = 0;
+  std::uint64_t max = 0;
+};
+
+/*******************************************************************************
+ *                                    Server                                    *
+ *******************************************************************************/
+
+struct TServeOptions {
+  std::string socketPath;
+  /// The number of translating threads, all of the cores if 0
+  unsigned workers = 0;
+};
+
+/// Translates the requests from a Unix socket. One thread runs an epoll loop
+/// that accepts the clients and reads and writes the frames without blocking,
+/// the translations run on the workers. The translator is loaded and warm
+/// once for all of the requests, a request pays only for its own parse and
+/// code generation
+class TTranslationServer {
+ public:
+  /// Binds the socket (replacing a stale one, but not one a live server
+  /// listens on) and starts the workers. Logs the reason and returns nullptr
+  /// on failure
+  static std::unique_ptr<TTranslationServer> Start(const TServeOptions& options);
+
+  ~TTranslationServer();
+
+  /// Serves until Stop, on the calling thread
+  void Run();
+
+  /// Makes Run return, can be called from any thread and from a signal
+  /// handler
+  void Stop();
+
+  /// From the complete request to its response queued for writing, read it
+  /// after Run returns
+  const TLatencyHistogram& Latency() const { return latency; }
+
+ private:
+  struct TState;
+
+  explicit TTranslationServer(std::unique_ptr<TState> state_);
+
+  std::unique_ptr<TState> state;
+  TLatencyHistogram latency;
+  int wakeFd = -1;
+  std::atomic<bool> stopping{false};
+};
+
+/// A blocking client, for the tests and the benchmarks
+class TServeClient {
+ public:
+  static std::optional<TServeClient> Connect(const std::string& socketPath);
+
+  TServeClient(TServeClient&& other) noexcept;
+  TServeClient& operator=(TServeClient&&) = delete;
+  ~TServeClient();
+
+  bool Send(EServeRequest kind, std::string_view payload);
+
+  /// Tells the server no more requests come. The responses to the ones sent
+  /// still do, then the server closes the connection
+  bool FinishSending();
+
+  /// The next response, nullopt if the connection is closed
+  std::optional<std::pair<EServeResponse, std::string>> Receive();
+
+ private:
+  explicit TServeClient(int fd_) : fd{fd_} {}
+
+  int fd = -1;
+};
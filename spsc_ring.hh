@@ -0,0 +1,87 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <type_traits>
+
+/// A bounded lock-free queue for exactly one producer thread and one consumer
+/// thread. Both sides work on batches: the producer makes its elements
+/// visible every BATCH pushes (or on Publish) and the consumer hands the slots
+/// back every BATCH pops (or when it runs dry), so the shared indices are
+/// touched once per batch instead of once per element
+template <typename T, std::size_t Capacity, std::size_t BATCH = 64>
+class TSpscRing {
+  static_assert((Capacity & (Capacity - 1)) == 0, "Capacity must be a power of two");
+  static_assert(BATCH <= Capacity);
+  static_assert(std::is_trivially_copyable_v<T>);
+
+ public:
+  /// Producer side. Returns false if the ring is full, the pending elements
+  /// are published in that case so the consumer can make progress
+  bool TryPush(const T& value) {
+    if (producer.tail - producer.cachedHead == Capacity) {
+      producer.cachedHead = head.load(std::memory_order_acquire);
+      if (producer.tail - producer.cachedHead == Capacity) {
+        Publish();
+        return false;
+      }
+    }
+    slots[producer.tail & (Capacity - 1)] = value;
+    producer.tail++;
+    if (producer.tail - producer.publishedTail >= BATCH) {
+      Publish();
+    }
+    return true;
+  }
+
+  /// Producer side. Makes everything pushed so far visible to the consumer
+  void Publish() {
+    tail.store(producer.tail, std::memory_order_release);
+    producer.publishedTail = producer.tail;
+  }
+
+  /// Consumer side. Returns false if there is nothing published to pop
+  bool TryPop(T& value) {
+    if (consumer.head == consumer.cachedTail) {
+      Release();
+      consumer.cachedTail = tail.load(std::memory_order_acquire);
+      if (consumer.head == consumer.cachedTail) {
+        return false;
+      }
+    }
+    value = slots[consumer.head & (Capacity - 1)];
+    consumer.head++;
+    if (consumer.head - consumer.releasedHead >= BATCH) {
+      Release();
+    }
+    return true;
+  }
+
+ private:
+  /// Consumer side. Hands the popped slots back to the producer
+  void Release() {
+    head.store(consumer.head, std::memory_order_release);
+    consumer.releasedHead = consumer.head;
+  }
+
+  static constexpr std::size_t CACHE_LINE = 64;
+
+  // NOTE: every group lives on its own cache line to avoid false sharing
+  alignas(CACHE_LINE) std::atomic<std::size_t> head{0};
+  alignas(CACHE_LINE) std::atomic<std::size_t> tail{0};
+
+  alignas(CACHE_LINE) struct {
+    std::size_t tail = 0;
+    std::size_t publishedTail = 0;
+    std::size_t cachedHead = 0;
+  } producer;
+
+  alignas(CACHE_LINE) struct {
+    std::size_t head = 0;
+    std::size_t releasedHead = 0;
+    std::size_t cachedTail = 0;
+  } consumer;
+
+  alignas(CACHE_LINE) std::array<T, Capacity> slots;
+};
@@ -0,0 +1,99 @@
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+/*******************************************************************************
+ *                                  Interning                                  *
+ *******************************************************************************/
+
+using TSymbolId = std::uint32_t;
+
+/// The builtins are interned before anything else, so their ids are constants
+/// and checking for a builtin is an integer compare
+namespace builtins {
+
+constexpr TSymbolId PRINT = 0;
+constexpr TSymbolId INT = 1;
+constexpr TSymbolId INPUT = 2;
+constexpr TSymbolId RANGE = 3;
+
+}  // namespace builtins
+
+/// An interned identifier. The name is owned by the TInterner it came from
+struct TSymbol {
+  TSymbolId id;
+  std::string_view name;
+};
+
+/// Maps every distinct identifier of a program to a dense id. The lexer fills
+/// it, the nodes keep the ids and views of the names it owns
+class TInterner {
+ public:
+  TInterner() {
+    for (auto builtin : {"print", "int", "input", "range"}) {
+      Intern(builtin);
+    }
+  }
+
+  TInterner(const TInterner&) = delete;
+  TInterner& operator=(const TInterner&) = delete;
+
+  TSymbol Intern(std::string_view name) {
+    if (auto it = ids.find(name); it != ids.end()) {
+      return {it->second, it->first};
+    }
+    // NOTE: deque never moves its elements, so the views stay valid
+    std::string_view stored = names.emplace_back(name);
+    auto id = static_cast<TSymbolId>(names.size() - 1);
+    ids.emplace(stored, id);
+    return {id, stored};
+  }
+
+  std::string_view Name(TSymbolId id) const { return names[id]; }
+
+  std::size_t size() const { return names.size(); }
+
+ private:
+  std::deque<std::string> names;
+  std::unordered_map<std::string_view, TSymbolId> ids;
+};
+
+/*******************************************************************************
+ *                                Symbol table                                 *
+ *******************************************************************************/
+
+/// What codegen knows about the identifiers: a record per symbol, looked up
+/// by TSymbolId and kept in the order of the first lookup
+template <typename TInfo>
+class TSymbolTable {
+ public:
+  /// Adds `info` as the record of `id` unless it has one already. Returns the
+  /// record and whether it was added, like try_emplace. NOTE: the record is
+  /// valid until the next call
+  std::pair<TInfo*, bool> TryEmplace(TSymbolId id, const TInfo& info) {
+    if (id >= index.size()) {
+      index.resize(id + 1, NONE);
+    }
+    if (index[id] != NONE) {
+      return {&records[index[id]], false};
+    }
+    index[id] = static_cast<std::uint32_t>(records.size());
+    return {&records.emplace_back(info), true};
+  }
+
+  /// In the order of the first lookup
+  const std::vector<TInfo>& Records() const { return records; }
+
+ private:
+  static constexpr std::uint32_t NONE = ~std::uint32_t{0};
+
+  /// The position of the record of every id: the ids are dense
+  std::vector<std::uint32_t> index;
+  std::vector<TInfo> records;
+};
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <atomic>
+#include <optional>
+#include <string_view>
+
+#include <spdlog/spdlog.h>
+
+/*******************************************************************************
+ *                                   Tracing                                   *
+ *******************************************************************************/
+
+// The trace points sit on the hottest paths (every token and every node), so
+// they are compiled out completely unless PYTOC_TRACING is set (see the
+// ENABLE_TRACING cmake option). When they are compiled in, every category can
+// be switched on separately at runtime.
+
+#ifndef PYTOC_TRACING
+#define PYTOC_TRACING 1
+#endif
+
+enum class ETraceCategory : unsigned {
+  Lexer = 1 << 0,
+  Parser = 1 << 1,
+  Codegen = 1 << 2,
+};
+
+namespace trace {
+
+constexpr unsigned ALL = 0b111;
+
+/// A mask of enabled ETraceCategory values
+inline std::atomic<unsigned> enabledCategories{0};
+
+inline void Enable(unsigned mask) {
+  enabledCategories.store(mask, std::memory_order_relaxed);
+}
+
+inline bool IsEnabled(ETraceCategory category) {
+  return PYTOC_TRACING && (enabledCategories.load(std::memory_order_relaxed) &
+                           static_cast<unsigned>(category));
+}
+
+/// Parses a comma separated list like "lexer,codegen" (or "all") into a mask,
+/// returns nullopt on unknown names
+inline std::optional<unsigned> ParseCategories(std::string_view list) {
+  unsigned mask = 0;
+  while (!list.empty()) {
+    auto comma = list.find(',');
+    auto name = list.substr(0, comma);
+    if (name == "lexer") {
+      mask |= static_cast<unsigned>(ETraceCategory::Lexer);
+    } else if (name == "parser") {
+      mask |= static_cast<unsigned>(ETraceCategory::Parser);
+    } else if (name == "codegen") {
+      mask |= static_cast<unsigned>(ETraceCategory::Codegen);
+    } else if (name == "all") {
+      mask |= ALL;
+    } else {
+      return std::nullopt;
+    }
+    list.remove_prefix(comma == std::string_view::npos ? list.size() : comma + 1);
+  }
+  return mask;
+}
+
+}  // namespace trace
+
+#if PYTOC_TRACING
+/// The arguments are only evaluated when the category is enabled
+#define PYTOC_TRACE(category, ...)                                  \
+  do {                                                              \
+    if (::trace::IsEnabled(ETraceCategory::category)) {             \
+      spdlog::info(__VA_ARGS__);                                    \
+    }                                                               \
+  } while (false)
+#else
+#define PYTOC_TRACE(category, ...) \
+  do {                             \
+  } while (false)
+#endif
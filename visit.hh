@@ -1,5 +1,9 @@
 #pragma once
 
+#include <cstddef>
+#include <tuple>
+#include <utility>
+
 /*******************************************************************************
  *                          Visitable implementation                           *
  *******************************************************************************/
@@ -12,38 +16,79 @@ namespace detail {
 template <typename...>
 struct IAbstractVisitable;
 
-template <>
-struct IAbstractVisitable<TypeList<>> {
-  void accept() = delete;
+/// Calls the `visit` overload for the node type T. The type is known when the
+/// thunk is instantiated, so the downcast is a static one
+template <typename TBase, typename TSig>
+struct TThunk;
+
+template <typename TBase, typename TVisitor, typename R, typename... Args>
+struct TThunk<TBase, TypeList<TVisitor, R, Args...>> {
+  using TType = R (*)(TBase* node, TVisitor* visitor, Args... args);
 
-  virtual ~IAbstractVisitable() = default;
+  template <typename T>
+  static R Call(TBase* node, TVisitor* visitor, Args... args) {
+    return visitor->visit(static_cast<T*>(node), args...);
+  }
 };
 
-template <typename TVisitor, typename R, typename... Args, typename... TSigTail>
-struct IAbstractVisitable<TypeList<TypeList<TVisitor, R, Args...>, TSigTail...>>
-    : IAbstractVisitable<TypeList<TSigTail...>> {
-  using TBase = IAbstractVisitable<TypeList<TSigTail...>>;
-  using TBase::accept;
+/// One thunk per visitor signature, in the order of the visitor list
+template <typename TBase, typename TSigs>
+struct TDispatchTable;
+
+template <typename TBase, typename... TSigs>
+struct TDispatchTable<TBase, TypeList<TSigs...>> {
+  using TType = std::tuple<typename TThunk<TBase, TSigs>::TType...>;
 
-  virtual R accept(TVisitor* visitor, Args... args) = 0;
+  template <typename T>
+  static constexpr TType FOR{&TThunk<TBase, TSigs>::template Call<T>...};
 };
 
-template <typename...>
-struct VisitableImpl;
+/// The position of the signature of TVisitor in the visitor list
+template <typename TVisitor, typename TSigs>
+struct TSigIndex;
+
+template <typename TVisitor, typename R, typename... Args, typename... TRest>
+struct TSigIndex<TVisitor, TypeList<TypeList<TVisitor, R, Args...>, TRest...>> {
+  static constexpr std::size_t value = 0;
+};
 
-template <typename T, typename TSigs>
-struct VisitableImpl<T, TypeList<>, TSigs> : IAbstractVisitable<TSigs> {};
+template <typename TVisitor, typename TSig, typename... TRest>
+struct TSigIndex<TVisitor, TypeList<TSig, TRest...>> {
+  static_assert(sizeof...(TRest) != 0, "the visitor is missing from the visitor list");
+  static constexpr std::size_t value = 1 + TSigIndex<TVisitor, TypeList<TRest...>>::value;
+};
+
+template <typename... TSigs>
+struct IAbstractVisitable<TypeList<TSigs...>> {
+  using TTable = typename TDispatchTable<IAbstractVisitable, TypeList<TSigs...>>::TType;
 
-template <typename T, typename TVisitor, typename R, typename... Args,
-          typename... TRestSigs, typename TSigs>
-struct VisitableImpl<T, TypeList<TypeList<TVisitor, R, Args...>, TRestSigs...>,
-                     TSigs> : VisitableImpl<T, TypeList<TRestSigs...>, TSigs> {
-  using TBase = VisitableImpl<T, TypeList<TRestSigs...>, TSigs>;
-  using TBase::accept;
+  /// Jumps to the visitor through the table of the node type: a single
+  /// indirect call, no virtual function per visitor and no dynamic_cast
+  template <typename TVisitor, typename... TArgs>
+  decltype(auto) accept(TVisitor* visitor, TArgs&&... args) {
+    constexpr auto index = TSigIndex<TVisitor, TypeList<TSigs...>>::value;
+    return std::get<index>(*table)(this, visitor, std::forward<TArgs>(args)...);
+  }
 
-  R accept(TVisitor* visitor, Args... args) override {
-    return visitor->visit(dynamic_cast<T*>(this), args...);
+  /// The node as T or nullptr if it is of some other type
+  template <typename T>
+  T* As() {
+    if (table != &TDispatchTable<IAbstractVisitable, TypeList<TSigs...>>::template FOR<T>) {
+      return nullptr;
+    }
+    return static_cast<T*>(this);
   }
+
+ protected:
+  explicit IAbstractVisitable(const TTable* table_) : table{table_} {}
+
+  /// NOTE: not virtual, the nodes are never deleted through the base (they
+  /// live in a TArena)
+  ~IAbstractVisitable() = default;
+
+ private:
+  /// Identifies the node type as well
+  const TTable* table;
 };
 
 }  // namespace detail
@@ -58,7 +103,12 @@ struct TVisitable;
 
 template <typename TDerived, typename... TSigs>
 // Provides a default implementation of `accept` method. Iherit from it to not
-// write anything manually
+// write anything manually. A new visitor only needs a signature in the list:
+// the nodes don't have a vtable that would grow with it
 struct TVisitable<TDerived, TypeList<TSigs...>>
-    : detail::VisitableImpl<TDerived, TypeList<TSigs...>, TypeList<TSigs...>> {
+    : detail::IAbstractVisitable<TypeList<TSigs...>> {
+  using TBase = detail::IAbstractVisitable<TypeList<TSigs...>>;
+
+  TVisitable()
+      : TBase{&detail::TDispatchTable<TBase, TypeList<TSigs...>>::template FOR<TDerived>} {}
 };
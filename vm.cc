@@ -0,0 +1,445 @@
+#include "vm.hh"
+
+#include <unistd.h>
+
+#include <cassert>
+#include <cerrno>
+#include <charconv>
+#include <iterator>
+#include <unordered_map>
+
+#include <spdlog/spdlog.h>
+
+namespace {
+
+/// What `input()` returns. The C code returns a pointer to its line buffer,
+/// which `int` reads: the VM has one line as well, the value is out of the
+/// range of the numbers so that `int` can tell it apart
+constexpr std::int64_t LINE = std::int64_t{1} << 32;
+
+/// The text of a string literal, with the escapes the C compiler would
+/// replace
+std::string Unescape(std::string_view literal) {
+  std::string result;
+  for (std::size_t i = 0; i < literal.size(); i++) {
+    if (literal[i] != '\\' || i + 1 == literal.size()) {
+      result.push_back(literal[i]);
+      continue;
+    }
+    switch (char c = literal[++i]) {
+      case 'n':
+        result.push_back('\n');
+        break;
+      case 't':
+        result.push_back('\t');
+        break;
+      case 'r':
+        result.push_back('\r');
+        break;
+      case '0':
+        result.push_back('\0');
+        break;
+      default:
+        result.push_back(c);
+        break;
+    }
+  }
+  return result;
+}
+
+class TBytecodeCompiler {
+ public:
+  explicit TBytecodeCompiler(const TIrFunction& function_) : function{function_} {
+    result.registers.resize(function.vars.size() + function.temps);
+    uses.resize(function.temps);
+    auto use = [&](TIrValue value) {
+      if (value.kind == TIrValue::EKind::Temp) {
+        uses[value.index]++;
+      }
+    };
+    for (auto& block : function.blocks) {
+      for (auto& instr : block.instrs) {
+        use(instr.lhs);
+        use(instr.rhs);
+        for (auto& arg : instr.args) {
+          use(arg);
+        }
+      }
+      if (block.exit.kind == TIrExit::EKind::Branch) {
+        use(block.exit.condition);
+      }
+    }
+  }
+
+  std::optional<TBytecode> Compile() {
+    std::vector<std::size_t> starts;
+    // The targets of the jumps are block numbers until all blocks are placed
+    std::vector<std::size_t> jumps;
+    for (std::size_t i = 0; i < function.blocks.size(); i++) {
+      starts.push_back(result.code.size());
+      blockStart = result.code.size();
+      auto& block = function.blocks[i];
+      for (auto& instr : block.instrs) {
+        if (!CompileInstr(instr)) {
+          return std::nullopt;
+        }
+      }
+      auto& exit = block.exit;
+      auto jump = [&](EVmOp op, std::uint32_t condition, std::size_t target) {
+        jumps.push_back(result.code.size());
+        result.code.push_back({op, condition, static_cast<std::uint32_t>(target), 0});
+      };
+      switch (exit.kind) {
+        case TIrExit::EKind::Return:
+          result.code.push_back({EVmOp::Halt});
+          break;
+        case TIrExit::EKind::Jump:
+          if (exit.targets[0] != i + 1) {
+            jump(EVmOp::Jump, 0, exit.targets[0]);
+          }
+          break;
+        case TIrExit::EKind::Branch: {
+          auto condition = Register(exit.condition);
+          if (!condition) {
+            return std::nullopt;
+          }
+          // The block that follows needs no jump
+          bool negate = exit.targets[0] == i + 1;
+          auto target = exit.targets[negate ? 1 : 0];
+          if (auto compare = TakeCompare(exit.condition, *condition)) {
+            jumps.push_back(result.code.size());
+            result.code.push_back({JumpIfCompare(compare->op, negate), compare->a,
+                                   static_cast<std::uint32_t>(target), compare->c});
+          } else {
+            jump(negate ? EVmOp::JumpIfNot : EVmOp::JumpIf, *condition, target);
+          }
+          if (!negate && exit.targets[1] != i + 1) {
+            jump(EVmOp::Jump, 0, exit.targets[1]);
+          }
+          break;
+        }
+      }
+    }
+    for (auto index : jumps) {
+      auto& instr = result.code[index];
+      instr.b = static_cast<std::uint32_t>(starts[instr.b]);
+    }
+    return std::move(result);
+  }
+
+ private:
+  bool CompileInstr(const TIrInstr& instr) {
+    switch (instr.op) {
+      case EIrOp::Error:
+        spdlog::error("{}", instr.name);
+        return false;
+      case EIrOp::Call:
+        spdlog::error("unknown function `{}`", instr.name);
+        return false;
+      case EIrOp::PrintStr:
+        assert(instr.lhs.kind == TIrValue::EKind::String);
+        result.strings.push_back(Unescape(function.strings[instr.lhs.index]));
+        result.code.push_back({EVmOp::PrintStr, 0, static_cast<std::uint32_t>(result.strings.size() - 1), 0});
+        return true;
+      default:
+        break;
+    }
+    // NOTE: the operations are in the same order as in EIrOp
+    static_assert(static_cast<int>(EVmOp::Atoi) - static_cast<int>(EVmOp::Move) ==
+                  static_cast<int>(EIrOp::Atoi) - static_cast<int>(EIrOp::Copy));
+    static_assert(static_cast<int>(EVmOp::PrintInt) - static_cast<int>(EVmOp::Move) ==
+                  static_cast<int>(EIrOp::PrintInt) - static_cast<int>(EIrOp::Copy));
+    auto op = static_cast<EVmOp>(static_cast<int>(instr.op) - static_cast<int>(EIrOp::Copy));
+    if (op == EVmOp::Move && IsLastUse(instr.lhs) && instr.dst.kind != TIrValue::EKind::Temp) {
+      // `x = t` right after `t = ...`: the value goes straight to `x`
+      auto& last = result.code.back();
+      auto dst = Register(instr.dst);
+      if (!dst) {
+        return false;
+      }
+      last.a = *dst;
+      return true;
+    }
+    std::uint32_t operands[3] = {0, 0, 0};
+    TIrValue values[3] = {instr.dst, instr.lhs, instr.rhs};
+    for (int i = 0; i < 3; i++) {
+      if (!values[i]) {
+        continue;
+      }
+      auto operand = Register(values[i]);
+      if (!operand) {
+        return false;
+      }
+      operands[i] = *operand;
+    }
+    result.code.push_back({op, operands[0], operands[1], operands[2]});
+    return true;
+  }
+
+  /// Whether `value` is a temporary that the last instruction of the block
+  /// computes and that is read only once, by the instruction being compiled
+  bool IsLastUse(TIrValue value) const {
+    if (value.kind != TIrValue::EKind::Temp || uses[value.index] != 1 || result.code.size() == blockStart) {
+      return false;
+    }
+    auto& last = result.code.back();
+    return last.op <= EVmOp::Atoi && last.a == function.vars.size() + value.index;
+  }
+
+  /// Removes the compare that computes the condition of the branch, if only
+  /// the branch reads it
+  std::optional<TVmInstr> TakeCompare(TIrValue condition, std::uint32_t reg) {
+    if (!IsLastUse(condition)) {
+      return std::nullopt;
+    }
+    auto last = result.code.back();
+    assert(last.a == reg);
+    if (last.op < EVmOp::Eq || last.op > EVmOp::Greater) {
+      return std::nullopt;
+    }
+    result.code.pop_back();
+    last.a = last.b;
+    return last;
+  }
+
+  static EVmOp JumpIfCompare(EVmOp compare, bool negate) {
+    switch (compare) {
+      case EVmOp::Eq:
+        return negate ? EVmOp::JumpIfNeq : EVmOp::JumpIfEq;
+      case EVmOp::Neq:
+        return negate ? EVmOp::JumpIfEq : EVmOp::JumpIfNeq;
+      case EVmOp::Less:
+        return negate ? EVmOp::JumpIfGreaterEq : EVmOp::JumpIfLess;
+      default:
+        assert(compare == EVmOp::Greater);
+        return negate ? EVmOp::JumpIfLessEq : EVmOp::JumpIfGreater;
+    }
+  }
+
+  std::optional<std::uint32_t> Register(TIrValue value) {
+    switch (value.kind) {
+      case TIrValue::EKind::Var:
+        if (!function.vars[value.index].assigned) {
+          spdlog::error("`{}` is never assigned", function.vars[value.index].name);
+          return std::nullopt;
+        }
+        return value.index;
+      case TIrValue::EKind::Temp:
+        return function.vars.size() + value.index;
+      case TIrValue::EKind::Const: {
+        auto [it, inserted] = constants.emplace(value.index, result.registers.size());
+        if (inserted) {
+          result.registers.push_back(value.index);
+        }
+        return it->second;
+      }
+      case TIrValue::EKind::String:
+        spdlog::error("strings can only be printed");
+        return std::nullopt;
+      case TIrValue::EKind::None:
+        break;
+    }
+    assert(false && "no value");
+    return std::nullopt;
+  }
+
+  const TIrFunction& function;
+  TBytecode result;
+  std::unordered_map<int, std::uint32_t> constants;
+  /// How many times the program reads each temporary
+  std::vector<int> uses;
+  std::size_t blockStart = 0;
+};
+
+/// The arithmetic of the C int, except that the overflow wraps around
+std::int64_t Int(std::int64_t value) { return static_cast<std::int32_t>(value); }
+
+std::int64_t Wrap(std::uint64_t value) { return static_cast<std::int32_t>(static_cast<std::uint32_t>(value)); }
+
+/// Parses the digits after the blanks and the sign, like the C runtime does.
+/// `c` is left at the byte after the number
+template <typename F>
+std::int64_t ParseInt(int& c, F&& next) {
+  bool negative = c == '-';
+  if (c == '-' || c == '+') {
+    c = next();
+  }
+  std::uint32_t value = 0;
+  for (; c >= '0' && c <= '9'; c = next()) {
+    value = value * 10 + static_cast<std::uint32_t>(c - '0');
+  }
+  return Wrap(negative ? 0u - value : value);
+}
+
+bool IsBlank(int c) { return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f'; }
+
+}  // namespace
+
+std::optional<TBytecode> CompileBytecode(const TIrFunction& function) {
+  return TBytecodeCompiler{function}.Compile();
+}
+
+bool TVmInput::Fill(TBufferedWriter& out) {
+  if (fd < 0) {
+    return false;
+  }
+  out.Flush();
+  ssize_t read = 0;
+  do {
+    read = ::read(fd, buffer.get(), BUFFER_SIZE);
+  } while (read < 0 && errno == EINTR);
+  if (read <= 0) {
+    return false;
+  }
+  data = buffer.get();
+  pos = 0;
+  len = read;
+  return true;
+}
+
+bool RunBytecode(const TBytecode& bytecode, TVmInput& input, TBufferedWriter& out) {
+  auto registers = bytecode.registers;
+  auto* r = registers.data();
+  std::string line;
+  auto noInput = [&] {
+    out.Flush();
+    spdlog::error("input: end of file");
+    return false;
+  };
+
+  for (auto* pc = bytecode.code.data();;) {
+    auto& instr = *pc++;
+    switch (instr.op) {
+      case EVmOp::Move:
+        r[instr.a] = r[instr.b];
+        break;
+      case EVmOp::Eq:
+        r[instr.a] = Int(r[instr.b]) == Int(r[instr.c]);
+        break;
+      case EVmOp::Neq:
+        r[instr.a] = Int(r[instr.b]) != Int(r[instr.c]);
+        break;
+      case EVmOp::Less:
+        r[instr.a] = Int(r[instr.b]) < Int(r[instr.c]);
+        break;
+      case EVmOp::Greater:
+        r[instr.a] = Int(r[instr.b]) > Int(r[instr.c]);
+        break;
+      case EVmOp::Minus:
+        r[instr.a] = Wrap(static_cast<std::uint64_t>(r[instr.b]) - static_cast<std::uint64_t>(r[instr.c]));
+        break;
+      case EVmOp::Plus:
+        r[instr.a] = Wrap(static_cast<std::uint64_t>(r[instr.b]) + static_cast<std::uint64_t>(r[instr.c]));
+        break;
+      case EVmOp::Mul:
+        r[instr.a] = Wrap(static_cast<std::uint64_t>(r[instr.b]) * static_cast<std::uint64_t>(r[instr.c]));
+        break;
+      case EVmOp::Not:
+        r[instr.a] = Int(r[instr.b]) == 0;
+        break;
+      case EVmOp::ReadInt: {
+        int c = input.Get(out);
+        if (c < 0) {
+          return noInput();
+        }
+        while (IsBlank(c)) {
+          c = input.Get(out);
+        }
+        r[instr.a] = ParseInt(c, [&] { return input.Get(out); });
+        // the rest of the line is skipped
+        while (c >= 0 && c != '\n') {
+          c = input.Get(out);
+        }
+        break;
+      }
+      case EVmOp::Input: {
+        int c = input.Get(out);
+        if (c < 0) {
+          return noInput();
+        }
+        // NOTE: the C buffer has 512 bytes, the longer lines are cut
+        line.clear();
+        for (; c >= 0; c = input.Get(out)) {
+          if (line.size() < 511) {
+            line.push_back(static_cast<char>(c));
+          }
+          if (c == '\n') {
+            break;
+          }
+        }
+        r[instr.a] = LINE;
+        break;
+      }
+      case EVmOp::Atoi: {
+        if (r[instr.b] != LINE) {
+          // `int` of a number is the number
+          r[instr.a] = Int(r[instr.b]);
+          break;
+        }
+        std::size_t i = 0;
+        auto next = [&]() -> int { return i < line.size() ? static_cast<unsigned char>(line[i++]) : -1; };
+        int c = next();
+        while (IsBlank(c) || c == '\n') {
+          c = next();
+        }
+        r[instr.a] = ParseInt(c, next);
+        break;
+      }
+      case EVmOp::PrintInt: {
+        char digits[16];
+        auto [end, _] = std::to_chars(std::begin(digits), std::end(digits), Int(r[instr.b]));
+        *end++ = '\n';
+        out.Write({digits, static_cast<std::size_t>(end - digits)});
+        break;
+      }
+      case EVmOp::PrintStr:
+        out.Write(bytecode.strings[instr.b]);
+        break;
+      case EVmOp::Jump:
+        pc = bytecode.code.data() + instr.b;
+        break;
+      case EVmOp::JumpIf:
+        if (Int(r[instr.a]) != 0) {
+          pc = bytecode.code.data() + instr.b;
+        }
+        break;
+      case EVmOp::JumpIfNot:
+        if (Int(r[instr.a]) == 0) {
+          pc = bytecode.code.data() + instr.b;
+        }
+        break;
+      case EVmOp::JumpIfEq:
+        if (Int(r[instr.a]) == Int(r[instr.c])) {
+          pc = bytecode.code.data() + instr.b;
+        }
+        break;
+      case EVmOp::JumpIfNeq:
+        if (Int(r[instr.a]) != Int(r[instr.c])) {
+          pc = bytecode.code.data() + instr.b;
+        }
+        break;
+      case EVmOp::JumpIfLess:
+        if (Int(r[instr.a]) < Int(r[instr.c])) {
+          pc = bytecode.code.data() + instr.b;
+        }
+        break;
+      case EVmOp::JumpIfGreater:
+        if (Int(r[instr.a]) > Int(r[instr.c])) {
+          pc = bytecode.code.data() + instr.b;
+        }
+        break;
+      case EVmOp::JumpIfLessEq:
+        if (Int(r[instr.a]) <= Int(r[instr.c])) {
+          pc = bytecode.code.data() + instr.b;
+        }
+        break;
+      case EVmOp::JumpIfGreaterEq:
+        if (Int(r[instr.a]) >= Int(r[instr.c])) {
+          pc = bytecode.code.data() + instr.b;
+        }
+        break;
+      case EVmOp::Halt:
+        return out.Flush();
+    }
+  }
+}
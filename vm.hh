@@ -0,0 +1,115 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "ir.hh"
+#include "writer.hh"
+
+/*******************************************************************************
+ *                                   Bytecode                                   *
+ *******************************************************************************/
+
+enum class EVmOp : std::uint8_t {
+  // a = b op c, named after EIrOp
+  Move,
+  Eq,
+  Neq,
+  Less,
+  Greater,
+  Minus,
+  Plus,
+  Mul,
+  Not,
+  ReadInt,
+  Input,
+  Atoi,
+  /// print(b)
+  PrintInt,
+  /// print(strings[b])
+  PrintStr,
+  /// goto b
+  Jump,
+  /// if (a) goto b
+  JumpIf,
+  /// if (!a) goto b
+  JumpIfNot,
+  // if (a op c) goto b, a compare fused with the branch on it
+  JumpIfEq,
+  JumpIfNeq,
+  JumpIfLess,
+  JumpIfGreater,
+  JumpIfLessEq,
+  JumpIfGreaterEq,
+  Halt,
+};
+
+/// The operands are register numbers, the constants are kept in registers as
+/// well, so every instruction has the same shape
+struct TVmInstr {
+  EVmOp op;
+  std::uint32_t a = 0;
+  std::uint32_t b = 0;
+  std::uint32_t c = 0;
+};
+
+/// A program compiled for RunBytecode, it can be run any number of times
+struct TBytecode {
+  std::vector<TVmInstr> code;
+  /// The values the registers start with: the variables and the temporaries
+  /// are 0, the constants follow them
+  std::vector<std::int64_t> registers;
+  std::vector<std::string> strings;
+};
+
+/// Flattens the blocks into bytecode. Logs the reason and returns nullopt for
+/// the programs the C compiler would reject: calls to unknown functions,
+/// variables that are never assigned, `for` over anything but `range(...)`
+std::optional<TBytecode> CompileBytecode(const TIrFunction& function);
+
+/*******************************************************************************
+ *                                     Run                                      *
+ *******************************************************************************/
+
+/// The stdin of the program run by the VM: reads a file descriptor through a
+/// buffer, like the C runtime, or a string
+class TVmInput {
+ public:
+  static constexpr std::size_t BUFFER_SIZE = 64 << 10;
+
+  /// Reads from `fd`, which stays open
+  explicit TVmInput(int fd_) : buffer{new char[BUFFER_SIZE]}, fd{fd_} {}
+
+  /// Reads `text`, which must outlive the input
+  explicit TVmInput(std::string_view text) : data{text.data()}, len{text.size()} {}
+
+  /// The next byte or -1 at the end. `out` is flushed before waiting for the
+  /// input, so that the prompts show up first
+  int Get(TBufferedWriter& out) {
+    if (pos == len && !Fill(out)) {
+      return -1;
+    }
+    return static_cast<unsigned char>(data[pos++]);
+  }
+
+ private:
+  bool Fill(TBufferedWriter& out);
+
+  std::unique_ptr<char[]> buffer;
+  const char* data = nullptr;
+  std::size_t pos = 0;
+  std::size_t len = 0;
+  int fd = -1;
+};
+
+/// Runs the program with the semantics of the generated C: `print` of a
+/// number adds a newline and of a string doesn't, `input()` returns a line
+/// that the next call overwrites, `int` parses like atoi. Returns false if
+/// the input ends before an `input()` (the C code aborts) or the output
+/// fails, the reason is logged
+bool RunBytecode(const TBytecode& bytecode, TVmInput& input, TBufferedWriter& out);
@@ -0,0 +1,63 @@
+#include "writer.hh"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <utility>
+
+#include <spdlog/spdlog.h>
+
+std::optional<TBufferedWriter> TBufferedWriter::Open(const std::string& path) {
+  int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    spdlog::error("can't open {}: {}", path, std::strerror(errno));
+    return std::nullopt;
+  }
+  return TBufferedWriter{fd, true};
+}
+
+TBufferedWriter::TBufferedWriter(int fd_) : TBufferedWriter{fd_, false} {}
+
+TBufferedWriter::TBufferedWriter(int fd_, bool owned_)
+    // NOTE: not make_unique, there is no need to zero the buffer
+    : buffer{new char[BUFFER_SIZE]}, fd{fd_}, owned{owned_} {}
+
+TBufferedWriter::TBufferedWriter(TBufferedWriter&& other) noexcept
+    : str{std::exchange(other.str, nullptr)},
+      buffer{std::move(other.buffer)},
+      used{std::exchange(other.used, 0)},
+      fd{std::exchange(other.fd, -1)},
+      owned{std::exchange(other.owned, false)},
+      ok{other.ok} {}
+
+TBufferedWriter::~TBufferedWriter() {
+  Flush();
+  if (owned) {
+    ::close(fd);
+  }
+}
+
+bool TBufferedWriter::Flush() {
+  if (used != 0) {
+    WriteOut({buffer.get(), used});
+    used = 0;
+  }
+  return ok;
+}
+
+void TBufferedWriter::WriteOut(std::string_view text) {
+  while (ok && !text.empty()) {
+    auto written = ::write(fd, text.data(), text.size());
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      spdlog::error("can't write the output: {}", std::strerror(errno));
+      ok = false;
+      return;
+    }
+    text.remove_prefix(written);
+  }
+}
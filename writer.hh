@@ -0,0 +1,159 @@
+#pragma once
+
+#include <cassert>
+#include <cstddef>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+
+/// Collects the output in a fixed buffer and writes it out whenever the buffer
+/// fills up, so the whole output is never held in memory. Writes to a file
+/// descriptor or appends to a string
+class TBufferedWriter {
+ public:
+  static constexpr std::size_t BUFFER_SIZE = 64 << 10;
+
+  /// Creates or truncates the file. Logs the reason and returns nullopt if it
+  /// can't be opened
+  static std::optional<TBufferedWriter> Open(const std::string& path);
+
+  /// Writes to `fd`, which stays open
+  explicit TBufferedWriter(int fd_);
+
+  /// Appends to `out` without any buffering
+  explicit TBufferedWriter(std::string& out) : str{&out} {}
+
+  TBufferedWriter(TBufferedWriter&& other) noexcept;
+  TBufferedWriter& operator=(TBufferedWriter&&) = delete;
+  TBufferedWriter(const TBufferedWriter&) = delete;
+  TBufferedWriter& operator=(const TBufferedWriter&) = delete;
+  ~TBufferedWriter();
+
+  void Write(std::string_view text) {
+    if (str) {
+      str->append(text);
+      return;
+    }
+    if (text.size() > BUFFER_SIZE - used) {
+      Flush();
+      if (text.size() >= BUFFER_SIZE) {
+        WriteOut(text);
+        return;
+      }
+    }
+    text.copy(buffer.get() + used, text.size());
+    used += text.size();
+  }
+
+  void Put(char c) {
+    if (str) {
+      str->push_back(c);
+      return;
+    }
+    if (used == BUFFER_SIZE) {
+      Flush();
+    }
+    buffer[used++] = c;
+  }
+
+  /// Writes out what's in the buffer. Returns false if any write has failed
+  /// so far (the error is logged once)
+  bool Flush();
+
+ private:
+  TBufferedWriter(int fd_, bool owned_);
+
+  void WriteOut(std::string_view text);
+
+  std::string* str = nullptr;
+  std::unique_ptr<char[]> buffer;
+  std::size_t used = 0;
+  int fd = -1;
+  bool owned = false;
+  bool ok = true;
+};
+
+/// Writes the generated code to a TBufferedWriter and indents the blocks. A
+/// block gets two more spaces in front of every line, empty lines included,
+/// and loses the newline at its very end (the template around it has one)
+class TCodeWriter {
+ public:
+  explicit TCodeWriter(TBufferedWriter& out_) : out{out_} {}
+
+  void Write(std::string_view text) {
+    while (!text.empty()) {
+      auto pos = text.find('\n');
+      if (pos != 0) {
+        if (newlineHeld) {
+          WriteNewline();
+        }
+        if (atLineStart) {
+          WriteIndent();
+        }
+        out.Write(text.substr(0, pos));
+      }
+      if (pos == std::string_view::npos) {
+        return;
+      }
+      // NOTE: the newline is held back until something follows it, it
+      // might be the last one of a block
+      if (newlineHeld) {
+        WriteNewline();
+      }
+      newlineHeld = true;
+      text.remove_prefix(pos + 1);
+    }
+  }
+
+  /// Starts a block, which must begin on a line of its own
+  void Open() {
+    if (newlineHeld) {
+      WriteNewline();
+    }
+    assert(atLineStart);
+    depth++;
+  }
+
+  void Close() {
+    assert(depth > 0);
+    newlineHeld = false;
+    // The block ends with an empty line, it's still indented
+    if (atLineStart) {
+      WriteIndent();
+    }
+    depth--;
+  }
+
+  /// Writes the newline held back at the end of the output
+  void Finish() {
+    if (newlineHeld) {
+      WriteNewline();
+    }
+  }
+
+ private:
+  void WriteNewline() {
+    if (atLineStart) {
+      WriteIndent();
+    }
+    out.Put('\n');
+    atLineStart = true;
+    newlineHeld = false;
+  }
+
+  void WriteIndent() {
+    std::size_t width = 2 * depth;
+    while (indents.size() < width) {
+      indents.append("  ");
+    }
+    out.Write({indents.data(), width});
+    atLineStart = false;
+  }
+
+  TBufferedWriter& out;
+  std::string indents;
+  std::size_t depth = 0;
+  bool atLineStart = true;
+  bool newlineHeld = false;
+};